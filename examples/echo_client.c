@@ -23,7 +23,9 @@ static char *event_names[] = {
   "msg_connection_ready",
   "msg_connection_closed",
   "msg_connection_lost",
-  "msg_error"
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
 };
 #define REQUEST_CONTENT    "yyy"
 #define MAX_RECVD_BYTES 1024  * 1
@@ -75,11 +75,14 @@ static int net_allocs[] = {0};  // Indexed by class.
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 // EWOULDBLOCK is the same as EAGAIN on mac.
@@ -167,6 +170,33 @@ static const char *make_non_blocking(int sock) {
   return NULL;  // Indicate success.
 }
 
+// Accepts a new connection as a non-blocking socket. Returns the new socket,
+// or -1 on error, in which case *failing_fn is the name of the failing system
+// call.
+// mac/linux version
+static int accept_non_blocking(int sock, struct sockaddr_in *remote_addr,
+                               const char **failing_fn) {
+  socklen_t addr_len = sizeof(*remote_addr);
+
+#ifdef SOCK_NONBLOCK
+  // On linux, accept4 saves us the fcntl calls made by make_non_blocking.
+  *failing_fn = "accept4";
+  return accept4(sock, (struct sockaddr *)remote_addr, &addr_len,
+                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  *failing_fn = "accept";
+  int new_sock = accept(sock, (struct sockaddr *)remote_addr, &addr_len);
+  if (new_sock == -1) return -1;
+
+  *failing_fn = make_non_blocking(new_sock);
+  if (*failing_fn == NULL) return new_sock;
+  int saved_errno = get_errno();
+  closesocket(new_sock);
+  set_errno(saved_errno);
+  return -1;
+#endif
+}
+
 /////
 // This section is all about avoiding SIGPIPE on sends to a broken socket.
 
@@ -198,7 +228,8 @@ static int avoid_sigpipe(int sock) {
 // mac/linux version
 static void set_conn_to_poll_mode(int index, PollMode poll_mode) {
   struct pollfd *poll_fd = array__item_ptr(poll_fds, index);
-  poll_fd->events = ((poll_mode & poll_mode_read) ? POLLIN : POLLOUT);
+  poll_fd->events = (((poll_mode & poll_mode_read)  ? POLLIN  : 0) |
+                     ((poll_mode & poll_mode_write) ? POLLOUT : 0));
 }
 
 // mac/linux version
@@ -208,7 +239,7 @@ static int check_poll_fds(int timeout_in_ms) {
 }
 
 // mac/linux version
-static PollMode poll_fds_mode(int sock, int index) {
+static PollMode poll_fds_mode(int index) {
   PollMode poll_mode = 0;
   struct pollfd *poll_fd = (struct pollfd *)array__item_ptr(poll_fds, index);
   if (poll_fd->revents & POLLIN)        poll_mode |= poll_mode_read;
@@ -218,14 +249,37 @@ static PollMode poll_fds_mode(int sock, int index) {
   return poll_mode;
 }
 
+// mac/linux version
+// Returns the first index >= start with a nonzero poll mode, or conns->count if
+// there is none. The scan reads only the contiguous pollfd items, so idle conns
+// cost no loads of their separately allocated msg_Conn structs.
+static int next_ready_conn(int start, PollMode *poll_mode) {
+  struct pollfd *poll_fd = (struct pollfd *)poll_fds->items;
+  int num_fds = poll_fds->count;
+  int i = start;
+  while (i < num_fds && poll_fd[i].revents == 0) ++i;
+  *poll_mode = (i < num_fds ? poll_fds_mode(i) : 0);
+  return i;
+}
+
+// mac/linux version
+// Waits up to timeout_in_ms for the socket to become writable.
+// Returns 1 if it's writable; 0 on timeout; -1 on error.
+static int wait_until_writable(int sock, int timeout_in_ms) {
+  struct pollfd poll_fd = { .fd = sock, .events = POLLOUT };
+  return poll(&poll_fd, 1, timeout_in_ms);
+}
+
 #else
 
 // Windows setup.
 
+#include <io.h>
 #include <process.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include "winutil.h"
+#include <afunix.h>  // This needs the types from winsock2.h and ws2def.h.
 
 // Allow void return values; useful for one-liners
 // that make a call and exit a function.
@@ -233,6 +287,7 @@ static PollMode poll_fds_mode(int sock, int index) {
 
 #define err_would_block   WSAEWOULDBLOCK
 #define err_in_progress   WSAEINPROGRESS
+#define err_invalid       WSAEINVAL
 #define err_bad_sock      WSAENOTSOCK
 #define err_intr          WSAEINTR
 #define err_conn_reset    WSAECONNRESET
@@ -240,8 +295,9 @@ static PollMode poll_fds_mode(int sock, int index) {
 #define err_conn_refused  WSAECONNREFUSED
 #define err_timed_out     WSAETIMEDOUT
 
-// Consider adding this to winutil.h.
+// Consider adding these to winutil.h.
 #define getpid _getpid
+#define unlink _unlink
 
 #define library_init library_init_()
 #define ms_call_conv __stdcall
@@ -349,6 +405,25 @@ static const char *make_non_blocking(int sock) {
   return NULL;  // Indicate success.
 }
 
+// Accepts a new connection as a non-blocking socket. Returns the new socket,
+// or -1 on error, in which case *failing_fn is the name of the failing system
+// call.
+// windows version
+static int accept_non_blocking(int sock, struct sockaddr_in *remote_addr,
+                               const char **failing_fn) {
+  socklen_t addr_len = sizeof(*remote_addr);
+  *failing_fn = "accept";
+  int new_sock = accept(sock, (struct sockaddr *)remote_addr, &addr_len);
+  if (new_sock == -1) return -1;
+
+  *failing_fn = make_non_blocking(new_sock);
+  if (*failing_fn == NULL) return new_sock;
+  int saved_errno = get_errno();
+  closesocket(new_sock);
+  set_errno(saved_errno);
+  return -1;
+}
+
 // windows version
 static int avoid_sigpipe(int sock) {
   // Do nothing; windows doesn't throw SIGPIPE on a broken socket.
@@ -372,9 +447,8 @@ static int check_poll_fds(int timeout_in_ms) {
   array__for(PollMode *, poll_mode, poll_fds.poll_modes, i) {
     msg_Conn *conn = array__item_val(conns, i, msg_Conn *);
     FD_SET(conn->socket, &poll_fds.except_fds);
-    FD_SET(conn->socket, (*poll_mode == poll_mode_read ?
-                          &poll_fds.read_fds :
-                          &poll_fds.write_fds));
+    if (*poll_mode & poll_mode_read)  FD_SET(conn->socket, &poll_fds.read_fds);
+    if (*poll_mode & poll_mode_write) FD_SET(conn->socket, &poll_fds.write_fds);
   }
 
   // Set up the timeout and call select.
@@ -391,7 +465,8 @@ static int check_poll_fds(int timeout_in_ms) {
 }
 
 // windows version
-static PollMode poll_fds_mode(int sock, int index) {
+static PollMode poll_fds_mode(int index) {
+  int sock = array__item_val(conns, index, msg_Conn *)->socket;
   PollMode poll_mode = 0;
   if (FD_ISSET(sock, &poll_fds.read_fds))   poll_mode |= poll_mode_read;
   if (FD_ISSET(sock, &poll_fds.write_fds))  poll_mode |= poll_mode_write;
@@ -399,6 +474,28 @@ static PollMode poll_fds_mode(int sock, int index) {
   return poll_mode;
 }
 
+// windows version
+// Returns the first index >= start with a nonzero poll mode, or conns->count if
+// there is none. The fd_set items are keyed by socket, so each conn is loaded.
+static int next_ready_conn(int start, PollMode *poll_mode) {
+  int i = start;
+  *poll_mode = 0;
+  while (i < conns->count && (*poll_mode = poll_fds_mode(i)) == 0) ++i;
+  return i;
+}
+
+// windows version
+// Waits up to timeout_in_ms for the socket to become writable.
+// Returns 1 if it's writable; 0 on timeout; -1 on error.
+static int wait_until_writable(int sock, int timeout_in_ms) {
+  fd_set write_fds;
+  FD_ZERO(&write_fds);
+  FD_SET(sock, &write_fds);
+  const struct timeval timeout = { timeout_in_ms / 1000,
+                                  (timeout_in_ms % 1000) * 1000 };
+  return select(0, NULL, &write_fds, NULL, &timeout);
+}
+
 #endif
 
 // Windows has dependencies around the order of included header files making
@@ -406,15 +503,166 @@ static PollMode poll_fds_mode(int sock, int index) {
 // windows-specific section.
 #include "msgbox_now.h"
 
+/////
+// This section is about udp segmentation offload, which lets the kernel split
+// one large send into many datagrams (gso), and coalesce many incoming
+// datagrams into one large recv (gro).
+
+// This is the most a single (possibly coalesced) datagram can hold.
+#define udp_max_datagram_len 65536
+
+// These limit the datagrams handed to the kernel in a single gso send.
+#define udp_max_gso_segments 64
+#define udp_max_gso_len      65507
+
+#if !defined(_WIN32) && defined(UDP_SEGMENT) && defined(UDP_GRO)
+
+#include <sys/uio.h>
+
+// linux version
+// Returns true if sock will now receive coalesced datagrams.
+static int turn_on_udp_gro(int sock) {
+  int set = 1;
+  return setsockopt(sock, SOL_UDP, UDP_GRO, &set, sizeof(set)) == 0;
+}
+
+// linux version
+// This works like recvfrom, and also sets *segment_len to the size of each
+// coalesced datagram, or to 0 if the datagram was not coalesced.
+static long recv_udp_gro(int sock, char *buffer, size_t buffer_len,
+                         struct sockaddr_in *from, int *segment_len) {
+  struct iovec iov = { .iov_base = buffer, .iov_len = buffer_len };
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg = {
+    .msg_name       = from,
+    .msg_namelen    = sizeof(*from),
+    .msg_iov        = &iov,
+    .msg_iovlen     = 1,
+    .msg_control    = control,
+    .msg_controllen = sizeof(control)
+  };
+  *segment_len = 0;
+  int default_options = 0;
+  long bytes_recvd = recvmsg(sock, &msg, default_options);
+  if (bytes_recvd == -1) return -1;
+
+  struct cmsghdr *cmsg;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      memcpy(segment_len, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+  return bytes_recvd;
+}
+
+// linux version
+// Sends the given frames as num_frames datagrams with a single system call.
+// All frames except the last must have the same length. The destination `to`
+// is NULL for connected sockets. Returns -1 on error, similar to sendmsg.
+static long send_udp_gso(int sock, struct sockaddr_in *to,
+                         char **frames, size_t *frame_lens, int num_frames) {
+  struct iovec *iov = alloca(num_frames * sizeof(struct iovec));
+  for (int i = 0; i < num_frames; ++i) {
+    iov[i] = (struct iovec) { .iov_base = frames[i], .iov_len = frame_lens[i] };
+  }
+  char control[CMSG_SPACE(sizeof(uint16_t))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg = {
+    .msg_name       = to,
+    .msg_namelen    = to ? sizeof(*to) : 0,
+    .msg_iov        = iov,
+    .msg_iovlen     = num_frames,
+    .msg_control    = control,
+    .msg_controllen = sizeof(control)
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level     = SOL_UDP;
+  cmsg->cmsg_type      = UDP_SEGMENT;
+  cmsg->cmsg_len       = CMSG_LEN(sizeof(uint16_t));
+  uint16_t segment_len = (uint16_t)frame_lens[0];
+  memcpy(CMSG_DATA(cmsg), &segment_len, sizeof(segment_len));
+  return sendmsg(sock, &msg, send_flags);
+}
+
+#else
+
+// This version is used where udp segmentation offload is unavailable.
+static int turn_on_udp_gro(int sock) {
+  return 0;  // Indicates gro is off.
+}
+
+// This version is used where udp segmentation offload is unavailable.
+static long recv_udp_gro(int sock, char *buffer, size_t buffer_len,
+                         struct sockaddr_in *from, int *segment_len) {
+  *segment_len = 0;
+  socklen_t from_len = sizeof(*from);
+  int default_options = 0;
+  return recvfrom(sock, buffer, (int)buffer_len, default_options,
+                  (struct sockaddr *)from, &from_len);
+}
+
+// This version is used where udp segmentation offload is unavailable.
+static long send_udp_gso(int sock, struct sockaddr_in *to,
+                         char **frames, size_t *frame_lens, int num_frames) {
+  set_errno(err_invalid);
+  return -1;  // The caller falls back to sending each frame by itself.
+}
+
+#endif
+
+// End udp segmentation offload section.
+/////
+
+/////
+// This section sends a datagram with a trailer, such as a checksum, without
+// first copying the datagram to make room for it.
+
+#ifndef _WIN32
+
+#include <sys/uio.h>
+
+// mac/linux version
+// Sends frame followed by trailer as one datagram. The destination `to`, of
+// to_len bytes, is NULL for connected sockets. Returns -1 on error, similar to
+// sendmsg.
+static long send_with_trailer(int sock, struct sockaddr *to, socklen_t to_len,
+                              const char *frame, size_t frame_len,
+                              const char *trailer, size_t trailer_len) {
+  struct iovec iov[2] = {
+    { .iov_base = (void *)frame,   .iov_len = frame_len   },
+    { .iov_base = (void *)trailer, .iov_len = trailer_len }
+  };
+  struct msghdr msg = {
+    .msg_name    = to,
+    .msg_namelen = to ? to_len : 0,
+    .msg_iov     = iov,
+    .msg_iovlen  = 2
+  };
+  return sendmsg(sock, &msg, send_flags);
+}
+
+#else
+
+// windows version
+static long send_with_trailer(int sock, struct sockaddr *to, socklen_t to_len,
+                              const char *frame, size_t frame_len,
+                              const char *trailer, size_t trailer_len) {
+  char *buffer = alloca(frame_len + trailer_len);
+  memcpy(buffer, frame, frame_len);
+  memcpy(buffer + frame_len, trailer, trailer_len);
+  if (to == NULL) return send(sock, buffer, (int)(frame_len + trailer_len), 0);
+  return sendto(sock, buffer, (int)(frame_len + trailer_len), 0, to, to_len);
+}
+
+#endif
+
+// End trailer section.
+/////
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //  Future work.
 
-// **. By default, all data objects sent to callbacks are dynamic and owned by
-//     us. We free them when the callback returns. Add a way for msgbox to
-//     retain ownership of a data buffer so that buffer doesn't have to
-//     be copied by the user. This doesn't have to be in v1.
-//
 // **. Try to eliminate unnamed function call parameters.
 //
 // **. Make the address info in msg_Conn an official Address object.
@@ -424,11 +672,6 @@ static PollMode poll_fds_mode(int sock, int index) {
 // **. When we receive a request, ensure that next_reply_id is above its
 //     reply_id. (This would be in read_from_socket.)
 //
-// **. Avoid blocking in send_all; instead cache data that needs to be sent and
-//     dole it out from the run loop. In practice, I can track how often this
-//     ends up as a problem (maybe how often send returns 0) and use that to
-//     prioritize things.
-//
 // **. Clean up use of num_bytes in the header for udp, as it is not used
 //     consistently now.
 //
@@ -454,6 +697,13 @@ static PollMode poll_fds_mode(int sock, int index) {
 
 #define sock_in_size sizeof(struct sockaddr_in)
 
+// A socket address of either family msgbox uses; see parse_address_str.
+typedef union {
+  struct sockaddr    any;
+  struct sockaddr_in in;
+  struct sockaddr_un un;
+} SockAddr;
+
 static msg_Data msg_no_data = { .num_bytes = 0, .bytes = NULL };
 
 typedef struct {
@@ -475,16 +725,195 @@ enum {
   msg_type_request,
   msg_type_reply,
   msg_type_heartbeat,
-  msg_type_close
+  msg_type_close,
+  msg_type_hello,
+  msg_type_fragment,
+  msg_type_channel
 };
 
+// This is the v1 header as sent, in network byte-order.
 typedef struct {
   uint16_t message_type;
   uint16_t reply_id;
   uint32_t num_bytes;
+} WireHeader;
+
+#define header_len (sizeof(WireHeader))
+
+// This is how msgbox holds any header internally, in host byte-order.
+typedef struct {
+  uint16_t message_type;
+  uint32_t reply_id;
+  uint32_t num_bytes;
 } Header;
 
-#define header_len (sizeof(Header))
+// The compact v2 header is laid out as:
+//   flags byte:   compact_flag | message_type | has_reply_id | has_extensions |
+//                 is_compressed | has_wide_reply_id
+//   num_bytes:    a varint of 1-5 bytes; 7 bits per byte, low bits first
+//   reply_id:     only if has_reply_id; network byte-order; 4 bytes if
+//                 has_wide_reply_id, and 2 bytes otherwise
+//   extensions:   a varint length, then that many bytes; only if has_extensions
+// A v1 header always begins with a zero byte, the high byte of message_type, so
+// the compact_flag bit tells the two apart. The extension bytes are one-byte
+// tags, and readers skip tags they don't know. Tags so far are
+// ext_more_replies, which marks a reply frame with more frames to follow,
+// ext_batch, which marks a one-way message whose body is a batch of messages,
+// and ext_checksum, which marks a udp datagram that ends with a checksum;
+// internally, these set the more_type_bit, batch_type_bit and
+// checksum_type_bit of message_type. A header has at most one of the first two
+// tags, and ext_checksum is only sent with udp, whose num_bytes takes at most 3
+// bytes, so a header of either kind fits in the in_place_header_len bytes of
+// the Header that ends a buffer's Metadata, and can be sent and received in
+// place.
+// Compressed bodies are only sent to remotes that have said they read them, and
+// only with compact headers; internally, a compressed message's message_type
+// has the compressed_type_bit set. Reply ids past 16 bits only go to remotes
+// that read v3 headers, as only those know the has_wide_reply_id flag, and
+// reply frames with more to follow only go to remotes that read v4 headers, and
+// batches only to remotes that read v5 headers.
+
+#define wire_version 5
+
+#define compact_flag        0x80
+#define compact_type_mask   0x07
+#define compact_has_reply   0x08
+#define compact_has_ext     0x10
+#define compact_compressed  0x20
+#define compact_wide_reply  0x40
+#define compact_known_flags 0xFF
+
+#define compressed_type_bit 0x8000
+#define more_type_bit       0x4000
+#define batch_type_bit      0x2000
+#define checksum_type_bit   0x1000
+
+#define ext_more_replies    0x01
+#define ext_batch           0x02
+#define ext_checksum        0x03
+
+#define in_place_header_len (sizeof(Header))
+#define max_extension_len   64
+#define max_wire_header_len (in_place_header_len + 5 + max_extension_len)
+
+// Writes value as a varint of 1-5 bytes and returns its length.
+static size_t write_varint(uint32_t value, uint8_t *bytes) {
+  size_t len = 0;
+  do {
+    bytes[len++] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+    value >>= 7;
+  } while (value);
+  return len;
+}
+
+// Writes the compact form of header into out and returns its length.
+static size_t encode_compact_header(Header *header, char *out) {
+  uint8_t *bytes = (uint8_t *)out;
+  size_t len = 0;
+  int is_compressed = (header->message_type & compressed_type_bit);
+  int is_wide       = (header->reply_id > UINT16_MAX);
+  int has_more      = (header->message_type & more_type_bit);
+  int is_batch      = (header->message_type & batch_type_bit);
+  assert(!(has_more && is_batch));
+  uint8_t ext_tags[2];
+  size_t  num_tags  = 0;
+  if (has_more) ext_tags[num_tags++] = ext_more_replies;
+  if (is_batch) ext_tags[num_tags++] = ext_batch;
+  if (header->message_type & checksum_type_bit) {
+    ext_tags[num_tags++] = ext_checksum;
+  }
+  bytes[len++] = (compact_flag |
+                  (header->message_type & compact_type_mask) |
+                  (header->reply_id ? compact_has_reply : 0) |
+                  (num_tags ? compact_has_ext : 0) |
+                  (is_compressed ? compact_compressed : 0) |
+                  (is_wide ? compact_wide_reply : 0));
+  len += write_varint(header->num_bytes, bytes + len);
+  if (is_wide) {
+    bytes[len++] = header->reply_id >> 24;
+    bytes[len++] = (header->reply_id >> 16) & 0xFF;
+  }
+  if (header->reply_id) {
+    bytes[len++] = (header->reply_id >> 8) & 0xFF;
+    bytes[len++] = header->reply_id & 0xFF;
+  }
+  if (num_tags) {
+    bytes[len++] = (uint8_t)num_tags;  // The varint length of the extensions.
+    for (size_t i = 0; i < num_tags; ++i) bytes[len++] = ext_tags[i];
+  }
+  return len;
+}
+
+// Reads a varint of at most 5 bytes starting at bytes[*len], advancing *len.
+// Returns 1 on success, 0 if more bytes are needed, or -1 if it's malformed.
+static int read_varint(const uint8_t *bytes, size_t num_bytes, size_t *len,
+                       uint32_t *value) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (*len == num_bytes) return 0;
+    uint8_t byte = bytes[(*len)++];
+    result |= (uint64_t)(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      if (result > UINT32_MAX) return -1;
+      *value = (uint32_t)result;
+      return 1;
+    }
+  }
+  return -1;
+}
+
+// Parses the v1 or compact header at the start of the num_bytes at bytes into
+// header, in host byte order.
+// Returns the header's length on the wire; 0 if more bytes are needed to tell;
+// or -1 if the bytes don't start with a valid header.
+static int parse_header(const char *in, size_t num_bytes, Header *header) {
+  const uint8_t *bytes = (const uint8_t *)in;
+  if (num_bytes == 0) return 0;
+
+  if (bytes[0] == 0) {
+    if (num_bytes < header_len) return 0;
+    WireHeader wire_header;
+    memcpy(&wire_header, bytes, header_len);
+    header->message_type = ntohs(wire_header.message_type);
+    header->reply_id     = ntohs(wire_header.reply_id);
+    header->num_bytes    = ntohl(wire_header.num_bytes);
+    return header_len;
+  }
+
+  uint8_t flags = bytes[0];
+  if ((flags & compact_flag) == 0 || (flags & ~compact_known_flags)) return -1;
+  header->message_type = flags & compact_type_mask;
+  if (flags & compact_compressed) header->message_type |= compressed_type_bit;
+  header->reply_id     = 0;
+  size_t len = 1;
+  int ret = read_varint(bytes, num_bytes, &len, &header->num_bytes);
+  if (ret != 1) return ret;
+  if (flags & compact_has_reply) {
+    size_t id_len = (flags & compact_wide_reply) ? 4 : 2;
+    if (num_bytes < len + id_len) return 0;
+    for (size_t i = 0; i < id_len; ++i) {
+      header->reply_id = (header->reply_id << 8) | bytes[len++];
+    }
+  }
+  if (flags & compact_has_ext) {
+    uint32_t ext_len;
+    ret = read_varint(bytes, num_bytes, &len, &ext_len);
+    if (ret != 1) return ret;
+    if (ext_len > max_extension_len) return -1;
+    if (num_bytes < len + ext_len) return 0;
+    for (size_t i = 0; i < ext_len; ++i) {
+      if (bytes[len + i] == ext_more_replies) {
+        header->message_type |= more_type_bit;
+      }
+      if (bytes[len + i] == ext_batch) header->message_type |= batch_type_bit;
+      if (bytes[len + i] == ext_checksum) {
+        header->message_type |= checksum_type_bit;
+      }
+    }
+    len += ext_len;
+  }
+  return (int)len;
+}
 
 typedef struct {
   uint32_t ip;    // Stored in network byte-order.
@@ -493,16 +922,226 @@ typedef struct {
 } Address;
 
 // Metadata is the preamble for a msg_Data buffer.
-// The non-header fields are used by listening udp sockets,
-// for which we must hold state across many remotes.
+// The reply_context and remote_address fields are used by listening udp
+// sockets, for which we must hold state across many remotes.
+// The header is last so that it immediately precedes the data bytes; the
+// 16-bit fields leave no padding before it.
 typedef struct {
   void *  reply_context;
   Address remote_address;
+  size_t  ref_count;     // The buffer is freed when this drops to zero.
+  size_t  chunk_offset;  // Used by msg_message_chunk data.
+  int16_t size_class;    // The buffer's data pool, or no_size_class.
+  int16_t header_size;   // The wire length of the header set by set_header.
   Header  header;
 } Metadata;
 
 #define metadata_len (sizeof(Metadata))
 
+static Metadata *metadata_of_data(msg_Data data) {
+  return (Metadata *)(data.bytes - metadata_len);
+}
+
+static size_t wire_header_size(msg_Data data) {
+  return metadata_of_data(data)->header_size;
+}
+
+// Every msg_Conn made by msgbox is the first member of a ConnExtra, which holds
+// per-connection state that's private to msgbox.
+typedef struct {
+  msg_Conn            conn;
+  msg_SocketOptions   options;      // Accepted tcp sockets inherit these.
+  int                 has_udp_gro;  // True if datagrams may arrive coalesced.
+
+  // A conn with a single remote owns that remote's status, which is set once
+  // the connection is ready. Listening udp conns keep theirs in conn_status.
+  struct ConnStatus * status;
+
+  // Tcp frames waiting for the socket to be writable; the frames before
+  // next_out_frame have been sent. out_frames is NULL until first needed.
+  Array               out_frames;
+  int                 next_out_frame;
+
+  // The path of a unix domain socket's address, or NULL for inet sockets. A
+  // unixgram client binds its own socket to a path made from this one and its
+  // local_address; see set_unix_sockaddr.
+  char *              unix_path;
+  Address             local_address;
+} ConnExtra;
+
+// An outgoing tcp frame that couldn't be sent right away. The frame holds a
+// reference to its data, and its own copy of the header since the same data may
+// be sent elsewhere with a different header in the meantime. As with data, the
+// header_size wire bytes of the header end at the end of the header field.
+typedef struct {
+  msg_Data data;
+  char     header[in_place_header_len];
+  size_t   header_size;
+  size_t   num_sent;  // The number of header and data bytes already sent.
+} OutFrame;
+
+static ConnExtra *extra_of_conn(msg_Conn *conn) {
+  return (ConnExtra *)conn;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Data pools.
+
+// msg_Data buffers, including their Metadata, are carved out of slabs in
+// power-of-two size classes. Freed buffers go onto a free list for their size
+// class to be reused. Each thread has its own pools, so no locking is needed; a
+// buffer released on another thread joins that thread's pools. Slabs are kept
+// for the life of the process. Larger buffers come directly from malloc.
+
+#ifdef _WIN32
+#define per_thread __declspec(thread)
+#else
+#define per_thread __thread
+#endif
+
+#define min_class_shift  6   // The smallest size class holds 64 bytes.
+#define num_size_classes 11  // The largest size class holds 64KB.
+#define no_size_class    -1
+#define slab_size        (1 << 17)
+
+typedef struct FreeBuffer {
+  struct FreeBuffer *next;
+} FreeBuffer;
+
+static per_thread FreeBuffer *   free_buffers[num_size_classes];
+static per_thread msg_PoolStats  pool_stats;
+
+static size_t class_size(int size_class) {
+  return (size_t)1 << (size_class + min_class_shift);
+}
+
+// Returns the smallest size class with room for num_bytes, or no_size_class.
+static int size_class_of(size_t num_bytes) {
+  for (int size_class = 0; size_class < num_size_classes; ++size_class) {
+    if (num_bytes <= class_size(size_class)) return size_class;
+  }
+  return no_size_class;
+}
+
+// Carves a new slab into buffers for the given size class. Returns false if
+// the memory isn't available.
+static int add_slab(int size_class) {
+  size_t buffer_size = class_size(size_class);
+  char * slab        = dbgcheck__malloc(slab_size, "msg_Data slab");
+  if (slab == NULL) return false;
+  for (size_t offset = 0; offset < slab_size; offset += buffer_size) {
+    FreeBuffer *buffer = (FreeBuffer *)(slab + offset);
+    buffer->next = free_buffers[size_class];
+    free_buffers[size_class] = buffer;
+  }
+  pool_stats.pool_bytes += slab_size;
+  return true;
+}
+
+// Returns NULL if the memory isn't available.
+static char *alloc_buffer(size_t num_bytes, int size_class) {
+  pool_stats.num_allocs++;
+  if (size_class == no_size_class) {
+    pool_stats.num_large_allocs++;
+    return dbgcheck__malloc(num_bytes, "msg_Data bytes");
+  }
+  if (free_buffers[size_class]) {
+    pool_stats.num_pool_hits++;
+  } else if (!add_slab(size_class)) {
+    return NULL;
+  }
+  FreeBuffer *buffer = free_buffers[size_class];
+  free_buffers[size_class] = buffer->next;
+  return (char *)buffer;
+}
+
+static void free_buffer(char *buffer, int size_class) {
+  if (size_class == no_size_class) {
+    return dbgcheck__free(buffer, "msg_Data bytes");
+  }
+  FreeBuffer *free_buffer = (FreeBuffer *)buffer;
+  free_buffer->next = free_buffers[size_class];
+  free_buffers[size_class] = free_buffer;
+}
+
+// This is msg_new_data_space for callers that can cope without the memory; it
+// returns msg_no_data if the memory isn't available.
+static msg_Data try_new_data_space(size_t num_bytes) {
+  int size_class = size_class_of(num_bytes + metadata_len);
+  char *buffer   = alloc_buffer(num_bytes + metadata_len, size_class);
+  if (buffer == NULL) return msg_no_data;
+  msg_Data data  = {.num_bytes = num_bytes, .bytes = buffer + metadata_len};
+  Metadata *metadata      = metadata_of_data(data);
+  metadata->reply_context = NULL;
+  metadata->ref_count     = 1;
+  metadata->size_class    = size_class;
+  metadata->header_size   = header_len;
+  return data;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Object pools.
+
+// Per-connection objects - msg_Conn (allocated as a ConnExtra) and ConnStatus -
+// are recycled through these pools so that connection setup and
+// teardown usually avoid the allocator. A pool keeps every object returned to
+// it, and starts out with msg_config.conn_pool_size objects.
+
+typedef struct {
+  Array       free_objects;  // The items have type void *.
+  size_t      object_size;
+  const char *set_name;
+} ObjectPool;
+
+static ObjectPool conn_pool = { NULL, sizeof(ConnExtra), "msg_Conn" };
+
+static void init_object_pool(ObjectPool *pool, int num_objects) {
+  pool->free_objects = array__new(num_objects > 8 ? num_objects : 8,
+                                  sizeof(void *));
+  for (int i = 0; i < num_objects; ++i) {
+    void *object = dbgcheck__calloc(pool->object_size, pool->set_name);
+    array__add_item_val(pool->free_objects, object);
+  }
+}
+
+// New objects are zeroed; recycled objects are left as they were freed.
+static void *alloc_object(ObjectPool *pool) {
+  Array free_objects = pool->free_objects;
+  if (free_objects->count == 0) {
+    return dbgcheck__calloc(pool->object_size, pool->set_name);
+  }
+  void *object = array__item_val(free_objects, free_objects->count - 1, void *);
+  array__remove_last(free_objects);
+  return object;
+}
+
+static void free_object(ObjectPool *pool, void *object) {
+  array__add_item_val(pool->free_objects, object);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Memory budget.
+
+// msgbox accounts for the memory it holds on behalf of remotes in the
+// categories of msg_MemoryStats, and sheds load once their total would pass
+// msg_config.memory_budget.
+
+static msg_MemoryStats memory_stats;
+
+static size_t memory_in_use() {
+  return (memory_stats.incoming_bytes + memory_stats.pending_call_bytes +
+          memory_stats.outgoing_bytes + memory_stats.status_bytes);
+}
+
+// Returns true if holding num_bytes more would exceed the memory budget.
+static int is_over_budget(size_t num_bytes) {
+  size_t budget = msg_config.memory_budget;
+  return budget && memory_in_use() + num_bytes > budget;
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //  Connection status map.
@@ -521,84 +1160,339 @@ char *address_as_str(Address *address) {
   return address_str;
 }
 
-int address_hash(void *address) {
-  char *bytes = (char *)address;
-  int hash = 0;
-  for (int i = 0; i < sizeof(Address); ++i) {
-    hash *= 234;
-    hash += bytes[i];
-  }
-  return hash;
-}
-
-int address_eq(void *addr1, void *addr2) {
-  return memcmp(addr1, addr2, sizeof(Address)) == 0;
-}
+// An outstanding msg_get. Reply ids start at 1 and skip 0 when they wrap
+// around, so a reply_id of 0 marks an unused slot.
+typedef struct {
+  void *   reply_context;
+  uint32_t reply_id;
+} ReplySlot;
 
-int reply_id_hash(void *reply_id) {
-  return (int)(intptr_t)reply_id;
-}
+// A udp message being put back together from its fragments. data.bytes is NULL
+// when the slot is unused.
+typedef struct {
+  uint32_t message_id;
+  Header   header;         // The whole message's header, in host byte order.
+  msg_Data data;
+  uint8_t *received;       // A flag per fragment.
+  size_t   fragment_len;   // The size of every fragment but the last.
+  int      num_fragments;
+  int      num_received;
+  double   started_at;
+} Reassembly;
 
-int reply_id_eq(void *reply_id1, void *reply_id2) {
-  uint16_t id1 = (intptr_t)reply_id1;
-  uint16_t id2 = (intptr_t)reply_id2;
-  return id1 == id2;
-}
+#define min_reply_slots 8
+#define max_reply_slots (1 << 16)  // The widest window of pending reply ids.
 
-typedef struct {
+typedef struct ConnStatus {
   double   last_seen_at;
-  Map      reply_contexts;  // Map reply_id -> reply_context.
   void *   conn_context;    // Useful for listening udp conns.
-  uint16_t next_reply_id;
+  msg_ConnId conn_id;       // The conn that talks with this remote.
+  int      beat_index;      // The index in out_beats, or -1 if it's not there.
+  int      is_recent;       // Set by each message; cleared by the evict_hand.
+  uint32_t next_reply_id;
   Address  remote_address;
 
+  // The remote reads compact headers once it has sent a hello with a
+  // peer_version of 2 or more; sent_hello is true once we've sent ours. A hello
+  // we offer over udp is resent until the remote's arrives; num_offers counts
+  // the hellos we've sent that weren't answers.
+  int      peer_version;
+  int      sent_hello;
+  int      num_offers;
+  double   offer_sent_at;
+
+  // The remote reads compressed bodies once its hello says so, and holds the
+  // dictionary with the given id, or 0 if none. We compress what we send it
+  // while compress is true; it starts as msg_config.compression.
+  int      peer_reads_compressed;
+  uint32_t peer_dictionary_id;
+  int      compress;
+
+  // The remote checks the checksums of udp datagrams once its hello says so.
+  int      peer_reads_checksums;
+
+  // Outstanding msg_get calls; the one with a given reply_id is always at index
+  // reply_id & (num_reply_slots - 1). num_reply_slots is a power of two.
+  ReplySlot *reply_slots;
+  int        num_reply_slots;
+  int        num_replies_pending;
+
   // These overlap; waiting_buffer is a suffix of total_buffer.
   msg_Data total_buffer;
   msg_Data waiting_buffer;
+
+  // These track a tcp message delivered as msg_message_chunk events;
+  // stream_chunk_size is 0 when no message is being streamed.
+  size_t   stream_chunk_size;
+  void *   stream_reply_context;
+  int      stream_is_discarded;
+
+  // Incoming fragmented udp messages; reassemblies has max_reassemblies slots,
+  // and is NULL until the first fragment arrives.
+  Reassembly *reassemblies;
+  int         num_reassemblies;
+
+  // Small outgoing messages waiting to be sent together as one batch, which
+  // holds batch_len bytes of wire headers and bodies; batch.bytes is NULL when
+  // nothing is waiting. The batch is sent once it's full or at batch_due_at.
+  msg_Data batch;
+  size_t   batch_len;
+  double   batch_due_at;
+
+  // The state of each delivery channel, by channel number; channels has
+  // max_channels items, each NULL until that channel is used, and is itself
+  // NULL until the first channel is used.
+  struct Channel **channels;
 } ConnStatus;
 
+static ObjectPool conn_status_pool = { NULL, sizeof(ConnStatus), "ConnStatus" };
+
 ConnStatus *new_conn_status(double now, Address *address) {
-  ConnStatus *status     = dbgcheck__calloc(sizeof(ConnStatus), "ConnStatus");
-  status->last_seen_at   = now;
-  status->reply_contexts = map__new(reply_id_hash, reply_id_eq);
-  status->next_reply_id  = 1;
+  ConnStatus *status     = alloc_object(&conn_status_pool);
+
+  // A recycled ConnStatus keeps its empty reply slots.
+  ReplySlot *reply_slots     = status->reply_slots;
+  int        num_reply_slots = status->num_reply_slots;
+  memset(status, 0, sizeof(ConnStatus));
+  if (reply_slots == NULL) {
+    num_reply_slots = min_reply_slots;
+    reply_slots     = dbgcheck__calloc(num_reply_slots * sizeof(ReplySlot),
+                                       "ReplySlot");
+  }
+
+  status->last_seen_at    = now;
+  status->beat_index      = -1;
+  status->peer_version    = 1;
+  status->compress        = msg_config.compression;
+  status->reply_slots     = reply_slots;
+  status->num_reply_slots = num_reply_slots;
+  memory_stats.status_bytes += (sizeof(ConnStatus) +
+                                num_reply_slots * sizeof(ReplySlot));
+  status->next_reply_id   = 1;
   status->remote_address = *address;
   return status;
 }
 
-static void new_conn_status_buffer(ConnStatus *status, Header *header) {
-  status->total_buffer = status->waiting_buffer =
-      msg_new_data_space(header->num_bytes);
-  memcpy(status->total_buffer.bytes - header_len, header, header_len);
+// Sets up the buffer for the part of a message starting at chunk_offset.
+// Streamed messages use a buffer of at most stream_chunk_size bytes.
+static void new_conn_status_buffer(ConnStatus *status, Header *header,
+                                   size_t chunk_offset) {
+  size_t num_bytes = header->num_bytes - chunk_offset;
+  if (status->stream_chunk_size && num_bytes > status->stream_chunk_size) {
+    num_bytes = status->stream_chunk_size;
+  }
+  status->total_buffer = status->waiting_buffer = msg_new_data_space(num_bytes);
+  metadata_of_data(status->total_buffer)->header       = *header;
+  metadata_of_data(status->total_buffer)->chunk_offset = chunk_offset;
+  memory_stats.incoming_bytes += num_bytes;
 }
 
-static void delete_conn_status_buffer(ConnStatus *status) {
-  msg_delete_data(status->total_buffer);
+// Hands off ownership of the buffer of a completely received message.
+static msg_Data take_conn_status_buffer(ConnStatus *status) {
+  msg_Data data = status->total_buffer;
+  memory_stats.incoming_bytes -= data.num_bytes;
   status->total_buffer = status->waiting_buffer =
       (msg_Data) { .num_bytes = 0, .bytes = NULL };
+  return data;
+}
+
+static void delete_conn_status_buffer(ConnStatus *status) {
+  msg_delete_data(take_conn_status_buffer(status));
 }
 
-static void delete_conn_status(void *status_v_ptr, void *context) {
-  ConnStatus *status = (ConnStatus *)status_v_ptr;
-  // This should be empty since we need to give the user a chance to free all
-  // contexts.
-  assert(status->reply_contexts->count == 0);
-  map__delete(status->reply_contexts);
-  // TODO Should we delete the ConnStatus itself here?
-  // If yes, do it. Otherwise leave a comment explaining why not.
+static void remove_timeouts_of_status(ConnStatus *status);  // Defined below.
+
+static void drop_reassemblies(ConnStatus *status);  // Defined below.
+
+static void drop_channels(ConnStatus *status);  // Defined below.
+
+static void remove_from_out_beats(ConnStatus *status);  // Defined below.
+
+static void drop_batch(ConnStatus *status);  // Defined below.
+
+static void delete_conn_status(ConnStatus *status) {
+  // Pending gets are usually failed by local_disconnect first, which gives the
+  // user a chance to free their contexts.
+  if (status->num_replies_pending) remove_timeouts_of_status(status);
+  // Drop any partially-received messages.
+  if (status->total_buffer.bytes) delete_conn_status_buffer(status);
+  if (status->reassemblies) drop_reassemblies(status);
+  if (status->channels) drop_channels(status);
+  if (status->beat_index != -1) remove_from_out_beats(status);
+  if (status->batch.bytes) drop_batch(status);
+  memory_stats.status_bytes -= (sizeof(ConnStatus) +
+                                status->num_reply_slots * sizeof(ReplySlot));
+  free_object(&conn_status_pool, status);
+}
+
+// The statuses with a batch waiting to be sent; see send_message.
+static Array batch_statuses = NULL;  // Items have type ConnStatus *.
+
+// This maps Address -> ConnStatus * for the remotes of listening udp conns, and
+// owns those ConnStatus objects.
+// It's an open-addressing table with linear probing, keyed by each Address
+// packed into a uint64_t. A key of 0 marks an empty entry; no Address packs to
+// 0 since protocol_type is never 0.
+
+typedef struct {
+  uint64_t    key;
+  ConnStatus *status;
+} StatusEntry;
+
+#define min_status_entries 64
+
+static StatusEntry *conn_status           = NULL;
+static size_t       num_conn_status_slots = 0;  // Always a power of two.
+static size_t       num_conn_statuses     = 0;
+
+static uint64_t key_of_address(Address *address) {
+  uint64_t key;
+  memcpy(&key, address, sizeof(key));
+  return key;
+}
+
+// This is the 64-bit finalizer from MurmurHash3, which mixes every input bit
+// into every output bit; nearby addresses end up far apart.
+static size_t hash_of_key(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return (size_t)key;
+}
+
+static void init_conn_status(size_t num_slots) {
+  conn_status           = dbgcheck__calloc(num_slots * sizeof(StatusEntry),
+                                           "StatusEntry");
+  num_conn_status_slots = num_slots;
+  num_conn_statuses     = 0;
+}
+
+// Returns the entry for key, or the empty entry where key belongs.
+static StatusEntry *find_status_entry(uint64_t key) {
+  size_t mask = num_conn_status_slots - 1;
+  for (size_t i = hash_of_key(key) & mask;; i = (i + 1) & mask) {
+    StatusEntry *entry = conn_status + i;
+    if (entry->key == key || entry->key == 0) return entry;
+  }
+}
+
+// Returns NULL if the given remote address has no associated status.
+static ConnStatus *get_conn_status(Address *address) {
+  return find_status_entry(key_of_address(address))->status;
+}
+
+static void set_conn_status(Address *address, ConnStatus *status) {
+  // Keep the table at most 3/4 full.
+  if (4 * (num_conn_statuses + 1) > 3 * num_conn_status_slots) {
+    StatusEntry *old_entries   = conn_status;
+    size_t       old_num_slots = num_conn_status_slots;
+    size_t       num_statuses  = num_conn_statuses;
+    init_conn_status(2 * old_num_slots);
+    for (size_t i = 0; i < old_num_slots; ++i) {
+      if (old_entries[i].key) {
+        *find_status_entry(old_entries[i].key) = old_entries[i];
+      }
+    }
+    num_conn_statuses = num_statuses;
+    dbgcheck__free(old_entries, "StatusEntry");
+  }
+
+  uint64_t key = key_of_address(address);
+  StatusEntry *entry = find_status_entry(key);
+  if (entry->key == 0) num_conn_statuses++;
+  entry->key    = key;
+  entry->status = status;
+}
+
+// Drops and deletes the status of the given address, if it has one.
+static void unset_conn_status(Address *address) {
+  StatusEntry *entry = find_status_entry(key_of_address(address));
+  if (entry->key == 0) return;
+  delete_conn_status(entry->status);
+  num_conn_statuses--;
+
+  // Shift later entries back into the hole so that every entry stays reachable
+  // from its home slot without passing an empty entry.
+  size_t mask = num_conn_status_slots - 1;
+  size_t hole = entry - conn_status;
+  for (size_t i = (hole + 1) & mask; conn_status[i].key; i = (i + 1) & mask) {
+    size_t home = hash_of_key(conn_status[i].key) & mask;
+    // Entry i may move iff its home is not cyclically within (hole, i].
+    int can_move = (hole < i) ? (home <= hole || home > i) :
+                                (home <= hole && home > i);
+    if (can_move) {
+      conn_status[hole] = conn_status[i];
+      hole = i;
+    }
+  }
+  conn_status[hole] = (StatusEntry) { .key = 0, .status = NULL };
 }
 
-// This maps Address -> ConnStatus.
-// The actual keys & values are pointers to those types,
-// and the releasers free them.
-// TODO Once heartbeats is added, let heartbeats own the ConnStatus objects.
-static Map conn_status = NULL;
+static int is_listening_udp(msg_Conn *conn) {
+  return conn->for_listening && conn->protocol_type == msg_udp;
+}
 
 // Returns NULL if the given remote address has no associated status.
 ConnStatus *status_of_conn(msg_Conn *conn) {
-  Address *address = (Address *)(&conn->remote_ip);
-  map__key_value *pair = map__get(conn_status, address);
-  return pair ? (ConnStatus *)pair->value : NULL;
+  if (!is_listening_udp(conn)) return extra_of_conn(conn)->status;
+  return get_conn_status(address_of_conn(conn));
+}
+
+// Versions of msgbox from before the hello don't read the frame types added
+// since - fragments, channel frames and heartbeats - so these are only sent to
+// remotes that have sent a hello.
+static int peer_sent_hello(ConnStatus *status) {
+  return status && status->peer_version >= 2;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Conn ids.
+
+// This slot map hands out the msg_ConnId of each conn. An id holds a slot index
+// in its low 32 bits and that slot's generation in its high 32 bits. The
+// generation changes when the conn is freed, so the ids of freed conns no
+// longer match. Generations start at 1, so no id is 0 (msg_no_conn_id).
+
+typedef struct {
+  msg_Conn *conn;        // NULL when the slot is free.
+  uint32_t  generation;
+} ConnSlot;
+
+static Array conn_slots      = NULL;  // ConnSlot items, indexed by id.
+static Array free_conn_slots = NULL;  // int items; indexes of free slots.
+
+static msg_ConnId new_conn_id(msg_Conn *conn) {
+  int index;
+  if (free_conn_slots->count) {
+    index = array__item_val(free_conn_slots, free_conn_slots->count - 1, int);
+    array__remove_last(free_conn_slots);
+  } else {
+    index = conn_slots->count;
+    array__new_val(conn_slots, ConnSlot) = (ConnSlot) { NULL, 1 };
+  }
+  ConnSlot *slot = array__item_ptr(conn_slots, index);
+  slot->conn = conn;
+  return ((msg_ConnId)slot->generation << 32) | (uint32_t)index;
+}
+
+static void release_conn_id(msg_ConnId id) {
+  int index = (uint32_t)id;
+  ConnSlot *slot = array__item_ptr(conn_slots, index);
+  assert(slot->conn && slot->generation == (uint32_t)(id >> 32));
+  slot->conn = NULL;
+  if (++slot->generation == 0) slot->generation = 1;
+  array__add_item_val(free_conn_slots, index);
+}
+
+// Returns NULL if id is not the id of a live conn.
+static msg_Conn *conn_of_id(msg_ConnId id) {
+  uint32_t index = (uint32_t)id;
+  if (conn_slots == NULL || index >= conn_slots->count) return NULL;
+  ConnSlot *slot = array__item_ptr(conn_slots, index);
+  return slot->generation == (uint32_t)(id >> 32) ? slot->conn : NULL;
 }
 
 
@@ -609,26 +1503,26 @@ ConnStatus *status_of_conn(msg_Conn *conn) {
 
 typedef struct {
   double      at;
-  msg_Conn *  conn;
+  msg_ConnId  conn_id;
   ConnStatus *status;
-  uint16_t    reply_id;
+  uint32_t    reply_id;
 } Timeout;
 
 static Array timeouts = NULL;  // Items have type Timeout.
 
 #define make_timeout(a, c, s, r) \
-    ((Timeout){ .at = a, .conn = c, .status = s, .reply_id = r })
+    ((Timeout){ .at = a, .conn_id = c, .status = s, .reply_id = r })
 
-static void add_timeout(msg_Conn *conn, ConnStatus *status, uint16_t reply_id) {
+static void add_timeout(msg_Conn *conn, ConnStatus *status, uint32_t reply_id) {
   // This is called from msg_get, which takes responsibility for making sure
   // status exists.
   double timeout_at = now() + udp_timeout_sec;
-  array__new_val(timeouts, Timeout) = make_timeout(timeout_at, conn,
+  array__new_val(timeouts, Timeout) = make_timeout(timeout_at, conn->id,
                                                    status, reply_id);
 }
 
 // Remove the given timeout if it can be found.
-static void remove_timeout(ConnStatus *status, uint16_t reply_id) {
+static void remove_timeout(ConnStatus *status, uint32_t reply_id) {
   array__for(Timeout *, timeout, timeouts, i) {
     if (timeout->status != status || timeout->reply_id != reply_id) continue;
     // At this point, we've found the given timeout.
@@ -637,19 +1531,827 @@ static void remove_timeout(ConnStatus *status, uint16_t reply_id) {
   }
 }
 
-
-///////////////////////////////////////////////////////////////////////////////
-//  Debugging functions.
-
-static void print_bytes(char *bytes, size_t num_to_print) {
-  printf("bytes (%zd) :", num_to_print);
-  for (size_t i = 0; i < num_to_print; ++i) {
-    printf(" 0x%02X", bytes[i]);
+// Remove all timeouts of the given status, which is about to be deleted.
+static void remove_timeouts_of_status(ConnStatus *status) {
+  array__for(Timeout *, timeout, timeouts, i) {
+    if (timeout->status != status) continue;
+    array__remove_item(timeouts, timeout);
+    i--;  // Back up one item so the next iteration gets the next item.
   }
-  printf("\n");
 }
 
-// This is purposefully *not* static, so it may be called externally by
+// Doubles the reply slots of status until the given reply_id's slot is free.
+// Returns false, changing nothing, if that would take over max_reply_slots.
+static int grow_reply_slots(ConnStatus *status, uint32_t reply_id) {
+  int        old_num_slots = status->num_reply_slots;
+  ReplySlot *old_slots     = status->reply_slots;
+  int        num_slots     = old_num_slots;
+
+  // Pending ids are distinct modulo old_num_slots, so they stay distinct modulo
+  // any larger power of two. We only need to look for room for reply_id.
+  int has_room = false;
+  while (!has_room) {
+    num_slots *= 2;
+    if (num_slots > max_reply_slots) return false;
+    int index = reply_id & (num_slots - 1);
+    has_room  = (old_slots[index & (old_num_slots - 1)].reply_id &
+                 (num_slots - 1)) != index;
+  }
+
+  ReplySlot *slots = dbgcheck__calloc(num_slots * sizeof(ReplySlot),
+                                      "ReplySlot");
+  for (int i = 0; i < old_num_slots; ++i) {
+    uint32_t id = old_slots[i].reply_id;
+    if (id) slots[id & (num_slots - 1)] = old_slots[i];
+  }
+  dbgcheck__free(old_slots, "ReplySlot");
+  memory_stats.status_bytes += (num_slots - old_num_slots) * sizeof(ReplySlot);
+
+  status->reply_slots     = slots;
+  status->num_reply_slots = num_slots;
+  return true;
+}
+
+// Remembers the reply_context of a new msg_get. Returns false if reply_id's
+// slot is still held by an earlier msg_get with max_reply_slots slots - that
+// is, if the pending ids would span more than max_reply_slots ids.
+static int add_reply_context(ConnStatus *status, uint32_t reply_id,
+                             void *reply_context) {
+  ReplySlot *slot = &status->reply_slots[reply_id &
+                                         (status->num_reply_slots - 1)];
+  if (slot->reply_id == reply_id) return false;
+  if (slot->reply_id) {
+    if (!grow_reply_slots(status, reply_id)) return false;
+    slot = &status->reply_slots[reply_id & (status->num_reply_slots - 1)];
+  }
+  slot->reply_id      = reply_id;
+  slot->reply_context = reply_context;
+  status->num_replies_pending++;
+  return true;
+}
+
+// Finds and forgets the reply_context of an outstanding msg_get.
+// Returns true on success; false if reply_id is not outstanding.
+static int take_reply_slot(ConnStatus *status, uint32_t reply_id,
+                           void **reply_context) {
+  ReplySlot *slot = &status->reply_slots[reply_id &
+                                         (status->num_reply_slots - 1)];
+  if (reply_id == 0 || slot->reply_id != reply_id) return false;
+  *reply_context = slot->reply_context;
+  slot->reply_id = 0;
+  status->num_replies_pending--;
+  return true;
+}
+
+// This is take_reply_slot for an incoming reply, which also drops the timeout.
+static int take_reply_context(ConnStatus *status, uint32_t reply_id,
+                              void **reply_context) {
+  if (!take_reply_slot(status, reply_id, reply_context)) return false;
+  remove_timeout(status, reply_id);
+  return true;
+}
+
+// Finds the reply_context of an outstanding msg_get for an incoming reply frame
+// with more to follow. The msg_get stays outstanding, and its timeout restarts.
+// Returns true on success; false if reply_id is not outstanding.
+static int peek_reply_context(msg_Conn *conn, ConnStatus *status,
+                              uint32_t reply_id, void **reply_context) {
+  ReplySlot *slot = &status->reply_slots[reply_id &
+                                         (status->num_reply_slots - 1)];
+  if (reply_id == 0 || slot->reply_id != reply_id) return false;
+  *reply_context = slot->reply_context;
+  // The restarted timeout is the latest one, so it goes at the end.
+  remove_timeout(status, reply_id);
+  add_timeout(conn, status, reply_id);
+  return true;
+}
+
+// Looks up the reply_context for an incoming reply with the given message_type,
+// keeping the msg_get outstanding if more frames are to follow.
+static int find_reply_context(msg_Conn *conn, ConnStatus *status,
+                              uint16_t message_type, uint32_t reply_id,
+                              void **reply_context) {
+  if (message_type & more_type_bit) {
+    return peek_reply_context(conn, status, reply_id, reply_context);
+  }
+  return take_reply_context(status, reply_id, reply_context);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Fragment reassembly.
+
+// Udp messages too large for a single datagram are sent as fragments, each a
+// datagram of type msg_type_fragment. The body of a fragment begins with this
+// header, in network byte-order; the rest of the body is the num_bytes of the
+// message at offset.
+typedef struct {
+  uint32_t message_id;
+  uint16_t index;
+  uint16_t num_fragments;
+  uint32_t offset;
+  uint16_t message_type;  // These three fields describe the whole message.
+  uint16_t reply_id;      // A wider one is in the fragment's own header.
+  uint32_t num_bytes;
+} FragmentHeader;
+
+#define fragment_header_len (sizeof(FragmentHeader))
+
+// These bound the memory held for incomplete messages. A remote may have this
+// many messages in reassembly at once; a new one replaces the oldest.
+#define max_reassemblies       4
+#define reassembly_timeout_sec 2
+
+// msg_config.udp_fragment_size is raised to at least this.
+#define min_fragment_len 512
+
+typedef struct {
+  double      at;
+  ConnStatus *status;
+  uint32_t    message_id;
+} ReassemblyTimeout;
+
+// These items are soonest-first since every reassembly gets the same timeout.
+static Array reassembly_timeouts = NULL;  // Items have type ReassemblyTimeout.
+
+// Returns NULL if status has no reassembly of the given message.
+static Reassembly *find_reassembly(ConnStatus *status, uint32_t message_id) {
+  if (status->reassemblies == NULL) return NULL;
+  for (int i = 0; i < max_reassemblies; ++i) {
+    Reassembly *reassembly = &status->reassemblies[i];
+    if (reassembly->data.bytes && reassembly->message_id == message_id) {
+      return reassembly;
+    }
+  }
+  return NULL;
+}
+
+// Frees the bookkeeping of reassembly and its slot; the caller is responsible
+// for its data.
+static void end_reassembly(ConnStatus *status, Reassembly *reassembly) {
+  array__for(ReassemblyTimeout *, timeout, reassembly_timeouts, i) {
+    if (timeout->status     != status ||
+        timeout->message_id != reassembly->message_id) continue;
+    array__remove_item(reassembly_timeouts, timeout);
+    break;
+  }
+  memory_stats.incoming_bytes -= (reassembly->data.num_bytes +
+                                  reassembly->num_fragments);
+  dbgcheck__free(reassembly->received, "Reassembly.received");
+  reassembly->received   = NULL;
+  reassembly->data.bytes = NULL;
+  status->num_reassemblies--;
+}
+
+static void drop_reassembly(ConnStatus *status, Reassembly *reassembly) {
+  msg_Data data = reassembly->data;
+  end_reassembly(status, reassembly);
+  msg_delete_data(data);
+}
+
+// Drops all of the reassemblies of status, which is about to be deleted.
+static void drop_reassemblies(ConnStatus *status) {
+  for (int i = 0; i < max_reassemblies; ++i) {
+    Reassembly *reassembly = &status->reassemblies[i];
+    if (reassembly->data.bytes) drop_reassembly(status, reassembly);
+  }
+  dbgcheck__free(status->reassemblies, "Reassembly");
+  status->reassemblies = NULL;
+}
+
+// Returns NULL if the memory for the reassembly isn't available.
+static Reassembly *new_reassembly(ConnStatus *status, uint32_t message_id,
+                                  Header *header, int num_fragments,
+                                  size_t fragment_len) {
+  if (status->reassemblies == NULL) {
+    status->reassemblies = dbgcheck__calloc(
+        max_reassemblies * sizeof(Reassembly), "Reassembly");
+    if (status->reassemblies == NULL) return NULL;
+  }
+  msg_Data data     = try_new_data_space(header->num_bytes);
+  uint8_t *received = NULL;
+  if (data.bytes) {
+    received = dbgcheck__calloc(num_fragments, "Reassembly.received");
+  }
+  if (received == NULL) {
+    if (data.bytes) msg_delete_data(data);
+    return NULL;
+  }
+
+  // Use a free slot, or else replace the oldest reassembly.
+  Reassembly *reassembly = &status->reassemblies[0];
+  for (int i = 0; i < max_reassemblies; ++i) {
+    Reassembly *slot = &status->reassemblies[i];
+    if (slot->data.bytes == NULL) {
+      reassembly = slot;
+      break;
+    }
+    if (slot->started_at < reassembly->started_at) reassembly = slot;
+  }
+  if (reassembly->data.bytes) drop_reassembly(status, reassembly);
+
+  double time_now = now();
+  *reassembly = (Reassembly) {
+    .message_id    = message_id,
+    .header        = *header,
+    .data          = data,
+    .received      = received,
+    .fragment_len  = fragment_len,
+    .num_fragments = num_fragments,
+    .num_received  = 0,
+    .started_at    = time_now
+  };
+  status->num_reassemblies++;
+  memory_stats.incoming_bytes += header->num_bytes + num_fragments;
+
+  array__new_val(reassembly_timeouts, ReassemblyTimeout) = (ReassemblyTimeout) {
+    .at         = time_now + reassembly_timeout_sec,
+    .status     = status,
+    .message_id = message_id
+  };
+  return reassembly;
+}
+
+// Drops the reassemblies that have waited too long for their missing fragments.
+static void drop_stale_reassemblies(double time_now) {
+  while (reassembly_timeouts->count) {
+    ReassemblyTimeout *timeout = array__item_ptr(reassembly_timeouts, 0);
+    if (timeout->at > time_now) break;
+    Reassembly *reassembly = find_reassembly(timeout->status,
+                                             timeout->message_id);
+    // A timeout is removed along with its reassembly, so this should exist.
+    assert(reassembly);
+    if (reassembly == NULL) {
+      array__remove_item(reassembly_timeouts, timeout);
+      continue;
+    }
+    drop_reassembly(timeout->status, reassembly);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Delivery channels.
+
+// msg_send_on_channel sends udp messages on numbered channels. Each channel
+// carries a reliable-ordered stream and an unreliable-sequenced stream, each
+// with its own sequence numbers starting at 1. A channel message is a datagram
+// of type msg_type_channel whose body begins with this header, in network
+// byte-order. Every channel message, including a bare ack, acknowledges the
+// reliable messages received on its channel: all sequences up to ack have
+// arrived, and bit i of ack_bits is set if ack + 2 + i has also arrived.
+typedef struct {
+  uint8_t  delivery;  // A msg_Delivery value; msg_unreliable for a bare ack.
+  uint8_t  channel;
+  uint16_t unused;
+  uint32_t sequence;
+  uint32_t ack;
+  uint32_t ack_bits;
+} ChannelHeader;
+
+#define channel_header_len (sizeof(ChannelHeader))
+
+#define max_channels 16
+
+// A sender has at most this many reliable messages per channel in flight; later
+// ones wait until earlier ones are acknowledged. The receiver holds early
+// arrivals within the same window, so this is also the width of ack_bits.
+#define reliable_window 32
+
+// Unacknowledged messages are resent after min_resend_sec, and the wait doubles
+// with each resend up to max_resend_sec. Resends continue until
+// msg_config.reliable_timeout, when the remote is lost.
+#define min_resend_sec 0.1
+#define max_resend_sec 1.0
+
+// An outgoing reliable message; data is the whole frame, starting with its
+// ChannelHeader. num_sends is 0 until the window has room for it.
+typedef struct {
+  msg_Data data;
+  uint32_t sequence;
+  int      num_sends;
+  double   sent_at;
+  double   queued_at;  // When msg_send_on_channel was called.
+} ReliableMessage;
+
+typedef struct Channel {
+  // Outgoing.
+  uint32_t next_reliable;   // The sequence of the next reliable message.
+  uint32_t next_sequenced;  // The sequence of the next sequenced message.
+  Array    unacked;         // ReliableMessage items, in sequence order.
+
+  // Incoming.
+  uint32_t next_expected;     // Reliable messages before this were delivered.
+  uint32_t newest_sequenced;  // Older sequenced messages are dropped.
+  int      ack_pending;       // True if the remote is owed an ack.
+
+  // Reliable messages that arrived early, at index sequence % reliable_window;
+  // held_sequences[i] is 0 if there's no message at index i.
+  msg_Data held[reliable_window];
+  uint32_t held_sequences[reliable_window];
+} Channel;
+
+// The statuses with any channels. The run loop sends their queued messages,
+// resends and acks from here.
+static Array channel_statuses = NULL;  // Items have type ConnStatus *.
+
+// Returns true if sequence a comes before b, allowing for wraparound.
+static int is_before(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) < 0;
+}
+
+// Returns the given channel of status, setting it up if needed.
+static Channel *channel_of_status(ConnStatus *status, int index) {
+  if (status->channels == NULL) {
+    status->channels = dbgcheck__calloc(max_channels * sizeof(Channel *),
+                                        "Channel array");
+    memory_stats.status_bytes += max_channels * sizeof(Channel *);
+    array__add_item_val(channel_statuses, status);
+  }
+  Channel *channel = status->channels[index];
+  if (channel == NULL) {
+    channel = dbgcheck__calloc(sizeof(Channel), "Channel");
+    channel->next_reliable  = 1;
+    channel->next_sequenced = 1;
+    channel->next_expected  = 1;
+    channel->unacked        = array__new(8, sizeof(ReliableMessage));
+    memory_stats.status_bytes += sizeof(Channel);
+    status->channels[index] = channel;
+  }
+  return channel;
+}
+
+// Sets the ack fields, in host byte order, that describe what has arrived on
+// channel.
+static void get_acks(Channel *channel, uint32_t *ack, uint32_t *ack_bits) {
+  *ack      = channel->next_expected - 1;
+  *ack_bits = 0;
+  for (int i = 0; i < reliable_window; ++i) {
+    uint32_t sequence = *ack + 2 + i;
+    if (channel->held_sequences[sequence % reliable_window] == sequence) {
+      *ack_bits |= (uint32_t)1 << i;
+    }
+  }
+}
+
+static int is_acked(uint32_t sequence, uint32_t ack, uint32_t ack_bits) {
+  if (!is_before(ack, sequence)) return true;
+  uint32_t bit = sequence - ack - 2;
+  return bit < reliable_window && (ack_bits & ((uint32_t)1 << bit));
+}
+
+// Forgets the outgoing reliable messages acknowledged by an incoming message.
+static void receive_acks(Channel *channel, uint32_t ack, uint32_t ack_bits) {
+  array__for(ReliableMessage *, message, channel->unacked, i) {
+    if (message->num_sends == 0) break;  // This and later ones are unsent.
+    if (!is_acked(message->sequence, ack, ack_bits)) continue;
+    memory_stats.outgoing_bytes -= message->data.num_bytes;
+    msg_delete_data(message->data);
+    array__remove_item(channel->unacked, message);
+    i--;  // Back up one item so the next iteration gets the next item.
+  }
+}
+
+static void delete_channel(Channel *channel) {
+  array__for(ReliableMessage *, message, channel->unacked, i) {
+    memory_stats.outgoing_bytes -= message->data.num_bytes;
+    msg_delete_data(message->data);
+  }
+  array__delete(channel->unacked);
+  for (int i = 0; i < reliable_window; ++i) {
+    if (channel->held_sequences[i] == 0) continue;
+    memory_stats.incoming_bytes -= channel->held[i].num_bytes;
+    msg_delete_data(channel->held[i]);
+  }
+  memory_stats.status_bytes -= sizeof(Channel);
+  dbgcheck__free(channel, "Channel");
+}
+
+// Drops all of the channels of status, which is about to be deleted.
+static void drop_channels(ConnStatus *status) {
+  for (int i = 0; i < max_channels; ++i) {
+    if (status->channels[i]) delete_channel(status->channels[i]);
+  }
+  dbgcheck__free(status->channels, "Channel array");
+  status->channels = NULL;
+  memory_stats.status_bytes -= max_channels * sizeof(Channel *);
+
+  array__for(ConnStatus **, status_ptr, channel_statuses, i) {
+    if (*status_ptr != status) continue;
+    array__remove_and_fill(channel_statuses, i);
+    break;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Heartbeats.
+
+// Every udp remote is in the out_beats rotation. Each run loop visits the next
+// few remotes, enough that every remote is visited about once per
+// msg_config.heartbeat_interval, so heartbeats to many remotes go out a few at
+// a time rather than in bursts. A visit sends a heartbeat to a remote that's
+// been quiet for an interval, and reports a remote quiet for
+// max_missed_heartbeats intervals as lost.
+
+// The body of a heartbeat is a single byte. A ping asks the remote to answer
+// with a pong, so only one side needs heartbeats turned on.
+#define heartbeat_pong 0
+#define heartbeat_ping 1
+
+static Array  out_beats     = NULL;  // Items have type ConnStatus *.
+static int    next_beat     = 0;     // The rotation runs from the end down.
+static double beats_owed    = 0.0;   // The visits due, including fractions.
+static double last_beats_at = 0.0;
+
+// The remotes of listening udp conns are evicted once they've been idle for
+// msg_config.udp_idle_ttl, or as needed to stay within max_udp_remotes. This is
+// done by a second hand sweeping through out_beats, in the same direction as
+// the heartbeat rotation. It's a clock sweep: a remote that's sent a message
+// since the hand last passed it is spared once, so the least recently heard
+// from remotes are evicted first.
+static int    evict_hand     = 0;
+static double sweeps_owed    = 0.0;
+static double last_sweeps_at = 0.0;
+
+static void add_to_out_beats(ConnStatus *status) {
+  status->beat_index = out_beats->count;
+  array__add_item_val(out_beats, status);
+}
+
+// The last status moves into the removed one's place. The rotation runs from
+// the end of out_beats down to index 0, so a move never causes a skipped visit.
+static void remove_from_out_beats(ConnStatus *status) {
+  int index = status->beat_index;
+  array__remove_and_fill(out_beats, index);
+  if (index < out_beats->count) {
+    array__item_val(out_beats, index, ConnStatus *)->beat_index = index;
+  }
+  status->beat_index = -1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Compression.
+
+// Message bodies are compressed with a small LZ77 codec that writes lz4's block
+// format: sequences of a token byte, literal bytes, a 2-byte offset, and a
+// match length. Decompressing it is little more than a series of memcpy calls.
+// A compressed body is laid out as:
+//   flags byte:   uses_dictionary
+//   num_bytes:    a varint; the length of the original body
+//   the lz4 block
+// The optional msg_config.compression_dictionary acts as if it came just before
+// every body, so that short messages can refer to strings typical of them. Only
+// its last lz_max_offset bytes are reachable.
+
+#define lz_hash_bits      12
+#define lz_min_match      4
+#define lz_max_offset     65535
+#define lz_last_literals  5   // A block ends with at least this many literals.
+#define lz_match_margin   12  // No match starts this close to the end.
+
+#define compressed_uses_dictionary 0x01
+
+// Messages shorter than this are never compressed; there's too little to gain.
+#define min_compressed_len 16
+
+// A dictionary and body are copied together here to be compressed.
+static per_thread uint8_t *lz_scratch      = NULL;
+static per_thread size_t   lz_scratch_size = 0;
+
+static uint32_t read_u32(const uint8_t *bytes) {
+  uint32_t value;
+  memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+static size_t lz_hash(uint32_t value) {
+  return (value * 2654435761u) >> (32 - lz_hash_bits);
+}
+
+// Writes the part of a length beyond a token's 4 bits as a run of 255s and a
+// final smaller byte. Returns the new out position, or 0 if out is full.
+static size_t write_lz_length(size_t len, uint8_t *out, size_t pos,
+                              size_t cap) {
+  for (; len >= 255; len -= 255) {
+    if (pos == cap) return 0;
+    out[pos++] = 255;
+  }
+  if (pos == cap) return 0;
+  out[pos++] = (uint8_t)len;
+  return pos;
+}
+
+// Reads the extra bytes of a length into *len. Returns false if src ends first.
+static int read_lz_length(const uint8_t *src, size_t src_len, size_t *in,
+                          size_t *len) {
+  uint8_t byte;
+  do {
+    if (*in == src_len) return false;
+    byte  = src[(*in)++];
+    *len += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// Writes the given literals followed by a match, or by nothing when match_len
+// is 0. Returns the new out position, or 0 if out is full.
+static size_t write_lz_sequence(const uint8_t *literals, size_t num_literals,
+                                size_t offset, size_t match_len,
+                                uint8_t *out, size_t pos, size_t cap) {
+  size_t match_code = match_len ? match_len - lz_min_match : 0;
+  if (pos == cap) return 0;
+  out[pos++] = ((num_literals < 15 ? num_literals : 15) << 4 |
+                (match_code   < 15 ? match_code   : 15));
+  if (num_literals >= 15) {
+    pos = write_lz_length(num_literals - 15, out, pos, cap);
+    if (pos == 0) return 0;
+  }
+  if (num_literals > cap - pos) return 0;
+  memcpy(out + pos, literals, num_literals);
+  pos += num_literals;
+  if (match_len == 0) return pos;
+
+  if (cap - pos < 2) return 0;
+  out[pos++] = offset & 0xFF;
+  out[pos++] = offset >> 8;
+  if (match_code >= 15) pos = write_lz_length(match_code - 15, out, pos, cap);
+  return pos;
+}
+
+// Compresses src[start, end) into an lz4 block of at most out_cap bytes; the
+// bytes before start are a dictionary that matches may refer to. Returns the
+// block's length, or 0 if it doesn't fit.
+static size_t lz_compress(const uint8_t *src, size_t start, size_t end,
+                          uint8_t *out, size_t out_cap) {
+  uint32_t table[1 << lz_hash_bits];  // Positions plus 1; 0 means empty.
+  memset(table, 0, sizeof(table));
+  size_t p = start > lz_max_offset ? start - lz_max_offset : 0;
+  for (; p + lz_min_match <= start; ++p) {
+    table[lz_hash(read_u32(src + p))] = (uint32_t)p + 1;
+  }
+
+  size_t pos    = 0;
+  size_t anchor = start;
+  size_t limit  = end - start > lz_match_margin ? end - lz_match_margin : start;
+  for (p = start; p < limit;) {
+    uint32_t value = read_u32(src + p);
+    size_t   hash  = lz_hash(value);
+    size_t   match = table[hash];
+    table[hash] = (uint32_t)p + 1;
+    if (match-- == 0 || p - match > lz_max_offset ||
+        read_u32(src + match) != value) {
+      // Skip ahead faster the longer nothing has matched.
+      p += 1 + ((p - anchor) >> 6);
+      continue;
+    }
+
+    size_t len = lz_min_match;
+    size_t max_len = end - lz_last_literals - p;
+    while (len < max_len && src[match + len] == src[p + len]) len++;
+    pos = write_lz_sequence(src + anchor, p - anchor, p - match, len,
+                            out, pos, out_cap);
+    if (pos == 0) return 0;
+    p     += len;
+    anchor = p;
+  }
+  return write_lz_sequence(src + anchor, end - anchor, 0, 0, out, pos, out_cap);
+}
+
+// Decompresses the lz4 block src into out, which it must fill exactly; matches
+// may refer to the dict_len bytes of dict. Returns false if src is malformed.
+static int lz_decompress(const uint8_t *src, size_t src_len,
+                         uint8_t *out, size_t out_len,
+                         const uint8_t *dict, size_t dict_len) {
+  size_t in  = 0;
+  size_t pos = 0;
+  while (in < src_len) {
+    uint8_t token = src[in++];
+    size_t num_literals = token >> 4;
+    if (num_literals == 15 &&
+        !read_lz_length(src, src_len, &in, &num_literals)) {
+      return false;
+    }
+    if (num_literals > src_len - in || num_literals > out_len - pos) {
+      return false;
+    }
+    memcpy(out + pos, src + in, num_literals);
+    in  += num_literals;
+    pos += num_literals;
+    if (in == src_len) break;  // The last sequence has no match.
+
+    if (src_len - in < 2) return false;
+    size_t offset = src[in] | (src[in + 1] << 8);
+    in += 2;
+    size_t match_len = token & 0x0F;
+    if (match_len == 15 && !read_lz_length(src, src_len, &in, &match_len)) {
+      return false;
+    }
+    match_len += lz_min_match;
+    if (offset == 0 || offset > pos + dict_len || match_len > out_len - pos) {
+      return false;
+    }
+
+    // A match may begin in the dictionary, and may overlap its own output.
+    for (; match_len && offset > pos; --match_len, ++pos) {
+      out[pos] = dict[dict_len - (offset - pos)];
+    }
+    if (offset >= match_len) {
+      memcpy(out + pos, out + pos - offset, match_len);
+      pos += match_len;
+    } else {
+      for (; match_len; --match_len, ++pos) out[pos] = out[pos - offset];
+    }
+  }
+  return pos == out_len;
+}
+
+// Returns the reachable tail of the dictionary, setting *len to its length.
+static const uint8_t *dictionary(size_t *len) {
+  const char *dict = msg_config.compression_dictionary;
+  size_t      size = dict ? msg_config.compression_dictionary_size : 0;
+  *len = size < lz_max_offset ? size : lz_max_offset;
+  return (const uint8_t *)dict + (size - *len);
+}
+
+// Returns an FNV-1a hash of the dictionary, or 0 if there is none. A hello
+// carries this so both sides can tell if they hold the same dictionary.
+static uint32_t dictionary_id() {
+  static const uint8_t *hashed_dict = NULL;
+  static size_t         hashed_len  = 0;
+  static uint32_t       id          = 0;
+
+  size_t len;
+  const uint8_t *dict = dictionary(&len);
+  if (len == 0) return 0;
+  if (dict == hashed_dict && len == hashed_len) return id;
+
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; ++i) hash = (hash ^ dict[i]) * 16777619u;
+  hashed_dict = dict;
+  hashed_len  = len;
+  id          = hash ? hash : 1;
+  return id;
+}
+
+// Writes the compressed body of the num_bytes at bytes into out, as laid out
+// above. Returns its length, or 0 if it wouldn't be shorter than out_cap or the
+// scratch memory for a dictionary isn't available; the message is then sent
+// uncompressed.
+static size_t compress_body(const char *bytes, size_t num_bytes,
+                            int use_dictionary, uint8_t *out, size_t out_cap) {
+  size_t len = 0;
+  out[len++] = use_dictionary ? compressed_uses_dictionary : 0;
+  len += write_varint((uint32_t)num_bytes, out + len);
+  if (len >= out_cap) return 0;
+
+  const uint8_t *src = (const uint8_t *)bytes;
+  size_t dict_len    = 0;
+  if (use_dictionary) {
+    const uint8_t *dict = dictionary(&dict_len);
+    if (dict_len + num_bytes > lz_scratch_size) {
+      dbgcheck__free(lz_scratch, "lz_scratch");
+      lz_scratch_size = dict_len + num_bytes;
+      lz_scratch      = dbgcheck__malloc(lz_scratch_size, "lz_scratch");
+      if (lz_scratch == NULL) {
+        lz_scratch_size = 0;
+        return 0;
+      }
+    }
+    memcpy(lz_scratch, dict, dict_len);
+    memcpy(lz_scratch + dict_len, bytes, num_bytes);
+    src = lz_scratch;
+  }
+  size_t block_len = lz_compress(src, dict_len, dict_len + num_bytes,
+                                 out + len, out_cap - len);
+  return block_len ? len + block_len : 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Checksums.
+
+// Udp datagrams may end with a crc32c of their header and body, which catches
+// the corruption that slips past udp's 16-bit checksum. Cpus with sse4.2 have a
+// crc32c instruction, which is used when the running cpu has it; otherwise,
+// the slice-by-8 tables below process 8 bytes per step. Both give the same
+// result on any byte order.
+
+#define crc32c_poly  0x82F63B78  // The Castagnoli polynomial, bit-reversed.
+#define checksum_len 4
+
+// crc_tables[k][b] is the crc of byte b followed by k zero bytes.
+static uint32_t crc_tables[8][256];
+
+static void init_crc_tables() {
+  for (int i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; ++j) {
+      crc = (crc >> 1) ^ ((crc & 1) ? crc32c_poly : 0);
+    }
+    crc_tables[0][i] = crc;
+  }
+  for (int k = 1; k < 8; ++k) {
+    for (int i = 0; i < 256; ++i) {
+      uint32_t prev = crc_tables[k - 1][i];
+      crc_tables[k][i] = (prev >> 8) ^ crc_tables[0][prev & 0xFF];
+    }
+  }
+}
+
+// Continues the crc32c of earlier bytes, whose crc is crc, over len more bytes.
+static uint32_t crc32c_tables(uint32_t crc, const uint8_t *bytes, size_t len) {
+  crc = ~crc;
+  for (; len >= 8; bytes += 8, len -= 8) {
+    uint32_t low = crc ^ (bytes[0]                  | (uint32_t)bytes[1] << 8 |
+                          (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24);
+    crc = (crc_tables[7][low & 0xFF]         ^
+           crc_tables[6][(low >> 8) & 0xFF]  ^
+           crc_tables[5][(low >> 16) & 0xFF] ^
+           crc_tables[4][low >> 24]          ^
+           crc_tables[3][bytes[4]]           ^
+           crc_tables[2][bytes[5]]           ^
+           crc_tables[1][bytes[6]]           ^
+           crc_tables[0][bytes[7]]);
+  }
+  while (len--) crc = (crc >> 8) ^ crc_tables[0][(crc ^ *bytes++) & 0xFF];
+  return ~crc;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <nmmintrin.h>
+
+// x86 version
+// This is crc32c_tables using the sse4.2 crc32 instruction. It's compiled for
+// sse4.2 on its own, so only call it when the cpu has sse4.2.
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const uint8_t *bytes,
+                                size_t len) {
+  crc = ~crc;
+#ifdef __x86_64__
+  uint64_t crc64 = crc;
+  for (; len >= 8; bytes += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+#endif
+  for (; len >= 4; bytes += 4, len -= 4) {
+    uint32_t word;
+    memcpy(&word, bytes, sizeof(word));
+    crc = _mm_crc32_u32(crc, word);
+  }
+  while (len--) crc = _mm_crc32_u8(crc, *bytes++);
+  return ~crc;
+}
+
+// x86 version
+static int has_crc32c_hardware() {
+  return __builtin_cpu_supports("sse4.2");
+}
+
+#else
+
+// This version is used where there's no crc32c instruction.
+#define crc32c_hardware crc32c_tables
+
+// This version is used where there's no crc32c instruction.
+static int has_crc32c_hardware() {
+  return false;
+}
+
+#endif
+
+typedef uint32_t (*Crc32cFunction)(uint32_t crc, const uint8_t *bytes,
+                                   size_t len);
+
+static Crc32cFunction crc32c_function = NULL;
+
+// Returns the crc32c of len bytes, continuing from crc, which is 0 to start.
+static uint32_t crc32c(uint32_t crc, const void *bytes, size_t len) {
+  if (crc32c_function == NULL) {
+    init_crc_tables();
+    crc32c_function = has_crc32c_hardware() ? crc32c_hardware : crc32c_tables;
+  }
+  return crc32c_function(crc, (const uint8_t *)bytes, len);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Debugging functions.
+
+static void print_bytes(char *bytes, size_t num_to_print) {
+  printf("bytes (%zd) :", num_to_print);
+  for (size_t i = 0; i < num_to_print; ++i) {
+    printf(" 0x%02X", bytes[i]);
+  }
+  printf("\n");
+}
+
+// This is purposefully *not* static, so it may be called externally by
 // programs that know of it. It only gives useful data when msgbox is
 // compiled with DEBUG defined.
 int net_allocs_for_class(int class) { return net_allocs[class]; }
@@ -658,400 +2360,2132 @@ int net_allocs_for_class(int class) { return net_allocs[class]; }
 ///////////////////////////////////////////////////////////////////////////////
 //  Internal functions.
 
-static void set_sockaddr_for_conn(struct sockaddr_in *sockaddr,
-                                  msg_Conn *conn) {
+// A unixgram client binds its socket to the path of its listener followed by
+// ".<pid>.<n>", where n counts the unixgram clients of its process, so that the
+// listener can reply. The listener reads the path back as the client's Address,
+// with the pid as its ip and n as its port. Pids are below 2^24, so these ips
+// are in 0.0.0.0/8, which no inet datagram comes from, and never match the
+// Address of a udp remote in conn_status.
+
+#define max_unix_suffix_len 15  // The length of ".<pid>.<n>" at its longest.
+#define max_unix_pid        0xFFFFFF
+
+// Sets up sockaddr for the unix socket at path, or, if client is not NULL, for
+// the unixgram client of the listener at path with that Address. Returns the
+// length of sockaddr.
+static socklen_t set_unix_sockaddr(SockAddr *sockaddr, const char *path,
+                                   Address *client) {
+  memset(sockaddr, 0, sizeof(struct sockaddr_un));
+  sockaddr->un.sun_family = AF_UNIX;
+  size_t path_size = sizeof(sockaddr->un.sun_path);
+  if (client) {
+    snprintf(sockaddr->un.sun_path, path_size, "%s.%u.%u",
+             path, ntohl(client->ip), client->port);
+  } else {
+    snprintf(sockaddr->un.sun_path, path_size, "%s", path);
+  }
+  return sizeof(struct sockaddr_un);
+}
+
+// Sets up sockaddr for conn's current remote. Returns the length of sockaddr.
+static socklen_t set_sockaddr_for_conn(SockAddr *sockaddr, msg_Conn *conn) {
+  char *unix_path = extra_of_conn(conn)->unix_path;
+  if (unix_path) {
+    return set_unix_sockaddr(sockaddr, unix_path, address_of_conn(conn));
+  }
   memset(sockaddr, 0, sock_in_size);
-  sockaddr->sin_family = AF_INET;
-  sockaddr->sin_port = htons(conn->remote_port);
-  sockaddr->sin_addr.s_addr = conn->remote_ip;
+  sockaddr->in.sin_family      = AF_INET;
+  sockaddr->in.sin_port        = htons(conn->remote_port);
+  sockaddr->in.sin_addr.s_addr = conn->remote_ip;
+  return sock_in_size;
+}
+
+// Sets conn's remote address to that of a datagram's sender, which is sockaddr,
+// of sockaddr_len bytes. Returns false if the sender is a unix socket that a
+// listening conn can't reply to, in which case the datagram is to be dropped.
+static int set_remote_of_conn(msg_Conn *conn, SockAddr *sockaddr,
+                              socklen_t sockaddr_len) {
+  char *unix_path = extra_of_conn(conn)->unix_path;
+  if (unix_path == NULL) {
+    conn->remote_ip   = sockaddr->in.sin_addr.s_addr;
+    conn->remote_port = ntohs(sockaddr->in.sin_port);
+    return true;
+  }
+
+  // A unixgram client only hears from its listener, whose address it keeps.
+  if (!conn->for_listening) return true;
+
+  // The sender's path may fill sun_path with no terminating null.
+  char   sender_path[sizeof(sockaddr->un.sun_path) + 1] = "";
+  size_t path_offset = sockaddr->un.sun_path - (char *)sockaddr;
+  if (sockaddr_len > path_offset) {
+    memcpy(sender_path, sockaddr->un.sun_path, sockaddr_len - path_offset);
+  }
+
+  size_t   path_len = strlen(unix_path);
+  unsigned pid, n;
+  int      suffix_len = 0;
+  if (strncmp(sender_path, unix_path, path_len) != 0 ||
+      sscanf(sender_path + path_len, ".%u.%u%n", &pid, &n, &suffix_len) != 2 ||
+      sender_path[path_len + suffix_len] != '\0' ||
+      pid > max_unix_pid || n > UINT16_MAX) {
+    return false;
+  }
+  conn->remote_ip   = htonl(pid);
+  conn->remote_port = n;
+  return true;
+}
+
+// Binds a unixgram client's socket to its own path so that its listener can
+// reply. Returns -1 on error; 0 on success, similar to a system call.
+static int bind_unix_client(msg_Conn *conn) {
+  static uint16_t num_unix_clients = 0;
+  ConnExtra *extra = extra_of_conn(conn);
+  extra->local_address = (Address) {
+    .ip            = htonl(getpid() & max_unix_pid),
+    .port          = ++num_unix_clients,
+    .protocol_type = msg_udp };
+  SockAddr  sockaddr;
+  socklen_t sockaddr_len = set_unix_sockaddr(&sockaddr, extra->unix_path,
+                                             &extra->local_address);
+  // A client that ended without closing may have left its file behind.
+  unlink(sockaddr.un.sun_path);
+  return bind(conn->socket, &sockaddr.any, sockaddr_len);
+}
+
+// Removes the file of a unix socket that conn has bound: a listener's, or a
+// unixgram client's own.
+static void unlink_bound_path(msg_Conn *conn) {
+  ConnExtra *extra = extra_of_conn(conn);
+  if (extra->unix_path == NULL) return;
+  if (conn->for_listening) {
+    unlink(extra->unix_path);
+  } else if (extra->local_address.ip) {
+    SockAddr sockaddr;
+    set_unix_sockaddr(&sockaddr, extra->unix_path, &extra->local_address);
+    unlink(sockaddr.un.sun_path);
+  }
+}
+
+static char *new_unix_path(const char *path) {
+  size_t num_bytes = strlen(path) + 1;
+  char *unix_path = dbgcheck__malloc(num_bytes, "unix path");
+  memcpy(unix_path, path, num_bytes);
+  return unix_path;
 }
 
 // Returns -1 on error; 0 on success, similar to a system call.
-static int send_all(int socket, msg_Data data) {
-  data.bytes     -= header_len;
-  data.num_bytes += header_len;
+static int set_int_option(int sock, int level, int name, int value) {
+  // Send (char *)&value as windows takes a char*; mac/linux takes a void*.
+  return setsockopt(sock, level, name, (char *)&value, sizeof(value));
+}
+
+// Applies the nonzero fields of options to sock, which belongs to conn or was
+// accepted by it. Returns no_error (NULL) on success; otherwise returns a
+// description of the failing call, and get_errno() returns the error code.
+// Options that the os doesn't support, or that don't apply to sock, are
+// skipped.
+static const char *apply_socket_options(int sock, msg_Conn *conn,
+                                        const msg_SocketOptions *options) {
+  int is_inet = (extra_of_conn(conn)->unix_path == NULL);
+  int is_tcp  = (is_inet && conn->protocol_type == msg_tcp);
+
+  if (is_tcp && options->tcp_nodelay &&
+      set_int_option(sock, IPPROTO_TCP, TCP_NODELAY, 1)) {
+    return "setsockopt(TCP_NODELAY)";
+  }
+
+#ifdef TCP_QUICKACK
+  if (is_tcp && options->tcp_quickack &&
+      set_int_option(sock, IPPROTO_TCP, TCP_QUICKACK, 1)) {
+    return "setsockopt(TCP_QUICKACK)";
+  }
+#endif
+
+  if (options->recv_buffer_size &&
+      set_int_option(sock, SOL_SOCKET, SO_RCVBUF, options->recv_buffer_size)) {
+    return "setsockopt(SO_RCVBUF)";
+  }
+
+  if (options->send_buffer_size &&
+      set_int_option(sock, SOL_SOCKET, SO_SNDBUF, options->send_buffer_size)) {
+    return "setsockopt(SO_SNDBUF)";
+  }
+
+  if (is_inet && options->tos &&
+      set_int_option(sock, IPPROTO_IP, IP_TOS, options->tos)) {
+    return "setsockopt(IP_TOS)";
+  }
+
+#ifdef SO_PRIORITY
+  if (options->priority &&
+      set_int_option(sock, SOL_SOCKET, SO_PRIORITY, options->priority)) {
+    return "setsockopt(SO_PRIORITY)";
+  }
+#endif
+
+  return no_error;
+}
 
-  while (data.num_bytes > 0) {
-    long just_sent = send(socket, data.bytes, data.num_bytes, send_flags);
-    if (just_sent == -1 && get_errno() == err_would_block) continue;
-    if (just_sent == -1) return -1;
-    data.bytes     += just_sent;
-    data.num_bytes -= just_sent;
+// The kernel turns TCP_QUICKACK back off as it sees fit, so we turn it on again
+// after each read on connections that want it.
+static void rearm_quickack(msg_Conn *conn) {
+#ifdef TCP_QUICKACK
+  ConnExtra *extra = extra_of_conn(conn);
+  if (extra->options.tcp_quickack && extra->unix_path == NULL) {
+    set_int_option(conn->socket, IPPROTO_TCP, TCP_QUICKACK, 1);
+  }
+#endif
+}
+
+static int has_out_frames(msg_Conn *conn) {
+  ConnExtra *extra = extra_of_conn(conn);
+  return extra->out_frames && extra->next_out_frame < extra->out_frames->count;
+}
+
+// Sends as much of the queued frames as the socket will take, and releases the
+// data of each frame that's completely sent.
+// Returns -1 on error; 0 on success, similar to a system call.
+static int send_out_frames(msg_Conn *conn) {
+  ConnExtra *extra = extra_of_conn(conn);
+  Array out_frames = extra->out_frames;
+
+  while (extra->next_out_frame < out_frames->count) {
+    OutFrame *frame = array__item_ptr(out_frames, extra->next_out_frame);
+    size_t header_size = frame->header_size;
+    size_t frame_len   = header_size + frame->data.num_bytes;
+    while (frame->num_sent < frame_len) {
+      char * bytes     = frame->data.bytes + frame->num_sent - header_size;
+      size_t num_bytes = frame_len - frame->num_sent;
+      if (frame->num_sent < header_size) {
+        bytes     = (frame->header + in_place_header_len - header_size +
+                     frame->num_sent);
+        num_bytes = header_size - frame->num_sent;
+      }
+      long just_sent = send(conn->socket, bytes, num_bytes, send_flags);
+      if (just_sent == -1 && get_errno() == err_would_block) return 0;
+      if (just_sent == -1) return -1;
+      frame->num_sent += just_sent;
+    }
+    memory_stats.outgoing_bytes -= frame_len;
+    msg_release(frame->data);
+    extra->next_out_frame++;
   }
 
+  array__clear(out_frames);
+  extra->next_out_frame = 0;
   return 0;
 }
 
-// Returns no_error (NULL) on success;
-// returns the name of the failing system call on error,
-// and get_errno() returns the error code.
-static char *send_data(msg_Conn *conn, msg_Data data) {
-  if (conn->protocol_type == msg_tcp) {
-    return send_all(conn->socket, data) ? "send" : no_error;
+// Releases any frames that are still waiting to be sent.
+static void drop_out_frames(msg_Conn *conn) {
+  ConnExtra *extra = extra_of_conn(conn);
+  if (extra->out_frames == NULL) return;
+  for (int i = extra->next_out_frame; i < extra->out_frames->count; ++i) {
+    OutFrame *frame = array__item_ptr(extra->out_frames, i);
+    memory_stats.outgoing_bytes -= frame->header_size + frame->data.num_bytes;
+    msg_release(frame->data);
   }
+  array__delete(extra->out_frames);
+  extra->out_frames     = NULL;
+  extra->next_out_frame = 0;
+}
 
-  // At this point we expect protocol_type to be udp.
+// The longest a clean close waits for queued frames to be sent.
+#define close_flush_sec 1.0
+
+// Sends the queued frames ahead of a clean close, waiting for the socket to
+// become writable as needed, until they're sent, the connection fails, or
+// close_flush_sec passes. Whatever's left is dropped by the caller.
+static void flush_out_frames(msg_Conn *conn) {
+  double flush_until = now() + close_flush_sec;
+  while (has_out_frames(conn) && send_out_frames(conn) == 0) {
+    int ms_left = (int)((flush_until - now()) * 1000);
+    if (ms_left <= 0) return;
+    if (wait_until_writable(conn->socket, ms_left) != 1) return;
+  }
+}
+
+// Sends data, including its header, without blocking. Whatever the socket
+// won't take now is queued, holding a reference to data, and sent from the run
+// loop when the socket becomes writable.
+// Returns -1 on error; 0 on success, similar to a system call.
+static int send_all(msg_Conn *conn, msg_Data data) {
+  size_t header_size = wire_header_size(data);
+  size_t frame_len   = header_size + data.num_bytes;
+  long   num_sent    = 0;
+
+  // Later frames wait behind queued ones to keep messages in order.
+  if (!has_out_frames(conn)) {
+    num_sent = send(conn->socket, data.bytes - header_size, frame_len,
+                    send_flags);
+    if (num_sent == -1 && get_errno() != err_would_block) return -1;
+    if (num_sent == frame_len) return 0;
+    if (num_sent == -1) num_sent = 0;
+  }
+
+  ConnExtra *extra = extra_of_conn(conn);
+  if (extra->out_frames == NULL) {
+    extra->out_frames = array__new(8, sizeof(OutFrame));
+  }
+  OutFrame *frame = (OutFrame *)array__new_ptr(extra->out_frames);
+  frame->data     = msg_retain(data);
+  memcpy(frame->header, data.bytes - in_place_header_len, in_place_header_len);
+  frame->header_size = header_size;
+  frame->num_sent    = num_sent;
+  memory_stats.outgoing_bytes += frame_len;
+
+  set_conn_to_poll_mode(conn->index, poll_mode_read | poll_mode_write);
+  return 0;
+}
+
+// Returns true if udp datagrams to conn's remote end with a checksum.
+static int wants_checksum(msg_Conn *conn) {
+  if (!msg_config.udp_checksums) return false;
+  ConnStatus *status = status_of_conn(conn);
+  return status && status->peer_reads_checksums;
+}
+
+// Sends data, whose compact header is set up, as a udp datagram that ends with
+// the crc32c of its header and body; the header is rewritten to say so.
+// Returns no_error (NULL) on success; returns the name of the failing system
+// call on error, and get_errno() returns the error code.
+static char *send_checksummed(msg_Conn *conn, msg_Data data) {
+  Metadata *metadata = metadata_of_data(data);
+  Header header;
+  parse_header(data.bytes - metadata->header_size, metadata->header_size,
+               &header);
+  header.message_type |= checksum_type_bit;
+  char   compact[in_place_header_len];
+  size_t header_size = encode_compact_header(&header, compact);
+  memcpy(data.bytes - header_size, compact, header_size);
+  metadata->header_size = (int)header_size;
+
+  const char *frame     = data.bytes - header_size;
+  size_t      frame_len = header_size + data.num_bytes;
+  uint32_t checksum = htonl(crc32c(0, frame, frame_len));
+  SockAddr  sockaddr;
+  socklen_t sockaddr_len = set_sockaddr_for_conn(&sockaddr, conn);
+  struct sockaddr *to = conn->for_listening ? &sockaddr.any : NULL;
+  long bytes_sent = send_with_trailer(conn->socket, to, sockaddr_len,
+                                      frame, frame_len,
+                                      (const char *)&checksum, checksum_len);
+  return bytes_sent == -1 ? "sendmsg" : no_error;
+}
+
+// Checks the checksum at the end of a received datagram of frame_len bytes
+// whose header, of wire_len bytes, has the checksum_type_bit set. Returns the
+// datagram's length without its checksum, or 0 if the checksum doesn't match,
+// in which case the datagram is counted as dropped.
+static size_t strip_checksum(const char *frame, size_t frame_len,
+                             size_t wire_len) {
+  if (frame_len >= wire_len + checksum_len) {
+    uint32_t checksum;
+    frame_len -= checksum_len;
+    memcpy(&checksum, frame + frame_len, checksum_len);
+    if (ntohl(checksum) == crc32c(0, frame, frame_len)) return frame_len;
+  }
+  memory_stats.num_bad_checksums++;
+  if (verbosity >= 1) printf("Dropped a datagram with a bad checksum.\n");
+  return 0;
+}
+
+// Returns no_error (NULL) on success;
+// returns the name of the failing system call on error,
+// and get_errno() returns the error code.
+static char *send_data(msg_Conn *conn, msg_Data data) {
+  if (conn->protocol_type == msg_tcp) {
+    return send_all(conn, data) ? "send" : no_error;
+  }
+
+  // At this point we expect protocol_type to be udp.
+  if (wants_checksum(conn)) return send_checksummed(conn, data);
+  size_t header_size = wire_header_size(data);
   if (conn->for_listening) {
-    struct sockaddr_in sockaddr;
-    set_sockaddr_for_conn(&sockaddr, conn);
+    SockAddr  sockaddr;
+    socklen_t sockaddr_len = set_sockaddr_for_conn(&sockaddr, conn);
     long bytes_sent = sendto(conn->socket,
-        data.bytes - header_len, data.num_bytes + header_len, send_flags,
-        (struct sockaddr *)&sockaddr, sock_in_size);
+        data.bytes - header_size, data.num_bytes + header_size, send_flags,
+        &sockaddr.any, sockaddr_len);
     if (bytes_sent == -1) return "sendto";
   } else {
     long bytes_sent = send(conn->socket,
-        data.bytes - header_len, data.num_bytes + header_len, send_flags);
+        data.bytes - header_size, data.num_bytes + header_size, send_flags);
     if (bytes_sent == -1) return "send";
   }
-  return no_error;
-}
+  return no_error;
+}
+
+static void array__remove_last(Array array) {
+  array__remove_item(array, array__item_ptr(array, array->count - 1));
+}
+
+// This releases array[index], sets array[index] = array[count - 1], and
+// shortens the array by 1. Effectively, it quickly removes an element.
+static void array__remove_and_fill(Array array, int index) {
+  void *elt = array__item_ptr(array, index);
+  void *last_elt = array__item_ptr(array, array->count - 1);
+  if (array->releaser) array->releaser(elt, NULL);
+  if (elt != last_elt) memcpy(elt, last_elt, array->item_size);
+  array->count--;
+}
+
+static msg_Conn *new_connection(void *conn_context, msg_Callback callback) {
+  msg_Conn *conn = alloc_object(&conn_pool);
+  memset(conn, 0, sizeof(ConnExtra));
+  conn->conn_context = conn_context;
+  conn->callback = callback;
+  conn->id = new_conn_id(conn);
+  return conn;
+}
+
+// Frees the to_free object of a PendingCall.
+static void free_named_object(void *object, const char *set_name) {
+  // A freed conn's id must stop matching before the conn can be reused.
+  if (strcmp(set_name, conn_pool.set_name) == 0) {
+    release_conn_id(((msg_Conn *)object)->id);
+    char *unix_path = ((ConnExtra *)object)->unix_path;
+    if (unix_path) dbgcheck__free(unix_path, "unix path");
+  }
+  ObjectPool *pools[] = { &conn_pool, &conn_status_pool };
+  int num_pools = sizeof(pools) / sizeof(pools[0]);
+  for (int i = 0; i < num_pools; ++i) {
+    if (strcmp(set_name, pools[i]->set_name) == 0) {
+      return free_object(pools[i], object);
+    }
+  }
+  dbgcheck__free(object, set_name);
+}
+
+static void init_if_needed() {
+  static int init_done = false;
+  if (init_done) return;
+
+  library_init;
+
+  immediate_callbacks = array__new(16, sizeof(PendingCall));
+  conns    = array__new(8, sizeof(msg_Conn *));
+  removals = array__new(8, sizeof(int));
+  timeouts = array__new(8, sizeof(Timeout));
+  reassembly_timeouts = array__new(8, sizeof(ReassemblyTimeout));
+  channel_statuses    = array__new(8, sizeof(ConnStatus *));
+  batch_statuses      = array__new(8, sizeof(ConnStatus *));
+  out_beats           = array__new(8, sizeof(ConnStatus *));
+  conn_slots      = array__new(8, sizeof(ConnSlot));
+  free_conn_slots = array__new(8, sizeof(int));
+  init_poll_fds();
+
+  int pool_size = msg_config.conn_pool_size;
+  init_object_pool(&conn_pool,        pool_size);
+  init_object_pool(&conn_status_pool, pool_size);
+
+  init_conn_status(min_status_entries);
+
+  init_done = true;
+}
+
+static void send_callback(msg_Conn *conn, msg_Event event, msg_Data data,
+                          void *to_free, const char *set_name) {
+  PendingCall pending_callback = {
+    .conn = conn,
+    .event = event,
+    .data = { data.num_bytes, data.bytes },
+    .to_free = to_free,
+    .set_name = set_name };
+  array__add_item_val(immediate_callbacks, pending_callback);
+  memory_stats.pending_call_bytes += sizeof(PendingCall) + data.num_bytes;
+}
+
+static void send_callback_error(msg_Conn *conn, const char *msg,
+                                void *to_free, const char *set_name) {
+  send_callback(conn, msg_error, msg_new_data(msg), to_free, set_name);
+}
+
+static void send_callback_os_error(msg_Conn *conn, const char *msg,
+                                   void *to_free, const char *set_name) {
+  static char err_msg[1024];
+  snprintf(err_msg, 1024, "%s: %s", msg, err_str());
+  send_callback_error(conn, err_msg, to_free, set_name);
+}
+
+static void make_call(PendingCall *call) {
+  msg_Conn *   conn   = call->conn;
+  ConnStatus * status = NULL;  // We'll set this if needed in the udp case.
+
+  char *addr_str = "<uninitialized address>";
+
+  // Several messages may be read before their callbacks are made, so the
+  // reply_id and reply_context read last may not be this one's. Incoming
+  // messages keep their header, in host byte order, just before their bytes.
+  msg_Event event = call->event;
+  if (event == msg_message || event == msg_request || event == msg_reply ||
+      event == msg_message_chunk) {
+    Metadata *metadata  = metadata_of_data(call->data);
+    int is_request      = (metadata->header.message_type == msg_type_request);
+    conn->reply_id      = is_request ? metadata->header.reply_id : 0;
+    conn->reply_context = metadata->reply_context;
+  }
+
+  // An error about a msg_get carries its reply_context; other errors have none.
+  if (event == msg_error) {
+    conn->reply_context = metadata_of_data(call->data)->reply_context;
+  }
+
+  // Copy metadata from msg_Data/status to msg_Conn for udp messages.
+  if (conn->protocol_type == msg_udp && call->data.bytes) {
+    msg_Data data          = call->data;
+    Metadata *metadata     = metadata_of_data(data);
+    conn->reply_context    = metadata->reply_context;
+    *address_of_conn(conn) = metadata->remote_address;
+    status                 = status_of_conn(conn);
+
+    if (verbosity >= 3) {
+      addr_str = address_as_str(&metadata->remote_address);
+    }
+
+    // Unless this is a msg_error or a closure, we expect a udp callback to have
+    // a status.
+    assert(call->event == msg_error || call->event == msg_connection_closed ||
+           call->event == msg_connection_lost || call->event == msg_load_shed ||
+           status);
+    if (status) {
+      if (verbosity >= 3) {
+        printf("<pid %d> restoring conn_context=%p for address %s "
+               "(status=%p)\n",
+               getpid(), status->conn_context, addr_str, status);
+      }
+      conn->conn_context = status->conn_context;
+    } else if (verbosity >= 3) {
+      printf("<pid %d> no status to restore conn_context from; address=%s\n",
+          getpid(), addr_str);
+    }
+  }
+
+  conn->callback(conn, call->event, call->data);
+
+  // Save the user's conn_context in case they changed it.
+  if (conn->protocol_type == msg_udp && status) {
+    status->conn_context = conn->conn_context;
+    if (verbosity >= 3) {
+      printf("<pid %d> saving conn_context=%p for address %s (status=%p)\n",
+          getpid(), conn->conn_context, addr_str, status);
+    }
+  }
+
+  memory_stats.pending_call_bytes -= sizeof(PendingCall) + call->data.num_bytes;
+  if (call->data.bytes) msg_delete_data(call->data);
+  if (call->to_free) free_named_object(call->to_free, call->set_name);
+}
+
+// Sets up conn for the unix domain socket at path, which is part of the given
+// address. Returns no_error (NULL) on success, or an error string.
+static const char *parse_unix_path(const char *path, const char *address,
+                                   msg_Conn *conn) {
+  static char err_msg[1024];
+
+  // A unixgram client binds to its listener's path plus a suffix, so the
+  // listener's path is limited to leave room for it.
+  int  is_gram   = (conn->protocol_type == msg_udp);
+  long max_len   = (long)sizeof(((SockAddr *)NULL)->un.sun_path) - 1 -
+                   (is_gram ? max_unix_suffix_len : 0);
+  long path_len  = (long)strlen(path);
+  if (path_len > max_len || path_len < 1) {
+    snprintf(err_msg, 1024,
+        "Failing because path length=%ld; expected to be 1-%ld (in address "
+        "'%s')", path_len, max_len, address);
+    return err_msg;
+  }
+
+  extra_of_conn(conn)->unix_path = new_unix_path(path);
+  conn->remote_ip   = 0;
+  conn->remote_port = 0;
+  return no_error;
+}
+
+// Returns no_error (NULL) on success, and sets the protocol_type,
+// remote_ip, and remote_port of the given conn; for a unix domain socket, it
+// sets the unix_path of conn instead of its remote_ip and remote_port.
+// Returns an error string if there was an error.
+static const char *parse_address_str(const char *address, msg_Conn *conn) {
+  assert(conn != NULL);
+  static char err_msg[1024];
+
+  // TODO once v1 functionality is done, see if I can
+  // encapsulate the error pattern into a one-liner; eg with a macro.
+
+  // A unix domain socket's address is its path. Stream sockets work like tcp,
+  // and datagram sockets like udp.
+  const char *unix_prefix     = "unix://";
+  const char *unixgram_prefix = "unixgram://";
+  if (strncmp(address, unix_prefix, strlen(unix_prefix)) == 0) {
+    conn->protocol_type = SOCK_STREAM;
+    return parse_unix_path(address + strlen(unix_prefix), address, conn);
+  }
+  if (strncmp(address, unixgram_prefix, strlen(unixgram_prefix)) == 0) {
+    conn->protocol_type = SOCK_DGRAM;
+    return parse_unix_path(address + strlen(unixgram_prefix), address, conn);
+  }
+
+  // Parse the protocol type; either tcp or udp.
+  const char *tcp_prefix = "tcp://";
+  const char *udp_prefix = "udp://";
+  size_t prefix_len = 6;
+  if (strncmp(address, tcp_prefix, prefix_len) == 0) {
+    conn->protocol_type = SOCK_STREAM;
+  } else if (strncmp(address, udp_prefix, prefix_len) == 0) {
+    conn->protocol_type = SOCK_DGRAM;
+  } else {
+    // The address has no recognizable prefix.
+    snprintf(err_msg, 1024, "Failing due to unrecognized prefix: %s", address);
+    return err_msg;
+  }
+
+  // Parse the ip substring in three steps.
+  // 1. Find the start and end of the ip substring.
+  const char *ip_start = address + prefix_len;
+  char *colon = strchr(ip_start, ':');
+  if (colon == NULL) {
+    snprintf(err_msg, 1024,
+             "Can't parse address '%s'; missing colon after ip", address);
+    return err_msg;
+  }
+
+  // 2. Check substring length and copy over so we can hand inet_pton a
+  // null-terminated version.
+  long ip_len = colon - ip_start;
+  if (ip_len > 15 || ip_len < 1) {
+    snprintf(err_msg, 1024,
+        "Failing because ip length=%ld; expected to be 1-15 (in addresss '%s')",
+        ip_len, address);
+    return err_msg;
+  }
+  char ip_str[16];
+  char *ip_str_end = stpncpy(ip_str, ip_start, ip_len);
+  *ip_str_end = '\0';
+
+  // 3. Let inet_pton handle the actual parsing.
+  if (strcmp(ip_str, "*") == 0) {
+    conn->remote_ip = INADDR_ANY;
+  } else {
+    struct in_addr ip;
+    if (inet_pton(AF_INET, ip_str, &ip) != 1) {
+      snprintf(err_msg, 1024, "Couldn't parse ip string '%s'.", ip_str);
+      return err_msg;
+    }
+    conn->remote_ip = ip.s_addr;
+  }
+
+  // Parse the port.
+  int base_ten = 10;
+  char *end_ptr = NULL;
+  if (*(colon + 1) == '\0') {
+    snprintf(err_msg, 1024, "Empty port string in address '%s'", address);
+    return err_msg;
+  }
+  conn->remote_port = (int)strtol(colon + 1, &end_ptr, base_ten);
+  if (*end_ptr != '\0') {
+    snprintf(err_msg, 1024, "Invalid port string in address '%s'", address);
+    return err_msg;
+  }
+
+  return no_error;
+}
+
+// Sets up the header to send data to conn's remote. The header is compact if
+// the remote has said it reads compact headers; it ends at data.bytes either
+// way.
+static void set_header(msg_Conn *conn,
+                       msg_Data data,
+                       uint16_t msg_type,
+                       uint32_t reply_id,
+                       uint32_t num_bytes) {
+
+  Metadata *metadata = metadata_of_data(data);
+  ConnStatus *status = status_of_conn(conn);
+
+  // Wide reply ids only come about with remotes that read v3 headers.
+  assert(reply_id <= UINT16_MAX || (status && status->peer_version >= 3));
+  assert(!(msg_type & more_type_bit) || (status && status->peer_version >= 4));
+
+  if (status && status->peer_version >= 2) {
+    Header header = { msg_type, reply_id, num_bytes };
+    char   compact[in_place_header_len];
+    size_t len = encode_compact_header(&header, compact);
+    memcpy(data.bytes - len, compact, len);
+    metadata->header_size = (int)len;
+    return;
+  }
+
+  WireHeader *header = (WireHeader *)(data.bytes - header_len);
+  *header = (WireHeader) {
+    .message_type = htons(msg_type),
+    .reply_id     = htons((uint16_t)reply_id),
+    .num_bytes    = htonl(num_bytes) };
+  metadata->header_size = header_len;
+}
+
+// Returns the largest udp datagram we send, not counting any checksum trailer;
+// larger messages are fragmented.
+static size_t max_datagram_len() {
+  size_t trailer_len = msg_config.udp_checksums ? checksum_len : 0;
+  size_t len = msg_config.udp_fragment_size;
+  if (len == 0 || len > udp_max_gso_len) return udp_max_gso_len - trailer_len;
+  return (len < min_fragment_len ? min_fragment_len : len) - trailer_len;
+}
+
+// Returns the longest header that a fragment with the given reply id can take
+// on the wire to conn's remote, counting the checksum extension.
+static size_t max_fragment_header_len(msg_Conn *conn, uint32_t reply_id) {
+  if (!peer_sent_hello(status_of_conn(conn))) return header_len;
+  uint16_t checksum_bit = wants_checksum(conn) ? checksum_type_bit : 0;
+  Header header = {
+    .message_type = msg_type_fragment | checksum_bit,
+    .reply_id     = reply_id,
+    .num_bytes    = udp_max_gso_len  // No fragment's size takes more bytes.
+  };
+  char compact[in_place_header_len];
+  return encode_compact_header(&header, compact);
+}
+
+// Sends data, whose header is set up, as a sequence of fragments.
+// Returns no_error (NULL) on success; returns the name of the failing system
+// call on error, and get_errno() returns the error code.
+static char *send_fragments(msg_Conn *conn, msg_Data data) {
+  static uint32_t next_message_id = 1;
+
+  Header header;
+  size_t header_size = wire_header_size(data);
+  parse_header(data.bytes - header_size, header_size, &header);
+
+  // A fragment header holds 16 bits of reply_id, so a wider one is also sent in
+  // the header of each fragment.
+  uint32_t wide_reply_id = header.reply_id > UINT16_MAX ? header.reply_id : 0;
+
+  size_t max_payload   = (max_datagram_len() -
+                          max_fragment_header_len(conn, wide_reply_id) -
+                          fragment_header_len);
+  size_t num_fragments = (data.num_bytes + max_payload - 1) / max_payload;
+  if (num_fragments > UINT16_MAX) {
+    set_errno(err_invalid);
+    return "send";
+  }
+
+  uint32_t message_id = next_message_id++;
+  for (size_t i = 0; i < num_fragments; ++i) {
+    size_t offset    = i * max_payload;
+    size_t num_bytes = data.num_bytes - offset;
+    if (num_bytes > max_payload) num_bytes = max_payload;
+
+    msg_Data fragment_data = msg_new_data_space(fragment_header_len +
+                                                num_bytes);
+    FragmentHeader fragment = {
+      .message_id    = htonl(message_id),
+      .index         = htons((uint16_t)i),
+      .num_fragments = htons((uint16_t)num_fragments),
+      .offset        = htonl((uint32_t)offset),
+      .message_type  = htons(header.message_type),
+      .reply_id      = htons((uint16_t)header.reply_id),
+      .num_bytes     = htonl(header.num_bytes)
+    };
+    memcpy(fragment_data.bytes, &fragment, fragment_header_len);
+    memcpy(fragment_data.bytes + fragment_header_len, data.bytes + offset,
+           num_bytes);
+    set_header(conn, fragment_data, msg_type_fragment, wide_reply_id,
+               (uint32_t)fragment_data.num_bytes);
+    char *failed_sys_call = send_data(conn, fragment_data);
+    msg_delete_data(fragment_data);
+    if (failed_sys_call) return failed_sys_call;
+  }
+  return no_error;
+}
+
+// Returns a compressed copy of data, whose header is set up, if data is worth
+// compressing for conn's remote; returns msg_no_data otherwise.
+static msg_Data compress_message(msg_Conn *conn, msg_Data data) {
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL || !status->compress || !status->peer_reads_compressed ||
+      data.num_bytes < min_compressed_len ||
+      data.num_bytes < msg_config.compression_threshold) {
+    return msg_no_data;
+  }
+
+  Header header;
+  size_t header_size = wire_header_size(data);
+  parse_header(data.bytes - header_size, header_size, &header);
+
+  uint32_t dict_id = dictionary_id();
+  int use_dictionary = (dict_id && status->peer_dictionary_id == dict_id);
+  msg_Data compressed = msg_new_data_space(data.num_bytes);
+  size_t num_bytes = compress_body(data.bytes, data.num_bytes, use_dictionary,
+                                   (uint8_t *)compressed.bytes,
+                                   compressed.num_bytes);
+  if (num_bytes == 0) {
+    msg_delete_data(compressed);
+    return msg_no_data;
+  }
+  compressed.num_bytes = num_bytes;
+  set_header(conn, compressed, header.message_type | compressed_type_bit,
+             header.reply_id, (uint32_t)num_bytes);
+  return compressed;
+}
+
+// This is send_data for messages, which compresses messages and fragments udp
+// messages as needed.
+static char *send_unbatched(msg_Conn *conn, msg_Data data) {
+  msg_Data compressed = compress_message(conn, data);
+  if (compressed.bytes) data = compressed;
+
+  // Until the remote's hello arrives, a message is sent whole even if that's
+  // too large for a datagram, which then fails as it would without fragments.
+  char *failed_sys_call;
+  size_t frame_len = wire_header_size(data) + data.num_bytes;
+  if (conn->protocol_type == msg_udp && frame_len > max_datagram_len() &&
+      peer_sent_hello(status_of_conn(conn))) {
+    failed_sys_call = send_fragments(conn, data);
+  } else {
+    failed_sys_call = send_data(conn, data);
+  }
+
+  if (compressed.bytes) msg_delete_data(compressed);
+  return failed_sys_call;
+}
+
+// With msg_config.batch_delay on, small messages to a remote that reads v5
+// headers are held in its status and sent together as the body of one message
+// with the batch_type_bit set. That body is each message's wire header and body
+// in turn. The batch is sent once the next message won't fit in
+// max_batch_size bytes, once batch_delay seconds have passed since its first
+// message, or before any message that isn't batched, which keeps messages in
+// order. A batch is compressed and fragmented like any other message.
+
+static int is_batchable(ConnStatus *status, msg_Data data) {
+  if (msg_config.batch_delay <= 0 || status == NULL) return false;
+  if (status->peer_version < 5) return false;
+  size_t frame_len = wire_header_size(data) + data.num_bytes;
+  return frame_len <= msg_config.max_batch_size;
+}
+
+// Removes the batch from status and returns it, with num_bytes set to the
+// length of its contents.
+static msg_Data take_batch(ConnStatus *status) {
+  msg_Data batch = status->batch;
+  memory_stats.outgoing_bytes -= batch.num_bytes;
+  batch.num_bytes = status->batch_len;
+  status->batch   = msg_no_data;
+
+  array__for(ConnStatus **, status_ptr, batch_statuses, i) {
+    if (*status_ptr != status) continue;
+    array__remove_and_fill(batch_statuses, i);
+    break;
+  }
+  return batch;
+}
+
+// Drops the batch of status without sending it.
+static void drop_batch(ConnStatus *status) {
+  msg_delete_data(take_batch(status));
+}
+
+// Sends the batch of status to its remote, which may be any of the remotes of a
+// listening udp conn.
+// Returns no_error (NULL) on success; returns the name of the failing system
+// call on error, and get_errno() returns the error code.
+static char *send_batch(msg_Conn *conn, ConnStatus *status) {
+  msg_Data batch = take_batch(status);
+  Address saved_address  = *address_of_conn(conn);
+  *address_of_conn(conn) = status->remote_address;
+  int reply_id = 0;
+  set_header(conn, batch, msg_type_one_way | batch_type_bit, reply_id,
+             (uint32_t)batch.num_bytes);
+  char *failed_sys_call = send_unbatched(conn, batch);
+  *address_of_conn(conn) = saved_address;
+  msg_delete_data(batch);
+  return failed_sys_call;
+}
+
+// Adds data, whose header is set up, to the batch of status, first sending the
+// batch if data won't fit in it.
+// Returns no_error (NULL) on success; returns the name of the failing system
+// call on error, and get_errno() returns the error code.
+static char *add_to_batch(msg_Conn *conn, ConnStatus *status, msg_Data data) {
+  size_t header_size = wire_header_size(data);
+  size_t frame_len   = header_size + data.num_bytes;
+  if (status->batch.bytes &&
+      status->batch_len + frame_len > status->batch.num_bytes) {
+    char *failed_sys_call = send_batch(conn, status);
+    if (failed_sys_call) return failed_sys_call;
+  }
+  if (status->batch.bytes == NULL) {
+    status->batch        = msg_new_data_space(msg_config.max_batch_size);
+    status->batch_len    = 0;
+    status->batch_due_at = now() + msg_config.batch_delay;
+    memory_stats.outgoing_bytes += status->batch.num_bytes;
+    array__add_item_val(batch_statuses, status);
+  }
+  memcpy(status->batch.bytes + status->batch_len, data.bytes - header_size,
+         frame_len);
+  status->batch_len += frame_len;
+  return no_error;
+}
+
+static void resend_hello_if_due(msg_Conn *conn,
+                                ConnStatus *status);  // Defined below.
+
+// Sends data, which may be held for a batch.
+// Returns no_error (NULL) on success; returns the name of the failing system
+// call on error, and get_errno() returns the error code.
+static char *send_message(msg_Conn *conn, msg_Data data) {
+  ConnStatus *status = status_of_conn(conn);
+  if (status) resend_hello_if_due(conn, status);
+  if (is_batchable(status, data)) return add_to_batch(conn, status, data);
+  if (status && status->batch.bytes) {
+    char *failed_sys_call = send_batch(conn, status);
+    if (failed_sys_call) return failed_sys_call;
+  }
+  return send_unbatched(conn, data);
+}
+
+static void remove_conn_at(int index) {
+  array__remove_and_fill(conns, index);
+  if (index < conns->count) {
+    msg_Conn *filled_conn = array__item_val(conns, index, msg_Conn *);
+    filled_conn->index = index;
+  }
+
+  remove_from_poll_fds(index);
+}
+
+static void fail_pending_gets(msg_Conn *conn, ConnStatus *status,
+                              const char *msg);  // Defined below.
+
+// Forgets every remote of the listening udp conn, which is closing. Each
+// msg_get still waiting on one of them first receives a msg_error.
+static void drop_remotes_of_listener(msg_Conn *conn) {
+  // Unsetting a status moves other entries, so find them all first.
+  Array addresses = array__new(8, sizeof(Address));
+  for (size_t i = 0; i < num_conn_status_slots; ++i) {
+    ConnStatus *status = conn_status[i].status;
+    if (conn_status[i].key == 0 || status->conn_id != conn->id) continue;
+    array__add_item_val(addresses, status->remote_address);
+  }
+  array__for(Address *, address, addresses, i) {
+    ConnStatus *status = get_conn_status(address);
+    if (status->num_replies_pending) {
+      fail_pending_gets(conn, status, "udp get failed: connection closed");
+    }
+    unset_conn_status(address);
+  }
+  array__delete(addresses);
+}
+
+// Deletes the remote's status and sends the given event, which
+// should be one of msg_connection_{closed,lost}. Each msg_get still waiting on
+// the remote first receives a msg_error.
+static void local_disconnect(msg_Conn *conn, msg_Event event) {
+  Address *address = (Address *)(&conn->remote_ip);
+
+  // A listening udp conn is a special case as it lives until an unlisten call.
+  int is_listening = is_listening_udp(conn);
+
+  ConnExtra *extra = extra_of_conn(conn);
+  ConnStatus *status = is_listening ? get_conn_status(address) : extra->status;
+  if (status && status->num_replies_pending) {
+    int is_tcp = (conn->protocol_type == msg_tcp);
+    const char *msg = (event == msg_connection_lost ?
+                       (is_tcp ? "tcp get failed: connection lost" :
+                                 "udp get failed: connection lost") :
+                       (is_tcp ? "tcp get failed: connection closed" :
+                                 "udp get failed: connection closed"));
+    fail_pending_gets(conn, status, msg);
+  }
+
+  if (is_listening) {
+    unset_conn_status(address);
+  } else if (extra->status) {
+    delete_conn_status(extra->status);
+    extra->status = NULL;
+  }
+
+  void *to_free = is_listening ? NULL : conn;
+  const char *set_name = is_listening ? NULL : "msg_Conn";
+
+  // A listening udp conn may hear from other remotes before the callback, so
+  // we send the remote address along as metadata.
+  msg_Data data = msg_no_data;
+  if (is_listening) {
+    data = msg_new_data_space(0);
+    Metadata *metadata = metadata_of_data(data);
+    metadata->reply_context  = NULL;
+    metadata->remote_address = *address;
+  }
+  send_callback(conn, event, data, to_free, set_name);
+
+  if (is_listening) return;
+
+  // Finish sending queued frames, such as our own close message, on a clean
+  // close. This waits at most close_flush_sec.
+  if (event == msg_connection_closed) flush_out_frames(conn);
+  drop_out_frames(conn);
+
+  unlink_bound_path(conn);
+  closesocket(conn->socket);
+  array__add_item_val(removals, conn->index);
+}
+
+// Reads the header of a message, which may be a v1 or a compact header.
+// For udp packets, the next recv will still include the header.
+// For tcp packets, the next recv will be just after the header.
+// Returns the length of the header on the wire on success; 0 on failure.
+static int read_header(int sock, msg_Conn *conn, Header *header) {
+  char bytes[max_wire_header_len];
+  long bytes_recvd = recv(sock, bytes, max_wire_header_len, MSG_PEEK);
+
+  if (bytes_recvd == 0 ||
+      (bytes_recvd == -1 && get_errno() == err_conn_reset)) {
+    local_disconnect(conn, msg_connection_lost);
+    return false;
+  }
+  
+  // We ignore err_win_msg_size; it only tells us that we didn't get the full
+  // udp message.
+  if (bytes_recvd == -1 && get_errno() != err_win_msg_size) {
+    if (get_errno() == err_would_block) return false;
+    send_callback_os_error(conn, "recv", free_nothing, no_set_name);
+    return false;
+  }
+  // On windows, a udp peek into a short buffer fills the buffer.
+  if (bytes_recvd == -1) bytes_recvd = max_wire_header_len;
+
+  int default_options = 0;
+  int wire_len = parse_header(bytes, bytes_recvd, header);
+
+  // In some cases, a tcp message header may be cut off, so we want to
+  // asynchronously wait. Poor header. A datagram is never completed later, so
+  // we drop a short or malformed one.
+  if (wire_len <= 0 && conn->protocol_type == msg_udp) {
+    recv(sock, bytes, 1, default_options);
+    return false;
+  }
+  if (wire_len == 0) return false;
+  if (wire_len == -1) {
+    // We can't find the next message in the stream, so the connection is lost.
+    send_callback_error(conn, "Received an invalid message header",
+                        free_nothing, no_set_name);
+    local_disconnect(conn, msg_connection_lost);
+    return false;
+  }
+
+  // Mark the header as read in the tcp case.
+  if (conn->protocol_type == msg_tcp) {
+    recv(sock, bytes, wire_len, default_options);
+  }
+
+  conn->reply_id       = header->reply_id;
+
+  if (false) {
+    printf("%s called; header has ", __FUNCTION__);
+    print_bytes(bytes, wire_len);
+  }
+
+  if (false) {
+    char *type_names[] = {
+      "msg_type_one_way",
+      "msg_type_request",
+      "msg_type_reply",
+      "msg_type_heartbeat",
+      "msg_type_close",
+      "msg_type_hello",
+      "msg_type_fragment",
+      "msg_type_channel"
+    };
+    printf("pid %d: Read in a header: type=%s #bytes=%d\n",
+           getpid(),
+           type_names[header->message_type],
+           header->num_bytes);
+  }
+
+  return wire_len;
+}
+
+// A hello tells the remote what we read. Its body is laid out as:
+//   version byte:   the highest header version we read
+//   features byte:  hello_reads_compressed | hello_reads_checksums |
+//                   hello_is_answer
+//   dictionary id:  4 bytes, network byte-order; see dictionary_id
+// Versions of msgbox from before the hello can't read it, so a hello is only
+// offered when msg_config.compact_headers or compression is on. Every offer is
+// answered with a hello; answers aren't. Versions without compression send
+// only the version byte.
+
+#define hello_reads_compressed 0x01
+#define hello_reads_checksums  0x02
+#define hello_is_answer        0x04
+#define hello_len              6
+
+// A udp offer may be lost, so it's resent along with later messages, at most
+// every hello_resend_sec and up to max_offers times in all, until the remote's
+// hello arrives.
+#define hello_resend_sec 0.2
+#define max_offers       10
+
+static void send_hello(msg_Conn *conn, ConnStatus *status, int is_answer) {
+  msg_Data data = msg_new_data_space(hello_len);
+  uint32_t dict_id = htonl(dictionary_id());
+  data.bytes[0] = wire_version;
+  data.bytes[1] = (hello_reads_compressed | hello_reads_checksums |
+                   (is_answer ? hello_is_answer : 0));
+  memcpy(data.bytes + 2, &dict_id, sizeof(dict_id));
+  int reply_id = 0;
+  set_header(conn, data, msg_type_hello, reply_id, (uint32_t)data.num_bytes);
+
+  char *failed_sys_call = send_data(conn, data);
+  if (failed_sys_call) {
+    send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
+  }
+  msg_delete_data(data);
+  status->sent_hello = true;
+  if (!is_answer) {
+    status->num_offers++;
+    status->offer_sent_at = now();
+  }
+}
+
+static void resend_hello_if_due(msg_Conn *conn, ConnStatus *status) {
+  if (conn->protocol_type != msg_udp || peer_sent_hello(status)) return;
+  if (status->num_offers == 0 || status->num_offers >= max_offers) return;
+  if (now() - status->offer_sent_at < hello_resend_sec) return;
+  int is_answer = false;
+  send_hello(conn, status, is_answer);
+}
+
+// Records what the remote reads, and answers the hello if it's an offer. An
+// offer that repeats one already answered means that our answer was lost.
+static void receive_hello(msg_Conn *conn, ConnStatus *status, msg_Data data) {
+  int is_answer = false;
+  if (data.num_bytes >= 1) {
+    int version = (uint8_t)data.bytes[0];
+    status->peer_version = version < wire_version ? version : wire_version;
+  }
+  if (data.num_bytes >= hello_len) {
+    uint32_t dict_id;
+    memcpy(&dict_id, data.bytes + 2, sizeof(dict_id));
+    int features = (uint8_t)data.bytes[1];
+    status->peer_reads_compressed = !!(features & hello_reads_compressed);
+    status->peer_reads_checksums  = !!(features & hello_reads_checksums);
+    status->peer_dictionary_id    = ntohl(dict_id);
+    is_answer = !!(features & hello_is_answer);
+  }
+  msg_delete_data(data);
+  if (!is_answer) send_hello(conn, status, true);
+}
+
+// This creates a new ConnStatus struct if none exists for the remote address.
+static ConnStatus *remote_address_seen(msg_Conn *conn) {
+
+  ConnStatus *status = status_of_conn(conn);
+
+  if (status == NULL) {
+    // It's a new remote address.
+    Address *address = address_of_conn(conn);
+    status = new_conn_status(now(), address);
+
+    status->conn_context = conn->conn_context;
+    status->conn_id      = conn->id;
+
+    if (is_listening_udp(conn)) {
+      set_conn_status(address, status);
+    } else {
+      extra_of_conn(conn)->status = status;
+    }
+    if (conn->protocol_type == msg_udp) add_to_out_beats(status);
+
+    // Send in the correct remote address with the callback.
+    msg_Data data = msg_new_data_space(0);
+    Metadata *metadata = metadata_of_data(data);
+    metadata->remote_address = *address;
+
+    send_callback(conn, msg_connection_ready, data, free_nothing, no_set_name);
+
+    // A listening udp conn only answers the hellos of its remotes.
+    int has_offer = (msg_config.compact_headers || msg_config.compression);
+    if (has_offer && !is_listening_udp(conn)) {
+      int is_answer = false;
+      send_hello(conn, status, is_answer);
+    }
+  }
+
+  status->last_seen_at = now();
+  status->is_recent    = true;
+
+  return status;
+}
+
+// Returns an error string if the incoming message described by header is larger
+// than msg_config.max_message_size; returns no_error (NULL) otherwise.
+static const char *message_size_error(Header *header) {
+  size_t max_size = msg_config.max_message_size;
+  if (max_size == 0 || header->num_bytes <= max_size) return no_error;
+  static char err_msg[1024];
+  snprintf(err_msg, 1024,
+           "Incoming message of %u bytes exceeds max_message_size (%zd bytes)",
+           header->num_bytes, max_size);
+  return err_msg;
+}
+
+// Sets up status to deliver the incoming tcp message described by header as a
+// sequence of msg_message_chunk events. A reply's context is looked up now so
+// that every chunk can be given the same reply_context.
+static void begin_stream(msg_Conn *conn, ConnStatus *status, Header *header) {
+  status->stream_chunk_size    = msg_config.stream_chunk_size;
+  status->stream_reply_context = NULL;
+  status->stream_is_discarded  = false;
+  if ((header->message_type & ~more_type_bit) != msg_type_reply) return;
+  if (!find_reply_context(conn, status, header->message_type, header->reply_id,
+                          &status->stream_reply_context)) {
+    send_callback_error(conn, "Unrecognized reply_id", free_nothing,
+                        no_set_name);
+    status->stream_is_discarded = true;
+  }
+}
+
+// Sends a completed chunk to the user and sets up the buffer for the next one.
+// Returns false so the caller moves on to other sockets; reading at most one
+// chunk per connection per run loop bounds the memory used by streaming.
+static int deliver_chunk(msg_Conn *conn, ConnStatus *status, msg_Data data) {
+  Header header = metadata_of_data(data)->header;
+  size_t end_offset = metadata_of_data(data)->chunk_offset + data.num_bytes;
+
+  if (status->stream_is_discarded) {
+    msg_delete_data(data);
+  } else {
+    int is_request      = (header.message_type == msg_type_request);
+    conn->reply_id      = is_request ? header.reply_id : 0;
+    conn->reply_context = status->stream_reply_context;
+    metadata_of_data(data)->reply_context = conn->reply_context;
+    send_callback(conn, msg_message_chunk, data, free_nothing, no_set_name);
+  }
+
+  if (end_offset == header.num_bytes) {
+    status->stream_chunk_size = 0;  // That was the last chunk.
+  } else {
+    new_conn_status_buffer(status, &header, end_offset);
+  }
+  return false;
+}
+
+// Returns true when the entire message is received;
+// returns false when more data remains but no error occurred;
+// returns -1 when there was an error - the caller must respond to it;
+// returns -2 when a message was interrupted by a connection close.
+static int continue_recv(msg_Conn *conn, ConnStatus *status) {
+  int sock = conn->socket;
+  msg_Data *buffer = &status->waiting_buffer;
+  int default_options = 0;
+  long bytes_in = recv(sock, buffer->bytes, buffer->num_bytes, default_options);
+  if (bytes_in == 0 || (bytes_in == -1 && get_errno() == err_conn_reset)) {
+    local_disconnect(conn, msg_connection_lost);
+    return -2;
+  }
+  if (bytes_in == -1) {
+    if (get_errno() == err_would_block) return false;  // More data is pending.
+    // This is an error we must report; treat the current data as lost.
+    return -1;
+  } 
+
+  rearm_quickack(conn);
+
+  buffer->bytes     += bytes_in;
+  buffer->num_bytes -= bytes_in;
+  return buffer->num_bytes == 0;
+}
+
+// Schedules a msg_error callback for a message from the given remote address.
+// On udp, make_call overrides conn's remote address with the one in the data's
+// metadata, so we set that up here.
+static void send_callback_remote_error(msg_Conn *conn, const char *msg,
+                                       Address *remote_address) {
+  msg_Data data = msg_new_data(msg);
+  Metadata *metadata = metadata_of_data(data);
+  metadata->reply_context  = NULL;
+  metadata->remote_address = *remote_address;
+  send_callback(conn, msg_error, data, free_nothing, no_set_name);
+}
+
+// Sends a msg_load_shed event describing what was shed to stay within the
+// memory budget. For udp, the conn's remote address is the one affected.
+static void send_callback_shed(msg_Conn *conn, const char *msg) {
+  msg_Data data = msg_new_data(msg);
+  Metadata *metadata = metadata_of_data(data);
+  metadata->reply_context  = NULL;
+  metadata->remote_address = *address_of_conn(conn);
+  send_callback(conn, msg_load_shed, data, free_nothing, no_set_name);
+}
+
+static void receive_channel_message(msg_Conn *conn, ConnStatus *status,
+                                    msg_Data data);  // Defined below.
+
+static void receive_heartbeat(msg_Conn *conn, ConnStatus *status,
+                              msg_Data data);  // Defined below.
+
+static void receive_batch(msg_Conn *conn, ConnStatus *status,
+                          msg_Data data);  // Defined below.
+
+// Returns the decompressed form, in a new buffer, of the compressed message
+// data described by header; data is released either way. Returns msg_no_data,
+// and sends a msg_error, if data can't be decompressed.
+static msg_Data decompress_message(msg_Conn *conn, Header *header,
+                                   msg_Data data) {
+  Metadata *metadata   = metadata_of_data(data);
+  const uint8_t *bytes = (const uint8_t *)data.bytes;
+  Header original = {
+    .message_type = header->message_type & ~compressed_type_bit,
+    .reply_id     = header->reply_id
+  };
+
+  // Each byte of an lz4 block stands for at most 255 bytes of output.
+  size_t len = 1;
+  int    flags = data.num_bytes ? bytes[0] : 0;
+  const char *err_msg = "Received a malformed compressed message";
+  if (data.num_bytes == 0 || (flags & ~compressed_uses_dictionary) ||
+      read_varint(bytes, data.num_bytes, &len, &original.num_bytes) != 1 ||
+      original.num_bytes / 255 > data.num_bytes) {
+    send_callback_remote_error(conn, err_msg, address_of_conn(conn));
+    msg_delete_data(data);
+    return msg_no_data;
+  }
+  const char *size_err_msg = message_size_error(&original);
+  if (size_err_msg) {
+    send_callback_remote_error(conn, size_err_msg, address_of_conn(conn));
+    msg_delete_data(data);
+    return msg_no_data;
+  }
+
+  size_t dict_len = 0;
+  const uint8_t *dict = NULL;
+  if (flags & compressed_uses_dictionary) dict = dictionary(&dict_len);
+  msg_Data out = msg_new_data_space(original.num_bytes);
+  if (!lz_decompress(bytes + len, data.num_bytes - len,
+                     (uint8_t *)out.bytes, out.num_bytes, dict, dict_len)) {
+    send_callback_remote_error(conn, err_msg, address_of_conn(conn));
+    msg_delete_data(out);
+    msg_delete_data(data);
+    return msg_no_data;
+  }
+
+  Metadata *out_metadata       = metadata_of_data(out);
+  out_metadata->reply_context  = metadata->reply_context;
+  out_metadata->remote_address = metadata->remote_address;
+  out_metadata->header         = original;
+  msg_delete_data(data);
+  return out;
+}
+
+// Schedules the callback for a complete incoming message. For udp messages, the
+// caller is expected to have set up the metadata of data.
+static void dispatch_message(msg_Conn *conn, ConnStatus *status,
+                             Header *header, msg_Data data) {
+  if (header->message_type & compressed_type_bit) {
+    data = decompress_message(conn, header, data);
+    if (data.bytes == NULL) return;
+    header = &metadata_of_data(data)->header;
+  }
+
+  if (header->message_type & batch_type_bit) {
+    return receive_batch(conn, status, data);
+  }
+
+  if (verbosity >= 2) {  // Debug code.
+    char *msg_type_str[] = {
+      "msg_type_one_way",
+      "msg_type_request",
+      "msg_type_reply",
+      "msg_type_heartbeat",
+      "msg_type_close",
+      "msg_type_hello",
+      "msg_type_fragment",
+      "msg_type_channel"
+    };
+    if (header->message_type < (sizeof(msg_type_str) / sizeof(char *))) {
+      printf("Received message of type '%s'.\n",
+             msg_type_str[header->message_type]);
+    } else {
+      printf("Received message of unknown type %d.\n",
+             header->message_type);
+    }
+  }
+
+  // Set up the appropriate reaction event.
+  msg_Event event;
+  switch (header->message_type & ~more_type_bit) {
+    case msg_type_one_way:
+      event = msg_message;
+      // Avoid confusion about whether or not this is a reply.
+      conn->reply_id = 0;
+      break;
+    case msg_type_request:
+      event = msg_request;
+      break;
+    case msg_type_reply:
+      event = msg_reply;
+      break;
+    case msg_type_hello:
+      return receive_hello(conn, status, data);
+    case msg_type_channel:
+      return receive_channel_message(conn, status, data);
+    case msg_type_heartbeat:
+      return receive_heartbeat(conn, status, data);
+    default:
+      // Drop unknown types.
+      msg_delete_data(data);
+      return;
+  }
 
-static void array__remove_last(Array array) {
-  array__remove_item(array, array__item_ptr(array, array->count - 1));
-}
+  Metadata *metadata = metadata_of_data(data);
 
-// This releases array[index], sets array[index] = array[count - 1], and
-// shortens the array by 1. Effectively, it quickly removes an element.
-static void array__remove_and_fill(Array array, int index) {
-  void *elt = array__item_ptr(array, index);
-  void *last_elt = array__item_ptr(array, array->count - 1);
-  if (array->releaser) array->releaser(elt, NULL);
-  if (elt != last_elt) memcpy(elt, last_elt, array->item_size);
-  array->count--;
-}
+  // Look up a reply_context if it's a reply.
+  if (event == msg_reply) {
+    void *reply_context;
+    if (!find_reply_context(conn, status, header->message_type,
+                            header->reply_id, &reply_context)) {
+      send_callback_remote_error(conn, "Unrecognized reply_id",
+                                 address_of_conn(conn));
+      msg_delete_data(data);
+      return;
+    }
+    conn->reply_context = reply_context;
+    metadata->reply_context = reply_context;  // Restored by make_call.
+    // Clear reply_id so a nested msg_send isn't interpreted as a reply itself.
+    conn->reply_id = 0;
+  } else {
+    conn->reply_context = NULL;
+  }
 
-static msg_Conn *new_connection(void *conn_context, msg_Callback callback) {
-  msg_Conn *conn = dbgcheck__malloc(sizeof(msg_Conn), "msg_Conn");
-  memset(conn, 0, sizeof(msg_Conn));
-  conn->conn_context = conn_context;
-  conn->callback = callback;
-  return conn;
+  send_callback(conn, event, data, free_nothing, no_set_name);
 }
 
-static void address_releaser(void *address_vp, void *context) {
-  dbgcheck__free(address_vp, "Address");
+// The sender fills every fragment of a message but the last, so one fragment's
+// index and size fix the offset of each of them. Returns that common size, or
+// 0 if the fragment can't be part of a message of message_len bytes.
+static size_t fragment_len_of(int index, int num_fragments, size_t offset,
+                              size_t num_bytes, size_t message_len) {
+  if (index >= num_fragments) return 0;
+  int    is_last      = (index == num_fragments - 1);
+  size_t fragment_len = (is_last && index > 0) ? offset / index : num_bytes;
+  size_t max_len      = (size_t)num_fragments * fragment_len;
+  int    is_valid     = (fragment_len > 0 && fragment_len <= udp_max_gso_len &&
+                         offset == (size_t)index * fragment_len &&
+                         message_len <= max_len &&
+                         message_len > max_len - fragment_len);
+  if (is_last) is_valid = is_valid && offset + num_bytes == message_len;
+  return is_valid ? fragment_len : 0;
 }
 
-static void init_if_needed() {
-  static int init_done = false;
-  if (init_done) return;
-
-  library_init;
-
-  immediate_callbacks = array__new(16, sizeof(PendingCall));
-  conns    = array__new(8, sizeof(msg_Conn *));
-  removals = array__new(8, sizeof(int));
-  timeouts = array__new(8, sizeof(Timeout));
-  init_poll_fds();
+// Returns an error string if the incoming fragmented message described by
+// header is larger than msg_config.max_reassembly_size; returns no_error (NULL)
+// otherwise.
+static const char *reassembly_size_error(Header *header) {
+  size_t max_size = msg_config.max_reassembly_size;
+  if (max_size == 0 || header->num_bytes <= max_size) return no_error;
+  static char err_msg[1024];
+  snprintf(err_msg, 1024,
+           "Incoming message of %u bytes exceeds max_reassembly_size "
+           "(%zd bytes)", header->num_bytes, max_size);
+  return err_msg;
+}
 
-  conn_status = map__new(address_hash, address_eq);
-  conn_status->key_releaser   = address_releaser;
-  conn_status->value_releaser = delete_conn_status;
+// Adds an incoming fragment to its message, and dispatches the message once all
+// of its fragments have arrived. Invalid and duplicate fragments are dropped.
+static void receive_fragment(msg_Conn *conn, ConnStatus *status,
+                             msg_Data data) {
+  if (data.num_bytes < fragment_header_len) return msg_delete_data(data);
+
+  FragmentHeader fragment;
+  memcpy(&fragment, data.bytes, fragment_header_len);
+  uint32_t message_id    = ntohl(fragment.message_id);
+  int      index         = ntohs(fragment.index);
+  int      num_fragments = ntohs(fragment.num_fragments);
+  size_t   offset        = ntohl(fragment.offset);
+  size_t   num_bytes     = data.num_bytes - fragment_header_len;
+  Header   header        = {
+    .message_type = ntohs(fragment.message_type),
+    .reply_id     = ntohs(fragment.reply_id),
+    .num_bytes    = ntohl(fragment.num_bytes)
+  };
+  uint32_t wide_reply_id = metadata_of_data(data)->header.reply_id;
+  if (wide_reply_id) header.reply_id = wide_reply_id;
+
+  size_t fragment_len = fragment_len_of(index, num_fragments, offset,
+                                        num_bytes, header.num_bytes);
+  if (fragment_len == 0) return msg_delete_data(data);
+
+  Reassembly *reassembly = find_reassembly(status, message_id);
+  if (reassembly == NULL) {
+    if (header.message_type == msg_type_fragment) return msg_delete_data(data);
+
+    const char *err_msg = message_size_error(&header);
+    if (err_msg == no_error) err_msg = reassembly_size_error(&header);
+    if (err_msg) {
+      msg_delete_data(data);
+      return send_callback_remote_error(conn, err_msg, address_of_conn(conn));
+    }
+    const char *reason = NULL;
+    if (is_over_budget(header.num_bytes + num_fragments)) {
+      reason = "memory budget exceeded";
+    } else {
+      reassembly = new_reassembly(status, message_id, &header, num_fragments,
+                                  fragment_len);
+      if (reassembly == NULL) reason = "out of memory";
+    }
+    if (reason) {
+      msg_delete_data(data);
+      memory_stats.num_messages_refused++;
+      static char msg[1024];
+      snprintf(msg, 1024, "Refused an incoming message of %u bytes from %s: "
+               "%s", header.num_bytes, msg_address_str(conn), reason);
+      return send_callback_shed(conn, msg);
+    }
+  }
 
-  init_done = true;
+  // Drop duplicates and fragments that don't fit the message as first seen.
+  Header *expected = &reassembly->header;
+  if (num_fragments != reassembly->num_fragments ||
+      fragment_len != reassembly->fragment_len ||
+      header.num_bytes != expected->num_bytes ||
+      reassembly->received[index]) {
+    return msg_delete_data(data);
+  }
+  memcpy(reassembly->data.bytes + offset, data.bytes + fragment_header_len,
+         num_bytes);
+  msg_delete_data(data);
+  reassembly->received[index] = true;
+  if (++reassembly->num_received < reassembly->num_fragments) return;
+
+  // The message is complete.
+  msg_Data message = reassembly->data;
+  header           = *expected;
+  end_reassembly(status, reassembly);
+
+  Metadata *metadata = metadata_of_data(message);
+  metadata->reply_context  = NULL;
+  metadata->remote_address = *address_of_conn(conn);
+  metadata->header         = header;
+  conn->reply_id           = header.reply_id;
+  dispatch_message(conn, status, &header, message);
 }
 
-static void send_callback(msg_Conn *conn, msg_Event event, msg_Data data,
-                          void *to_free, const char *set_name) {
-  PendingCall pending_callback = {
-    .conn = conn,
-    .event = event,
-    .data = { data.num_bytes, data.bytes },
-    .to_free = to_free,
-    .set_name = set_name };
-  array__add_item_val(immediate_callbacks, pending_callback);
+// Sends a one-way message of the given type to the remote of status, which may
+// be any of the remotes of a listening udp conn.
+// Returns no_error (NULL) on success; returns the name of the failing system
+// call on error, and get_errno() returns the error code.
+static char *send_to_remote(msg_Conn *conn, ConnStatus *status,
+                            uint16_t msg_type, msg_Data data) {
+  Address saved_address  = *address_of_conn(conn);
+  *address_of_conn(conn) = status->remote_address;
+  int reply_id = 0;
+  set_header(conn, data, msg_type, reply_id, (uint32_t)data.num_bytes);
+  char *failed_sys_call = send_message(conn, data);
+  *address_of_conn(conn) = saved_address;
+  return failed_sys_call;
 }
 
-static void send_callback_error(msg_Conn *conn, const char *msg,
-                                void *to_free, const char *set_name) {
-  send_callback(conn, msg_error, msg_new_data(msg), to_free, set_name);
+// Returns a new frame for a message on the given channel. The frame's ack
+// fields are set as it's sent.
+static msg_Data new_channel_frame(int index, msg_Delivery delivery,
+                                  uint32_t sequence, msg_Data data) {
+  msg_Data frame = msg_new_data_space(channel_header_len + data.num_bytes);
+  ChannelHeader channel_header = {
+    .delivery = delivery,
+    .channel  = index,
+    .sequence = htonl(sequence)
+  };
+  memcpy(frame.bytes, &channel_header, channel_header_len);
+  if (data.num_bytes) {
+    memcpy(frame.bytes + channel_header_len, data.bytes, data.num_bytes);
+  }
+  return frame;
 }
 
-static void send_callback_os_error(msg_Conn *conn, const char *msg,
-                                   void *to_free, const char *set_name) {
-  static char err_msg[1024];
-  snprintf(err_msg, 1024, "%s: %s", msg, err_str());
-  send_callback_error(conn, err_msg, to_free, set_name);
+// Sends frame, a message on channel, to the remote of status with the latest
+// acks for that channel.
+// Returns no_error (NULL) on success; returns the name of the failing system
+// call on error, and get_errno() returns the error code.
+static char *send_channel_frame(msg_Conn *conn, ConnStatus *status,
+                                Channel *channel, msg_Data frame) {
+  uint32_t ack, ack_bits;
+  get_acks(channel, &ack, &ack_bits);
+  ChannelHeader *channel_header = (ChannelHeader *)frame.bytes;
+  channel_header->ack      = htonl(ack);
+  channel_header->ack_bits = htonl(ack_bits);
+  channel->ack_pending     = false;
+  return send_to_remote(conn, status, msg_type_channel, frame);
 }
 
-static void make_call(PendingCall *call) {
-  msg_Conn *   conn   = call->conn;
-  ConnStatus * status = NULL;  // We'll set this if needed in the udp case.
+// Sends the reliable messages of channel that have entered the window, and
+// resends those that have waited too long for an ack.
+// Returns no_error (NULL) on success; returns the name of the failing system
+// call on error, and get_errno() returns the error code.
+static char *send_reliable_messages(msg_Conn *conn, ConnStatus *status,
+                                    Channel *channel, double time_now) {
+  Array unacked = channel->unacked;
+  if (unacked->count == 0) return no_error;
+
+  // Messages wait, unsent, until the remote's hello arrives.
+  if (!peer_sent_hello(status)) {
+    resend_hello_if_due(conn, status);
+    return no_error;
+  }
+  ReliableMessage *oldest = array__item_ptr(unacked, 0);
+  uint32_t window_end = oldest->sequence + reliable_window;
+
+  array__for(ReliableMessage *, message, unacked, i) {
+    if (!is_before(message->sequence, window_end)) break;
+    if (message->num_sends) {
+      double wait = min_resend_sec;
+      for (int j = 1; j < message->num_sends && wait < max_resend_sec; ++j) {
+        wait *= 2;
+      }
+      if (wait > max_resend_sec) wait = max_resend_sec;
+      if (time_now - message->sent_at < wait) continue;
+    }
+    // A failed send counts as a send so that errors are reported no more often
+    // than resends are made.
+    message->num_sends++;
+    message->sent_at = time_now;
+    char *failed_sys_call = send_channel_frame(conn, status, channel,
+                                               message->data);
+    if (failed_sys_call) return failed_sys_call;
+  }
+  return no_error;
+}
 
-  char *addr_str = "<uninitialized address>";
+// Sends a bare ack on the given channel.
+static char *send_ack(msg_Conn *conn, ConnStatus *status, int index) {
+  uint32_t sequence = 0;
+  msg_Data frame = new_channel_frame(index, msg_unreliable, sequence,
+                                     msg_no_data);
+  char *failed_sys_call = send_channel_frame(conn, status,
+                                             status->channels[index], frame);
+  msg_delete_data(frame);
+  return failed_sys_call;
+}
 
-  // Copy metadata from msg_Data/status to msg_Conn for udp messages.
-  if (conn->protocol_type == msg_udp && call->data.bytes) {
-    msg_Data data          = call->data;
-    Metadata *metadata     = (Metadata *)(data.bytes - metadata_len);
-    conn->reply_context    = metadata->reply_context;
-    *address_of_conn(conn) = metadata->remote_address;
-    status                 = status_of_conn(conn);
+// Returns true if the remote of status has gone msg_config.reliable_timeout
+// without acknowledging a reliable message.
+static int has_overdue_message(ConnStatus *status, double time_now) {
+  double timeout = msg_config.reliable_timeout;
+  if (timeout <= 0) return false;
+  for (int i = 0; i < max_channels; ++i) {
+    Channel *channel = status->channels[i];
+    if (channel == NULL || channel->unacked->count == 0) continue;
+    ReliableMessage *oldest = array__item_ptr(channel->unacked, 0);
+    if (time_now - oldest->queued_at > timeout) return true;
+  }
+  return false;
+}
 
-    if (verbosity >= 3) {
-      addr_str = address_as_str(&metadata->remote_address);
+static void lose_remote(msg_Conn *conn,
+                        ConnStatus *status);  // Defined below.
+
+// Sends the messages that have entered their window, the resends, and the acks
+// not yet carried by other channel messages, for every remote with channels.
+// Remotes with an overdue reliable message are lost.
+static void update_channels(double time_now) {
+  array__for(ConnStatus **, status_ptr, channel_statuses, i) {
+    ConnStatus *status = *status_ptr;
+    msg_Conn *  conn   = conn_of_id(status->conn_id);
+    if (conn == NULL) continue;  // The status outlived a listening conn.
+    if (has_overdue_message(status, time_now)) {
+      lose_remote(conn, status);
+      i--;  // The status left channel_statuses; its place is refilled.
+      continue;
     }
-
-    // Unless this is a msg_error, we expect a udp callback to have a status.
-    assert(call->event == msg_error || status);
-    if (status) {
-      if (verbosity >= 3) {
-        printf("<pid %d> restoring conn_context=%p for address %s "
-               "(status=%p)\n",
-               getpid(), status->conn_context, addr_str, status);
+    for (int j = 0; j < max_channels; ++j) {
+      Channel *channel = status->channels[j];
+      if (channel == NULL) continue;
+      char *failed_sys_call = send_reliable_messages(conn, status, channel,
+                                                     time_now);
+      if (failed_sys_call == no_error && channel->ack_pending) {
+        failed_sys_call = send_ack(conn, status, j);
+      }
+      if (failed_sys_call) {
+        static char err_msg[1024];
+        snprintf(err_msg, 1024, "%s: %s", failed_sys_call, err_str());
+        send_callback_remote_error(conn, err_msg, &status->remote_address);
       }
-      conn->conn_context = status->conn_context;
-    } else if (verbosity >= 3) {
-      printf("<pid %d> no status to restore conn_context from; address=%s\n",
-          getpid(), addr_str);
     }
   }
+}
 
-  conn->callback(conn, call->event, call->data);
-
-  // Save the user's conn_context in case they changed it.
-  if (conn->protocol_type == msg_udp && status) {
-    status->conn_context = conn->conn_context;
-    if (verbosity >= 3) {
-      printf("<pid %d> saving conn_context=%p for address %s (status=%p)\n",
-          getpid(), conn->conn_context, addr_str, status);
+// Sends the batches whose time has come.
+static void send_due_batches(double time_now) {
+  array__for(ConnStatus **, status_ptr, batch_statuses, i) {
+    ConnStatus *status = *status_ptr;
+    if (status->batch_due_at > time_now) continue;
+    msg_Conn *conn = conn_of_id(status->conn_id);
+    i--;  // Either way, status leaves batch_statuses; its place is refilled.
+    if (conn == NULL) {  // The status outlived a listening conn.
+      drop_batch(status);
+      continue;
+    }
+    char *failed_sys_call = send_batch(conn, status);
+    if (failed_sys_call) {
+      static char err_msg[1024];
+      snprintf(err_msg, 1024, "%s: %s", failed_sys_call, err_str());
+      send_callback_remote_error(conn, err_msg, &status->remote_address);
     }
   }
+}
 
-  if (call->data.bytes) msg_delete_data(call->data);
-  if (call->to_free) dbgcheck__free(call->to_free, call->set_name);
+// Returns how many milliseconds msg_runloop may wait before the next batch is
+// due, rounded up, or -1 if no batch is waiting.
+static int ms_until_batch_due(double time_now) {
+  if (batch_statuses->count == 0) return -1;
+  ConnStatus *first  = array__item_val(batch_statuses, 0, ConnStatus *);
+  double      due_at = first->batch_due_at;
+  array__for(ConnStatus **, status_ptr, batch_statuses, i) {
+    ConnStatus *status = *status_ptr;
+    if (status->batch_due_at < due_at) due_at = status->batch_due_at;
+  }
+  if (due_at <= time_now) return 0;
+  return (int)((due_at - time_now) * 1000 + 0.999);
 }
 
-// Returns no_error (NULL) on success, and sets the protocol_type,
-// remote_ip, and remote_port of the given conn.
-// Returns an error string if there was an error.
-static const char *parse_address_str(const char *address, msg_Conn *conn) {
-  assert(conn != NULL);
-  static char err_msg[1024];
+// Handles an incoming channel message, which holds acks for our own reliable
+// messages on its channel, along with a message for the user unless it's a
+// bare ack. Messages are delivered as msg_message events.
+static void receive_channel_message(msg_Conn *conn, ConnStatus *status,
+                                    msg_Data data) {
+  if (data.num_bytes < channel_header_len) return msg_delete_data(data);
+
+  ChannelHeader channel_header;
+  memcpy(&channel_header, data.bytes, channel_header_len);
+  int      index    = channel_header.channel;
+  int      delivery = channel_header.delivery;
+  uint32_t sequence = ntohl(channel_header.sequence);
+  if (index >= max_channels || delivery > msg_unreliable_sequenced ||
+      (delivery != msg_unreliable && sequence == 0)) {
+    return msg_delete_data(data);
+  }
 
-  // TODO once v1 functionality is done, see if I can
-  // encapsulate the error pattern into a one-liner; eg with a macro.
+  Channel *channel = channel_of_status(status, index);
+  receive_acks(channel, ntohl(channel_header.ack),
+               ntohl(channel_header.ack_bits));
+  if (delivery == msg_unreliable) return msg_delete_data(data);
 
-  // Parse the protocol type; either tcp or udp.
-  const char *tcp_prefix = "tcp://";
-  const char *udp_prefix = "udp://";
-  size_t prefix_len = 6;
-  if (strncmp(address, tcp_prefix, prefix_len) == 0) {
-    conn->protocol_type = SOCK_STREAM;
-  } else if (strncmp(address, udp_prefix, prefix_len) == 0) {
-    conn->protocol_type = SOCK_DGRAM;
-  } else {
-    // The address has no recognizable prefix.
-    snprintf(err_msg, 1024, "Failing due to unrecognized prefix: %s", address);
-    return err_msg;
+  Header header = {
+    .message_type = msg_type_one_way,
+    .reply_id     = 0,
+    .num_bytes    = (uint32_t)(data.num_bytes - channel_header_len)
+  };
+  msg_Data message = msg_new_data_space(header.num_bytes);
+  memcpy(message.bytes, data.bytes + channel_header_len, header.num_bytes);
+  msg_delete_data(data);
+  Metadata *metadata = metadata_of_data(message);
+  metadata->reply_context  = NULL;
+  metadata->remote_address = *address_of_conn(conn);
+  metadata->header         = header;
+
+  if (delivery == msg_unreliable_sequenced) {
+    if (!is_before(channel->newest_sequenced, sequence)) {
+      return msg_delete_data(message);
+    }
+    channel->newest_sequenced = sequence;
+    return dispatch_message(conn, status, &header, message);
   }
 
-  // Parse the ip substring in three steps.
-  // 1. Find the start and end of the ip substring.
-  const char *ip_start = address + prefix_len;
-  char *colon = strchr(ip_start, ':');
-  if (colon == NULL) {
-    snprintf(err_msg, 1024,
-             "Can't parse address '%s'; missing colon after ip", address);
-    return err_msg;
+  // At this point, delivery is msg_reliable_ordered. Duplicates are acked too,
+  // since the ack of the first copy may have been lost.
+  channel->ack_pending = true;
+  if (is_before(sequence, channel->next_expected) ||
+      sequence - channel->next_expected >= reliable_window) {
+    return msg_delete_data(message);
   }
-
-  // 2. Check substring length and copy over so we can hand inet_pton a
-  // null-terminated version.
-  long ip_len = colon - ip_start;
-  if (ip_len > 15 || ip_len < 1) {
-    snprintf(err_msg, 1024,
-        "Failing because ip length=%ld; expected to be 1-15 (in addresss '%s')",
-        ip_len, address);
-    return err_msg;
+  if (sequence != channel->next_expected) {
+    int i = sequence % reliable_window;
+    if (channel->held_sequences[i] == sequence) return msg_delete_data(message);
+    channel->held[i]           = message;
+    channel->held_sequences[i] = sequence;
+    memory_stats.incoming_bytes += message.num_bytes;
+    return;
   }
-  char ip_str[16];
-  char *ip_str_end = stpncpy(ip_str, ip_start, ip_len);
-  *ip_str_end = '\0';
 
-  // 3. Let inet_pton handle the actual parsing.
-  if (strcmp(ip_str, "*") == 0) {
-    conn->remote_ip = INADDR_ANY;
-  } else {
-    struct in_addr ip;
-    if (inet_pton(AF_INET, ip_str, &ip) != 1) {
-      snprintf(err_msg, 1024, "Couldn't parse ip string '%s'.", ip_str);
-      return err_msg;
-    }
-    conn->remote_ip = ip.s_addr;
+  // Deliver this message along with any held ones that are now in order.
+  for (;;) {
+    dispatch_message(conn, status, &header, message);
+    uint32_t next = ++channel->next_expected;
+    int i = next % reliable_window;
+    if (channel->held_sequences[i] != next) break;
+    message = channel->held[i];
+    header  = metadata_of_data(message)->header;
+    channel->held_sequences[i] = 0;
+    memory_stats.incoming_bytes -= message.num_bytes;
   }
+}
 
-  // Parse the port.
-  int base_ten = 10;
-  char *end_ptr = NULL;
-  if (*(colon + 1) == '\0') {
-    snprintf(err_msg, 1024, "Empty port string in address '%s'", address);
-    return err_msg;
+// Unpacks an incoming batch into its messages and dispatches each one in turn.
+// A malformed message ends the batch.
+static void receive_batch(msg_Conn *conn, ConnStatus *status, msg_Data data) {
+  size_t offset = 0;
+  while (offset < data.num_bytes) {
+    Header header;
+    int wire_len = parse_header(data.bytes + offset, data.num_bytes - offset,
+                                &header);
+    if (wire_len <= 0 || (header.message_type & batch_type_bit)) break;
+    offset += wire_len;
+    if (header.num_bytes > data.num_bytes - offset) break;
+
+    msg_Data message = msg_new_data_space(header.num_bytes);
+    memcpy(message.bytes, data.bytes + offset, header.num_bytes);
+    offset += header.num_bytes;
+    Metadata *metadata = metadata_of_data(message);
+    metadata->reply_context  = NULL;
+    metadata->remote_address = *address_of_conn(conn);
+    metadata->header         = header;
+
+    conn->reply_id = header.reply_id;
+    dispatch_message(conn, status, &metadata->header, message);
   }
-  conn->remote_port = (int)strtol(colon + 1, &end_ptr, base_ten);
-  if (*end_ptr != '\0') {
-    snprintf(err_msg, 1024, "Invalid port string in address '%s'", address);
-    return err_msg;
+  msg_delete_data(data);
+}
+
+// Sends a heartbeat of the given kind to the remote of status.
+static void send_heartbeat(msg_Conn *conn, ConnStatus *status, int kind) {
+  msg_Data data = msg_new_data_space(1);
+  data.bytes[0] = kind;
+  char *failed_sys_call = send_to_remote(conn, status, msg_type_heartbeat,
+                                         data);
+  msg_delete_data(data);
+  if (failed_sys_call) {
+    static char err_msg[1024];
+    snprintf(err_msg, 1024, "%s: %s", failed_sys_call, err_str());
+    send_callback_remote_error(conn, err_msg, &status->remote_address);
   }
+}
 
-  return no_error;
+// Answers a ping. Every incoming message, including this one, has already
+// updated the remote's last_seen_at.
+static void receive_heartbeat(msg_Conn *conn, ConnStatus *status,
+                              msg_Data data) {
+  int is_ping = (data.num_bytes >= 1 && data.bytes[0] == heartbeat_ping);
+  msg_delete_data(data);
+  if (is_ping) send_heartbeat(conn, status, heartbeat_pong);
 }
 
-static void set_header(msg_Data data,
-                       uint16_t msg_type,
-                       uint16_t reply_id,
-                       uint32_t num_bytes) {
+// Sends a msg_error for each msg_get still waiting on the remote of status,
+// with its reply_context, and forgets them along with their timeouts.
+static void fail_pending_gets(msg_Conn *conn, ConnStatus *status,
+                              const char *msg) {
+  for (int i = 0; i < status->num_reply_slots; ++i) {
+    uint32_t reply_id = status->reply_slots[i].reply_id;
+    if (reply_id == 0) continue;
+    void *reply_context = NULL;
+    if (!take_reply_context(status, reply_id, &reply_context)) continue;
 
-  Header *header = (Header *)(data.bytes - header_len);
-  *header = (Header) {
-    .message_type = htons(msg_type),
-    .reply_id     = htons(reply_id),
-    .num_bytes    = htonl(num_bytes) };
+    msg_Data data = msg_new_data(msg);
+    Metadata *metadata = metadata_of_data(data);
+    metadata->reply_context  = reply_context;
+    metadata->remote_address = status->remote_address;
+    send_callback(conn, msg_error, data, free_nothing, no_set_name);
+  }
 }
 
-static void remove_conn_at(int index) {
-  array__remove_and_fill(conns, index);
-  if (index < conns->count) {
-    msg_Conn *filled_conn = array__item_val(conns, index, msg_Conn *);
-    filled_conn->index = index;
+// Reports the remote of status as lost, which deletes its status.
+static void lose_remote(msg_Conn *conn, ConnStatus *status) {
+  if (!is_listening_udp(conn)) {
+    return local_disconnect(conn, msg_connection_lost);
   }
 
-  remove_from_poll_fds(index);
+  // A listening udp conn stands in for the lost remote while it's disconnected.
+  Address saved_address  = *address_of_conn(conn);
+  *address_of_conn(conn) = status->remote_address;
+  local_disconnect(conn, msg_connection_lost);
+  *address_of_conn(conn) = saved_address;
 }
 
-// Drops the conn from conn_status and sends the given event, which
-// should be one of msg_connection_{closed,lost}.
-static void local_disconnect(msg_Conn *conn, msg_Event event) {
-  Address *address = (Address *)(&conn->remote_ip);
-  map__unset(conn_status, address);
+// Checks on the remote of status as part of the out_beats rotation.
+static void visit_remote(ConnStatus *status, double time_now) {
+  msg_Conn *conn = conn_of_id(status->conn_id);
+  if (conn == NULL) return;  // The status outlived a listening conn.
 
-  // A listening udp conn is a special case as it lives until an unlisten call.
-  int is_listening_udp = (conn->for_listening &&
-                          conn->protocol_type == msg_udp);
+  // A remote that hasn't sent a hello can't answer heartbeats.
+  if (!peer_sent_hello(status)) return resend_hello_if_due(conn, status);
 
-  void *to_free = is_listening_udp ? NULL : conn;
-  const char *set_name = is_listening_udp ? NULL : "msg_Conn";
-  send_callback(conn, event, msg_no_data, to_free, set_name);
+  double interval  = msg_config.heartbeat_interval;
+  double quiet_for = time_now - status->last_seen_at;
+  if (quiet_for > interval * msg_config.max_missed_heartbeats) {
+    return lose_remote(conn, status);
+  }
+  if (quiet_for >= interval) send_heartbeat(conn, status, heartbeat_ping);
+}
 
-  if (is_listening_udp) return;
+// Makes the visits of the out_beats rotation that have come due since the last
+// run loop.
+static void check_heartbeats(double time_now) {
+  double interval = msg_config.heartbeat_interval;
+  double elapsed  = time_now - last_beats_at;
+  last_beats_at   = time_now;
+  if (interval <= 0 || out_beats->count == 0) return;
+
+  // Visits are made a whole number at a time; the remainder carries over.
+  beats_owed += out_beats->count * elapsed / interval;
+  if (beats_owed > out_beats->count) beats_owed = out_beats->count;
+  for (; beats_owed >= 1 && out_beats->count; beats_owed -= 1) {
+    if (next_beat < 0 || next_beat >= out_beats->count) {
+      next_beat = out_beats->count - 1;
+    }
+    ConnStatus *status = array__item_val(out_beats, next_beat, ConnStatus *);
+    next_beat--;
+    visit_remote(status, time_now);
+  }
+}
 
-  closesocket(conn->socket);
-  array__add_item_val(removals, conn->index);
+// Evicts the remote of status, which belongs to a listening udp conn. This is
+// reported as msg_connection_lost. A status left behind by msg_unlisten has
+// nobody to report to, so it's simply deleted.
+static void evict_remote(ConnStatus *status) {
+  msg_Conn *conn = conn_of_id(status->conn_id);
+  if (conn) return lose_remote(conn, status);
+  void *reply_context;
+  for (int i = 0; i < status->num_reply_slots; ++i) {
+    uint32_t reply_id = status->reply_slots[i].reply_id;
+    if (reply_id) take_reply_context(status, reply_id, &reply_context);
+  }
+  unset_conn_status(&status->remote_address);
 }
 
-// Reads the header of a message.
-// For udp packets, the next recv will still include the header.
-// For tcp packets, the next recv will be just after the header.
-// Returns true on success; false on failure.
-static int read_header(int sock, msg_Conn *conn, Header *header) {
-  // A (char *) header pointer works for all versions of recv, which take
-  // either char * or void *.
-  long bytes_recvd = recv(sock, (char *)header, header_len, MSG_PEEK);
+// Moves the evict_hand one step. Returns true if it evicted a remote; the hand
+// evicts a remote that's been idle for udp_idle_ttl, or else, if must_evict is
+// true, one that's not been heard from since the hand last passed it.
+static int step_evict_hand(double time_now, int must_evict) {
+  if (evict_hand < 0 || evict_hand >= out_beats->count) {
+    evict_hand = out_beats->count - 1;
+  }
+  ConnStatus *status = array__item_val(out_beats, evict_hand, ConnStatus *);
+  evict_hand--;
+  if (get_conn_status(&status->remote_address) != status) return false;
+
+  double ttl     = msg_config.udp_idle_ttl;
+  int    is_idle = (ttl > 0 && time_now - status->last_seen_at > ttl);
+  if (is_idle || (must_evict && !status->is_recent)) {
+    evict_remote(status);
+    return true;
+  }
+  status->is_recent = false;
+  return false;
+}
 
-  // In some cases, a tcp message header may be cut off, so we want to
-  // asynchronously wait. Poor header.
-  if (bytes_recvd > 0 && bytes_recvd < header_len) return false;
+// Evicts remotes of listening udp conns that have been idle for too long, and
+// the least recently heard from remotes beyond msg_config.max_udp_remotes.
+static void evict_idle_remotes(double time_now) {
+  double elapsed = time_now - last_sweeps_at;
+  last_sweeps_at = time_now;
+
+  // Every remote is spared at most once, so two passes are enough.
+  size_t max_remotes = msg_config.max_udp_remotes;
+  for (int steps = 2 * out_beats->count;
+       max_remotes && num_conn_statuses > max_remotes && steps > 0; --steps) {
+    step_evict_hand(time_now, true);
+  }
 
-  if (bytes_recvd == 0 ||
-      (bytes_recvd == -1 && get_errno() == err_conn_reset)) {
-    local_disconnect(conn, msg_connection_lost);
-    return false;
+  // Check each remote for idleness about four times per ttl.
+  double ttl = msg_config.udp_idle_ttl;
+  if (ttl <= 0 || out_beats->count == 0) return;
+  sweeps_owed += 4 * out_beats->count * elapsed / ttl;
+  if (sweeps_owed > out_beats->count) sweeps_owed = out_beats->count;
+  for (; sweeps_owed >= 1 && out_beats->count; sweeps_owed -= 1) {
+    step_evict_hand(time_now, false);
   }
-  
-  // We ignore err_win_msg_size; it only tells us that we didn't get the full
-  // udp message.
-  if (bytes_recvd == -1 && get_errno() != err_win_msg_size) {
-    if (get_errno() == err_would_block) return false;
-    send_callback_os_error(conn, "recv", free_nothing, no_set_name);
-    return false;
+}
+
+// Handles a complete incoming udp message. The caller sets up conn's remote
+// address to be the sender's.
+static void receive_udp_message(msg_Conn *conn, Header *header,
+                                msg_Data data) {
+
+  // A close from an unknown remote is dropped rather than announced as a new
+  // connection.
+  if (header->message_type == msg_type_close) {
+    msg_delete_data(data);
+    if (status_of_conn(conn)) local_disconnect(conn, msg_connection_closed);
+    return;
   }
-  
-  // Mark the header as read in the tcp case.
-  if (conn->protocol_type == msg_tcp) {
-    int default_options = 0;
-    recv(sock, (char *)header, header_len, default_options);
+
+  // We don't save the current conn_context because the user may have
+  // reasonably changed the remote address without changing the conn_context
+  // in order to send a message from the same socket - specifically, this is
+  // tricky for a listening udp socket. So we don't know at this point that
+  // conn_context is correctly associated with the conn's current remote
+  // address.
+
+  // Don't take on the state of a new remote when memory is short.
+  if (is_listening_udp(conn) && status_of_conn(conn) == NULL &&
+      is_over_budget(sizeof(ConnStatus))) {
+    msg_delete_data(data);
+    memory_stats.num_peers_dropped++;
+    static char msg[1024];
+    snprintf(msg, 1024, "Dropped a message from new remote %s: memory budget "
+             "exceeded", msg_address_str(conn));
+    return send_callback_shed(conn, msg);
   }
 
-  // Convert each field from network to host byte ordering.
-  header->message_type = ntohs(header->message_type);
-  header->reply_id     = ntohs(header->reply_id);
-  header->num_bytes    = ntohl(header->num_bytes);
+  // Save this data's status with the data itself, since this is udp.
+  ConnStatus *status = remote_address_seen(conn);
 
-  conn->reply_id       = header->reply_id;
+  Metadata *metadata = metadata_of_data(data);
+  metadata->reply_context  = NULL;  // reply_context is set for replies later.
+  metadata->remote_address = *address_of_conn(conn);
+  metadata->header         = *header;  // Replaces the header as received.
 
-  if (false) {
-    printf("%s called; header has ", __FUNCTION__);
-    print_bytes((char *)header, sizeof(Header));
+  if (header->message_type == msg_type_fragment) {
+    return receive_fragment(conn, status, data);
+  }
+  dispatch_message(conn, status, header, data);
+}
+
+// Handles one msgbox datagram held in frame, which is not owned by the caller.
+// This is used for the segments of a coalesced gro datagram.
+static void read_udp_frame(msg_Conn *conn, char *frame, size_t frame_len) {
+  Header header;
+  int wire_len = parse_header(frame, frame_len, &header);
+  if (wire_len <= 0) return;  // Drop the runt or malformed datagram.
+  if (header.message_type & checksum_type_bit) {
+    frame_len = strip_checksum(frame, frame_len, wire_len);
+    if (frame_len == 0) return;
+    header.message_type &= ~checksum_type_bit;
+  }
+
+  const char *err_msg = message_size_error(&header);
+  if (err_msg) {
+    return send_callback_remote_error(conn, err_msg, address_of_conn(conn));
+  }
+
+  // Trust the datagram size over the header in case they disagree.
+  if (header.num_bytes > frame_len - wire_len) {
+    header.num_bytes = (uint32_t)(frame_len - wire_len);
   }
 
-  if (false) {
-    char *type_names[] = {
-      "msg_type_one_way",
-      "msg_type_request",
-      "msg_type_reply",
-      "msg_type_heartbeat",
-      "msg_type_close"
-    };
-    printf("pid %d: Read in a header: type=%s #bytes=%d\n",
-           getpid(),
-           type_names[header->message_type],
-           header->num_bytes);
+  msg_Data data = msg_new_data_space(header.num_bytes);
+  memcpy(data.bytes, frame + wire_len, header.num_bytes);
+  conn->reply_id = header.reply_id;
+  receive_udp_message(conn, &header, data);
+}
+
+// Reads a datagram whose header is too long to be received in place in a
+// msg_Data buffer. Returns true iff the caller may immediately call this again.
+static int read_udp_datagram(int sock, msg_Conn *conn) {
+  static char buffer[udp_max_datagram_len];
+  SockAddr  remote_sockaddr;
+  socklen_t remote_sockaddr_size = sizeof(remote_sockaddr);
+  int default_options = 0;
+  long bytes_recvd = recvfrom(sock, buffer, sizeof(buffer), default_options,
+      &remote_sockaddr.any, &remote_sockaddr_size);
+  if (bytes_recvd == -1) {
+    send_callback_os_error(conn, "recvfrom", free_nothing, no_set_name);
+    return false;
   }
 
+  if (set_remote_of_conn(conn, &remote_sockaddr, remote_sockaddr_size)) {
+    read_udp_frame(conn, buffer, bytes_recvd);
+  }
   return true;
 }
 
-// This creates a new ConnStatus struct if none exists for the remote address.
-static ConnStatus *remote_address_seen(msg_Conn *conn) {
+// Reads a datagram from a udp socket with gro turned on. The kernel may have
+// coalesced several equal-sized msgbox datagrams into one, in which case they
+// are split back apart here. Returns true iff the caller may immediately call
+// this again to check for more datagrams.
+static int read_udp_segments(int sock, msg_Conn *conn) {
+  static char buffer[udp_max_datagram_len];
+  struct sockaddr_in remote_sockaddr;
+  int segment_len = 0;
+  long bytes_recvd = recv_udp_gro(sock, buffer, sizeof(buffer),
+                                  &remote_sockaddr, &segment_len);
+  if (bytes_recvd == -1) {
+    if (get_errno() == err_would_block) return false;
+    send_callback_os_error(conn, "recvmsg", free_nothing, no_set_name);
+    return false;
+  }
 
-  ConnStatus *status = status_of_conn(conn);
+  conn->remote_ip   = remote_sockaddr.sin_addr.s_addr;
+  conn->remote_port = ntohs(remote_sockaddr.sin_port);
 
-  if (status == NULL) {
-    // It's a new remote address; set up a new owned Address.
-    status = new_conn_status(0.0, address_of_conn(conn));  // TODO set to now.
+  // A segment length of 0 means this is a single, uncoalesced datagram.
+  if (segment_len == 0) segment_len = (int)bytes_recvd;
+  for (long offset = 0; offset < bytes_recvd; offset += segment_len) {
+    long frame_len = bytes_recvd - offset;
+    if (frame_len > segment_len) frame_len = segment_len;
+    read_udp_frame(conn, buffer + offset, frame_len);
+  }
+  return true;
+}
 
-    status->conn_context = conn->conn_context;
+// Accepts pending connections on a listening tcp socket, up to
+// msg_config.accept_budget of them, so that a backlog of new connections is
+// drained in a few run loops without starving other sockets.
+static void accept_new_conns(msg_Conn *conn) {
+  int budget = msg_config.accept_budget;
+  if (budget < 1) budget = 1;
+
+  for (int i = 0; i < budget; ++i) {
+    struct sockaddr_in remote_addr;
+    const char *failing_fn;
+    int new_sock = accept_non_blocking(conn->socket, &remote_addr, &failing_fn);
+    if (new_sock == -1) {
+      if (get_errno() == err_would_block) return;  // The backlog is empty.
+      send_callback_os_error(conn, failing_fn, free_nothing, no_set_name);
+      return;
+    }
 
-    Address *address = dbgcheck__malloc(sizeof(Address), "Address");
-    *address = *address_of_conn(conn);
+    // Unix stream clients are unnamed, so their remote ip and port are 0.
+    char *unix_path = extra_of_conn(conn)->unix_path;
+    if (unix_path) memset(&remote_addr, 0, sizeof(remote_addr));
 
-    map__set(conn_status, address, status);
+    if (avoid_sigpipe(new_sock) != 0) {
+      send_callback_os_error(conn, "setsockopt", free_nothing, no_set_name);
+      closesocket(new_sock);
+      continue;
+    }
 
-    // Send in the correct remote address with the callback.
-    msg_Data data = msg_new_data_space(0);
-    Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
-    metadata->remote_address = *address;
+    // Close new connections right away when memory is short. Accepting them
+    // first keeps them from waiting in the backlog.
+    if (is_over_budget(sizeof(ConnExtra) + sizeof(ConnStatus))) {
+      closesocket(new_sock);
+      memory_stats.num_conns_rejected++;
+      static char msg[1024];
+      snprintf(msg, 1024, "Rejected a connection from %s:%d: memory budget "
+               "exceeded", inet_ntoa(remote_addr.sin_addr),
+               ntohs(remote_addr.sin_port));
+      send_callback_shed(conn, msg);
+      continue;
+    }
 
-    send_callback(conn, msg_connection_ready, data, free_nothing, no_set_name);
-  }
+    // Accepted sockets inherit the listening socket's options.
+    const msg_SocketOptions *options = &extra_of_conn(conn)->options;
+    const char *failing_call = apply_socket_options(new_sock, conn, options);
+    if (failing_call) {
+      send_callback_os_error(conn, failing_call, free_nothing, no_set_name);
+      closesocket(new_sock);
+      continue;
+    }
 
-  // TODO Update the timing data for this remote address.
+    msg_Conn *new_conn      = new_connection(conn->conn_context,
+                                             conn->callback);
+    extra_of_conn(new_conn)->options = *options;
+    if (unix_path) {
+      extra_of_conn(new_conn)->unix_path = new_unix_path(unix_path);
+    }
+    new_conn->socket        = new_sock;
+    new_conn->remote_ip     = remote_addr.sin_addr.s_addr;
+    new_conn->remote_port   = ntohs(remote_addr.sin_port);
+    new_conn->protocol_type = conn->protocol_type;
+    new_conn->index         = conns->count;
+    array__add_item_val(conns, new_conn);
 
-  return status;
-}
+    add_to_poll_fds(new_sock, poll_mode_read);
 
-// Returns true when the entire message is received;
-// returns false when more data remains but no error occurred;
-// returns -1 when there was an error - the caller must respond to it;
-// returns -2 when a message was interrupted by a connection close.
-static int continue_recv(msg_Conn *conn, ConnStatus *status) {
-  int sock = conn->socket;
-  msg_Data *buffer = &status->waiting_buffer;
-  int default_options = 0;
-  long bytes_in = recv(sock, buffer->bytes, buffer->num_bytes, default_options);
-  if (bytes_in == 0 || (bytes_in == -1 && get_errno() == err_conn_reset)) {
-    local_disconnect(conn, msg_connection_lost);
-    return -2;
+    // This sets up a ConnStatus and sends msg_connection_ready.
+    remote_address_seen(new_conn);
   }
-  if (bytes_in == -1) {
-    if (get_errno() == err_would_block) return false;  // More data is pending.
-    // This is an error we must report; treat the current data as lost.
-    return -1;
-  } 
-
-  buffer->bytes     += bytes_in;
-  buffer->num_bytes -= bytes_in;
-  return buffer->num_bytes == 0;
 }
 
 // Returns true iff the caller may immediately call this again with the same
@@ -1060,53 +4494,17 @@ static int continue_recv(msg_Conn *conn, ConnStatus *status) {
 static int read_from_socket(int sock, msg_Conn *conn) {
   if (verbosity >= 1) {
     fprintf(stderr, "%s(%d, %s)\n",
-            __FUNCTION__, sock, address_as_str(address_of_conn(conn)));
+            __FUNCTION__, sock, msg_address_str(conn));
   }
   ConnStatus *status = NULL;
   Header *header = NULL;
-  Metadata *metadata = NULL;
   msg_Data data;
 
   // Read in any tcp data.
   if (conn->protocol_type == msg_tcp) {
 
     if (conn->for_listening) {
-
-      // Accept a new incoming connection.
-      struct sockaddr_in remote_addr;
-      socklen_t addr_len = sizeof(remote_addr);
-      int new_sock = accept(conn->socket,
-                            (struct sockaddr *)&remote_addr, &addr_len);
-      if (new_sock == -1) {
-        if (get_errno() == err_would_block) return false;
-        send_callback_os_error(conn, "accept", free_nothing, no_set_name);
-        return false;
-			}
-      
-      if (avoid_sigpipe(new_sock) != 0) {
-        send_callback_os_error(conn, "setsockopt", free_nothing, no_set_name);
-        return false;
-      }
-
-      const char *failing_fn = make_non_blocking(new_sock);
-      if (failing_fn) {
-        send_callback_os_error(conn, failing_fn, free_nothing, no_set_name);
-        return false;
-      }
-
-      msg_Conn *new_conn      = new_connection(conn->conn_context,
-                                               conn->callback);
-      new_conn->socket        = new_sock;
-      new_conn->remote_ip     = remote_addr.sin_addr.s_addr;
-      new_conn->remote_port   = ntohs(remote_addr.sin_port);
-      new_conn->protocol_type = conn->protocol_type;
-      new_conn->index         = conns->count;
-      array__add_item_val(conns, new_conn);
-
-      add_to_poll_fds(new_sock, poll_mode_read);
-
-      // This sets up a ConnStatus and sends msg_connection_ready.
-      remote_address_seen(new_conn);
+      accept_new_conns(conn);
       return false;
     }
 
@@ -1120,13 +4518,38 @@ static int read_from_socket(int sock, msg_Conn *conn) {
         local_disconnect(conn, msg_connection_closed);
         return false;
       }
-      new_conn_status_buffer(status, header);
+      const char *err_msg = message_size_error(header);
+      if (err_msg) {
+        // We can't skip over the message body, so the connection is lost.
+        send_callback_error(conn, err_msg, free_nothing, no_set_name);
+        local_disconnect(conn, msg_connection_lost);
+        return false;
+      }
+      size_t chunk_size = msg_config.stream_chunk_size;
+      // Compressed messages and batches are delivered whole.
+      int    do_stream  = (chunk_size && header->num_bytes > chunk_size &&
+                           !(header->message_type & (compressed_type_bit |
+                                                     batch_type_bit)));
+      if (is_over_budget(do_stream ? chunk_size : header->num_bytes)) {
+        // As above, the connection is lost since we can't skip the body.
+        memory_stats.num_messages_refused++;
+        static char msg[1024];
+        snprintf(msg, 1024, "Refused an incoming message of %u bytes: memory "
+                 "budget exceeded", header->num_bytes);
+        send_callback_shed(conn, msg);
+        local_disconnect(conn, msg_connection_lost);
+        return false;
+      }
+      if (do_stream) begin_stream(conn, status, header);
+      new_conn_status_buffer(status, header, 0);
     } else {
 
       // Load header from the buffer we'll continue.
-      header = (Header *)(status->total_buffer.bytes - header_len);
+      header = &metadata_of_data(status->total_buffer)->header;
     }
-    int ret_val = continue_recv(conn, status);
+    // An empty message is complete as soon as its header is read.
+    int is_empty = (status->waiting_buffer.num_bytes == 0);
+    int ret_val  = is_empty ? true : continue_recv(conn, status);
     if (ret_val == -2) return false;  // The message was interrupted by a close.
     if (ret_val == -1) {
       send_callback_os_error(conn, "recv", free_nothing, no_set_name);
@@ -1134,125 +4557,83 @@ static int read_from_socket(int sock, msg_Conn *conn) {
       return false;
     }
     if (ret_val == false) return false;  // It will finish later.
-    data = status->total_buffer;
+    data = take_conn_status_buffer(status);
 
     if (0) {
       printf("After continue_recv, data has ");
       print_bytes(data.bytes, data.num_bytes);
     }
 
-    status->total_buffer = status->waiting_buffer =
-        (msg_Data) { .num_bytes = 0, .bytes = NULL };
-
-  } else {
+    if (status->stream_chunk_size) return deliver_chunk(conn, status, data);
 
-    // New udp message: read the header.
-    header = alloca(sizeof(Header));
-    if (!read_header(sock, conn, header)) return false;
+    dispatch_message(conn, status, header, data);
+    return true;
   }
 
-  if (verbosity >= 2) {  // Debug code.
-    char *msg_type_str[] = {
-      "msg_type_one_way",
-      "msg_type_request",
-      "msg_type_reply",
-      "msg_type_heartbeat",
-      "msg_type_close"
-    };
-    if (header->message_type < (sizeof(msg_type_str) / sizeof(char *))) {
-      printf("Received message of type '%s'.\n",
-             msg_type_str[header->message_type]);
-    } else {
-      printf("Received message of unknown type %d.\n",
-             header->message_type);
-    }
-  }
+  // At this point, conn is a udp socket.
+  if (extra_of_conn(conn)->has_udp_gro) return read_udp_segments(sock, conn);
 
-  // Set up the appropriate reaction event.
-  msg_Event event;
-  switch (header->message_type) {
-    case msg_type_one_way:
-      event = msg_message;
-      // Avoid confusion about whether or not this is a reply.
-      conn->reply_id = 0;
-      break;
-    case msg_type_request:
-      event = msg_request;
-      break;
-    case msg_type_reply:
-      event = msg_reply;
-      break;
-    case msg_type_heartbeat:
-      assert(0);
-      break;
-    case msg_type_close:
-      if (conn->protocol_type == msg_tcp) msg_delete_data(data);
-      local_disconnect(conn, msg_connection_closed);
-      return false;
-  }
+  // New udp message: read the header.
+  header = alloca(sizeof(Header));
+  int wire_len = read_header(sock, conn, header);
+  if (!wire_len) return false;
 
-  // Read in any udp data.
-  if (conn->protocol_type == msg_udp) {
-    data = msg_new_data_space(header->num_bytes);
-    struct sockaddr_in remote_sockaddr;
-    socklen_t remote_sockaddr_size = sock_in_size;
-    int default_options = 0;
-    long bytes_recvd = recvfrom(sock, data.bytes - header_len,
-        data.num_bytes + header_len, default_options,
-        (struct sockaddr *)&remote_sockaddr, &remote_sockaddr_size);
+  // A header with extensions doesn't fit in the space before data.bytes.
+  if (wire_len > in_place_header_len) return read_udp_datagram(sock, conn);
 
-    if (bytes_recvd == -1) {
-      send_callback_os_error(conn, "recvfrom", free_nothing, no_set_name);
-      return false;
-    }
+  const char *err_msg = message_size_error(header);
+  int has_checksum = (header->message_type & checksum_type_bit);
+
+  // Read in the udp data. An oversized datagram is read into an empty buffer,
+  // which drops it since a short recv discards the rest of a datagram.
+  size_t num_bytes = header->num_bytes + (has_checksum ? checksum_len : 0);
+  data = msg_new_data_space(err_msg ? 0 : num_bytes);
+  SockAddr  remote_sockaddr;
+  socklen_t remote_sockaddr_size = sizeof(remote_sockaddr);
+  int default_options = 0;
+  long bytes_recvd = recvfrom(sock, data.bytes - wire_len,
+      data.num_bytes + wire_len, default_options,
+      &remote_sockaddr.any, &remote_sockaddr_size);
 
-    // We don't save the current conn_context because the user may have
-    // reasonably changed the remote address without changing the conn_context
-    // in order to send a message from the same socket - specifically, this is
-    // tricky for a listening udp socket. So we don't know at this point that
-    // conn_context is correctly associated with the conn's current remote
-    // address.
+  if (bytes_recvd == -1) {
+    send_callback_os_error(conn, "recvfrom", free_nothing, no_set_name);
+    msg_delete_data(data);
+    return false;
+  }
 
-    // Save this data's status with the data itself, since this is udp.
-    conn->remote_ip = remote_sockaddr.sin_addr.s_addr;
-    conn->remote_port = ntohs(remote_sockaddr.sin_port);
-    status = remote_address_seen(conn);
+  if (!set_remote_of_conn(conn, &remote_sockaddr, remote_sockaddr_size)) {
+    msg_delete_data(data);
+    return true;
+  }
 
-    metadata = (Metadata *)(data.bytes - metadata_len);
-    metadata->reply_context = NULL;  // reply_context is set for replies below.
-    metadata->remote_address = *address_of_conn(conn);
+  if (err_msg) {
+    send_callback_remote_error(conn, err_msg, address_of_conn(conn));
+    msg_delete_data(data);
+    return true;
   }
 
-  // Look up a reply_context if it's a reply.
-  if (header->message_type == msg_type_reply) {
-    void *reply_id_key = (void *)(intptr_t)header->reply_id;
-    map__key_value *pair = map__get(status->reply_contexts, reply_id_key);
-    if (pair == NULL) {
-      send_callback_error(
-          conn,
-          "Unrecognized reply_id",
-          data.bytes - metadata_len,  // Pointer to free.
-          "msg_Data bytes");          // Set name for dbgcheck free.
-      return false;
+  if (has_checksum) {
+    size_t frame_len = strip_checksum(data.bytes - wire_len, bytes_recvd,
+                                      wire_len);
+    if (frame_len == 0) {
+      msg_delete_data(data);
+      return true;
     }
-    remove_timeout(status, header->reply_id);
-    conn->reply_context = pair->value;
-    if (metadata) metadata->reply_context = pair->value;  // The udp case.
-    map__unset(status->reply_contexts, reply_id_key);
-    // Clear reply_id so a nested msg_send isn't interpreted as a reply itself.
-    conn->reply_id = 0;
-  } else {
-    conn->reply_context = NULL;
+    if (header->num_bytes > frame_len - wire_len) {
+      header->num_bytes = (uint32_t)(frame_len - wire_len);
+    }
+    data.num_bytes = header->num_bytes;
+    header->message_type &= ~checksum_type_bit;
   }
 
-  send_callback(conn, event, data, free_nothing, no_set_name);
+  receive_udp_message(conn, header, data);
   return true;
 }
 
 // Sets up sockaddr based on address. If an error occurs, the error callback
 // is scheduled.  Returns true on success. conn and its polling socket are
 // added to the conns and poll_fds data structures on success.
-static int setup_sockaddr(struct sockaddr_in *sockaddr,
+static int setup_sockaddr(SockAddr *sockaddr,
                           const char *address, msg_Conn *conn) {
   const char *err_msg = parse_address_str(address, conn);
   if (err_msg) {
@@ -1260,8 +4641,10 @@ static int setup_sockaddr(struct sockaddr_in *sockaddr,
     return false;
   }
 
+  char *unix_path = extra_of_conn(conn)->unix_path;
+  int   family    = unix_path ? AF_UNIX : AF_INET;
   int use_default_protocol = 0;
-  int sock = socket(AF_INET, conn->protocol_type, use_default_protocol);
+  int sock = socket(family, conn->protocol_type, use_default_protocol);
   if (sock == -1) {
     send_callback_os_error(conn, "socket", conn, "msg_Conn");
     return false;
@@ -1274,11 +4657,12 @@ static int setup_sockaddr(struct sockaddr_in *sockaddr,
 
   add_to_poll_fds(sock, poll_mode_read);
 
-  // Initialize the sockaddr_in struct.
-  memset(sockaddr, 0, sock_in_size);
-  sockaddr->sin_family = AF_INET;
-  sockaddr->sin_port = htons(conn->remote_port);
-  sockaddr->sin_addr.s_addr = conn->remote_ip;
+  // Initialize the sockaddr struct.
+  if (unix_path) {
+    set_unix_sockaddr(sockaddr, unix_path, NULL);
+  } else {
+    set_sockaddr_for_conn(sockaddr, conn);
+  }
 
   return true;
 }
@@ -1288,12 +4672,14 @@ typedef int (ms_call_conv *SocketOpener)(socket_t,
                                          socklen_t);
 
 static void open_socket(const char *address, void *conn_context,
-    msg_Callback callback, int for_listening) {
+    msg_Callback callback, int for_listening,
+    const msg_SocketOptions *options) {
   init_if_needed();
 
   msg_Conn *conn = new_connection(conn_context, callback);
   conn->for_listening = for_listening;
-  struct sockaddr_in *sockaddr = alloca(sock_in_size);
+  if (options) extra_of_conn(conn)->options = *options;
+  SockAddr *sockaddr = alloca(sizeof(SockAddr));
   if (!setup_sockaddr(sockaddr, address, conn)) {
     return;  // Error; setup_sockaddr now owns conn.
   }
@@ -1305,6 +4691,30 @@ static void open_socket(const char *address, void *conn_context,
     return remove_last_polling_conn();
   }
 
+  // Buffer sizes in particular must be set before a tcp connection is made.
+  failing_fn = apply_socket_options(conn->socket, conn,
+                                    &extra_of_conn(conn)->options);
+  if (failing_fn) {
+    send_callback_os_error(conn, failing_fn, conn, "msg_Conn");
+    return remove_last_polling_conn();
+  }
+
+  // On udp, let the kernel coalesce incoming datagrams if we've been asked to.
+  ConnExtra *extra = extra_of_conn(conn);
+  if (conn->protocol_type == msg_udp && msg_config.udp_offload &&
+      extra->unix_path == NULL) {
+    extra->has_udp_gro = turn_on_udp_gro(conn->socket);
+  }
+
+  // A unix socket's file outlives its process, so a listener takes over any
+  // file left at its path. A unixgram client binds a path of its own first.
+  if (extra->unix_path && for_listening) unlink(extra->unix_path);
+  if (extra->unix_path && !for_listening && conn->protocol_type == msg_udp &&
+      bind_unix_client(conn) == -1) {
+    send_callback_os_error(conn, "bind", conn, "msg_Conn");
+    return remove_last_polling_conn();
+  }
+
   // On tcp, turn on SO_REUSEADDR for easier server restarts.
   if (conn->protocol_type == msg_tcp) {
     int optval = 1;
@@ -1315,9 +4725,9 @@ static void open_socket(const char *address, void *conn_context,
 
   char *sys_call_name = for_listening ? "bind" : "connect";
   SocketOpener sys_open_sock = for_listening ? bind : connect;
-  int ret_val = sys_open_sock(conn->socket,
-                              (struct sockaddr *)sockaddr,
-                              sock_in_size);
+  socklen_t sockaddr_len = (extra->unix_path ? sizeof(struct sockaddr_un) :
+                                               sock_in_size);
+  int ret_val = sys_open_sock(conn->socket, &sockaddr->any, sockaddr_len);
   if (ret_val == -1) {
     int in_progress = (get_errno() == err_in_progress ||
                        get_errno() == err_would_block);
@@ -1327,6 +4737,7 @@ static void open_socket(const char *address, void *conn_context,
       set_conn_to_poll_mode(conns->count - 1, poll_mode_write);
       return;
     }
+    if (!for_listening) unlink_bound_path(conn);
     send_callback_os_error(conn, sys_call_name, conn, "msg_Conn");
     return remove_last_polling_conn();
   }
@@ -1355,6 +4766,12 @@ void msg_runloop(int timeout_in_ms) {
   // Don't delay pending calls.
   if (immediate_callbacks->count) { timeout_in_ms = 0; }
 
+  // Don't wait past the time the next batch is due.
+  int batch_ms = ms_until_batch_due(now());
+  if (batch_ms != -1 && (timeout_in_ms < 0 || batch_ms < timeout_in_ms)) {
+    timeout_in_ms = batch_ms;
+  }
+
   // Clear any conns marked for removal. Public functions work this way so
   // they behave well if called by user functions invoked as callbacks.
   array__for(int *, index, removals, i) remove_conn_at(*index);
@@ -1377,7 +4794,7 @@ void msg_runloop(int timeout_in_ms) {
       array__for(msg_Conn **, conn_ptr, conns, i) {
         msg_Conn *conn = *conn_ptr;
         int   sock     = conn->socket;
-        char *address  = address_as_str(address_of_conn(conn));
+        char *address  = msg_address_str(conn);
         char *type_str = conn->protocol_type == msg_tcp ? "tcp" : "udp";
         char *listn    = conn->for_listening ? "yes" : "no";
         s += snprintf(s, s_end - s, "  %-5d %-25s %-5s %s\n",
@@ -1405,9 +4822,16 @@ void msg_runloop(int timeout_in_ms) {
               poll_fn_name, err_str());
     }
   } else if (ret > 0) {
-    array__for(msg_Conn **, conn_ptr, conns, i) {
-      msg_Conn *conn = *conn_ptr;
-      PollMode poll_mode = poll_fds_mode(conn->socket, i);
+    // The value of ret is the number of ready sockets, so we can stop scanning
+    // once they've all been seen; idle conns are skipped by next_ready_conn
+    // without touching their msg_Conn structs.
+    int num_left = ret;
+    for (int i = 0; num_left > 0; ++i) {
+      PollMode poll_mode;
+      i = next_ready_conn(i, &poll_mode);
+      if (i == conns->count) break;
+      num_left--;
+      msg_Conn *conn = array__item_val(conns, i, msg_Conn *);
 
       // I'm including these since I'm not sure how important they are to track.
       if (verbosity >= 1) {
@@ -1425,6 +4849,7 @@ void msg_runloop(int timeout_in_ms) {
         getsockopt(conn->socket, SOL_SOCKET,
                    SO_ERROR, (char *)&error, &error_len);
         if (error == err_conn_refused || error == err_timed_out) {
+          drop_out_frames(conn);
           array__add_item_val(removals, conn->index);
           set_errno(error);
           send_callback_os_error(conn, "connect", conn, "msg_Conn");
@@ -1436,10 +4861,17 @@ void msg_runloop(int timeout_in_ms) {
         // from trying to send something to a remotely closed connection.
       }
       if (poll_mode & poll_mode_write) {
-        // We only listen for this event when waiting for a tcp connect to
-        // complete.
-        remote_address_seen(conn);  // Sends msg_connection_ready.
-        set_conn_to_poll_mode(i, poll_mode_read);
+        // We listen for this event when waiting for a tcp connect to complete,
+        // or when a tcp conn has queued frames to send.
+        if (has_out_frames(conn)) {
+          if (send_out_frames(conn) == -1) {
+            send_callback_os_error(conn, "send", free_nothing, no_set_name);
+            drop_out_frames(conn);
+          }
+        } else {
+          remote_address_seen(conn);  // Sends msg_connection_ready.
+        }
+        if (!has_out_frames(conn)) set_conn_to_poll_mode(i, poll_mode_read);
       }
       if (poll_mode & poll_mode_read) {
         // TODO Why are the two params to read_from_socket separate, since
@@ -1451,21 +4883,30 @@ void msg_runloop(int timeout_in_ms) {
     array__clear(removals);
   }
 
-  // Check for any unreplied-to udp requests that have timed out.
   double time_now = now();
+  drop_stale_reassemblies(time_now);
+  check_heartbeats(time_now);
+  evict_idle_remotes(time_now);
+
+  // Check for any unreplied-to udp requests that have timed out.
   array__for(Timeout *, timeout, timeouts, i) {
     // The timeouts are soonest-first; stop as soon as one is not in the past.
     if (timeout->at > time_now) break;
 
     // Remove the pending status information and inform the user of the timeout.
-    void *reply_id_key = (void *)(intptr_t)timeout->reply_id;
-    map__key_value *pair = map__get(timeout->status->reply_contexts,
-                                    reply_id_key);
+    msg_Conn *conn = conn_of_id(timeout->conn_id);
+    // Timeouts are dropped along with their status, so conn should be alive.
+    assert(conn);
+    if (conn == NULL) {
+      array__remove_item(timeouts, timeout);
+      i--;
+      continue;
+    }
+    int did_find = take_reply_slot(timeout->status, timeout->reply_id,
+                                   &conn->reply_context);
     // Since we set up the timeout ourselves, it should exist in the status.
-    assert(pair);
-    msg_Conn *conn = timeout->conn;  // Save conn as timeout will soon be freed.
-    conn->reply_context = pair->value;
-    map__unset(timeout->status->reply_contexts, reply_id_key);
+    assert(did_find);
+    (void)did_find;  // Avoid an unused-variable warning in non-DEBUG builds.
     array__remove_item(timeouts, timeout);
     i--;  // Back up one item so the next iteration gets the next item.
     const char *msg = (conn->protocol_type == msg_tcp ? "tcp get timed out" :
@@ -1473,7 +4914,7 @@ void msg_runloop(int timeout_in_ms) {
     
     // Set up metadata as it overrides data in conn within make_call.
     msg_Data data = msg_new_data(msg);
-    Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
+    Metadata *metadata = metadata_of_data(data);
     metadata->reply_context  = conn->reply_context;
     metadata->remote_address = timeout->status->remote_address;
 
@@ -1489,19 +4930,33 @@ void msg_runloop(int timeout_in_ms) {
     make_call(call);
   }
 
-  // TODO Handle timed callbacks - such as heartbeats - and get timeouts.
   array__delete(saved_immediate_callbacks);
+
+  // This follows the callbacks so that acks can ride along with any channel
+  // messages they send.
+  update_channels(time_now);
+  send_due_batches(time_now);
 }
 
 void msg_listen(const char *address, msg_Callback callback) {
-  int for_listening = true;
-  open_socket(address, msg_no_context, callback, for_listening);
+  msg_listen_ex(address, callback, NULL);
 }
 
 void msg_connect(const char *address, msg_Callback callback,
                  void *conn_context) {
+  msg_connect_ex(address, callback, conn_context, NULL);
+}
+
+void msg_listen_ex(const char *address, msg_Callback callback,
+                   const msg_SocketOptions *options) {
+  int for_listening = true;
+  open_socket(address, msg_no_context, callback, for_listening, options);
+}
+
+void msg_connect_ex(const char *address, msg_Callback callback,
+                    void *conn_context, const msg_SocketOptions *options) {
   int for_listening = false;
-  open_socket(address, conn_context, callback, for_listening);
+  open_socket(address, conn_context, callback, for_listening, options);
 }
 
 void msg_unlisten(msg_Conn *conn) {
@@ -1513,6 +4968,11 @@ void msg_unlisten(msg_Conn *conn) {
     const char *err_str = "msg_unlisten called on non-listening connection";
     return send_callback_error(conn, err_str, free_nothing, no_set_name);
   }
+  unlink_bound_path(conn);
+
+  // The remotes of a udp conn can't outlive it.
+  if (conn->protocol_type == msg_udp) drop_remotes_of_listener(conn);
+
   // Tell local_disconnect to free the conn object, even on udp.
   conn->for_listening = false;
   if (closesocket(conn->socket) == -1) {
@@ -1528,9 +4988,17 @@ void msg_unlisten(msg_Conn *conn) {
 }
 
 void msg_disconnect(msg_Conn *conn) {
+  // Send any waiting batch ahead of the close message.
+  ConnStatus *status = status_of_conn(conn);
+  if (status && status->batch.bytes) {
+    char *failed_sys_call = send_batch(conn, status);
+    if (failed_sys_call) send_callback_os_error(conn, failed_sys_call,
+                                                free_nothing, no_set_name);
+  }
+
   msg_Data data = msg_new_data_space(0);
   int num_bytes = 0, reply_id = 0;
-  set_header(data, msg_type_close, reply_id, num_bytes);
+  set_header(conn, data, msg_type_close, reply_id, num_bytes);
 
   char *failed_sys_call = send_data(conn, data);
   if (failed_sys_call) send_callback_os_error(conn, failed_sys_call,
@@ -1543,35 +5011,198 @@ void msg_disconnect(msg_Conn *conn) {
 void msg_send(msg_Conn *conn, msg_Data data) {
   // Set up the header.
   int msg_type = conn->reply_id ? msg_type_reply : msg_type_one_way;
-  set_header(data, msg_type, conn->reply_id, (uint32_t)data.num_bytes);
+  set_header(conn, data, msg_type, conn->reply_id, (uint32_t)data.num_bytes);
 
-  char *failed_sys_call = send_data(conn, data);
+  char *failed_sys_call = send_message(conn, data);
   if (failed_sys_call) {
     send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
   }
 }
 
-void msg_get(msg_Conn *conn, msg_Data data, void *reply_context) {
+void msg_send_reply_part(msg_Conn *conn, msg_Data data) {
+  ConnStatus *status = status_of_conn(conn);
+  if (conn->reply_id == 0) {
+    const char *err_msg = "msg_send_reply_part is only for replies";
+    return send_callback_error(conn, err_msg, free_nothing, no_set_name);
+  }
+  if (status == NULL || status->peer_version < 4) {
+    const char *err_msg = "The remote doesn't read reply parts";
+    return send_callback_error(conn, err_msg, free_nothing, no_set_name);
+  }
+  set_header(conn, data, msg_type_reply | more_type_bit, conn->reply_id,
+             (uint32_t)data.num_bytes);
+
+  char *failed_sys_call = send_message(conn, data);
+  if (failed_sys_call) {
+    send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
+  }
+}
+
+void msg_send_many(msg_Conn *conn, msg_Data *data, int num_data) {
+  int msg_type = conn->reply_id ? msg_type_reply : msg_type_one_way;
+  for (int i = 0; i < num_data; ++i) {
+    set_header(conn, data[i], msg_type, conn->reply_id,
+               (uint32_t)data[i].num_bytes);
+  }
+
+  char **frames      = alloca(udp_max_gso_segments * sizeof(char *));
+  size_t *frame_lens = alloca(udp_max_gso_segments * sizeof(size_t));
+  // Batching already puts small messages together, so it takes precedence.
+  // Checksums are added one datagram at a time, and unix sockets have no gso.
+  int use_gso = (conn->protocol_type == msg_udp && msg_config.udp_offload &&
+                 msg_config.batch_delay <= 0 && !msg_config.udp_checksums &&
+                 extra_of_conn(conn)->unix_path == NULL);
+
+  for (int i = 0; i < num_data;) {
+
+    // Find a run of equal-sized datagrams that the kernel can split for us.
+    int run_len = 1;
+    size_t frame_len = data[i].num_bytes + wire_header_size(data[i]);
+    size_t total_len = frame_len;
+    while (use_gso && frame_len <= max_datagram_len() &&
+           i + run_len < num_data &&
+           run_len < udp_max_gso_segments &&
+           data[i + run_len].num_bytes + wire_header_size(data[i + run_len]) ==
+               frame_len &&
+           total_len + frame_len <= udp_max_gso_len) {
+      total_len += frame_len;
+      run_len++;
+    }
+
+    if (run_len > 1) {
+      for (int j = 0; j < run_len; ++j) {
+        frames[j]     = data[i + j].bytes - wire_header_size(data[i + j]);
+        frame_lens[j] = frame_len;
+      }
+      SockAddr sockaddr;
+      set_sockaddr_for_conn(&sockaddr, conn);
+      struct sockaddr_in *to = conn->for_listening ? &sockaddr.in : NULL;
+      if (send_udp_gso(conn->socket, to, frames, frame_lens, run_len) != -1) {
+        i += run_len;
+        continue;
+      }
+      // If gso failed, fall back to sending the datagrams one at a time.
+    }
+
+    for (int j = i; j < i + run_len; ++j) {
+      char *failed_sys_call = send_message(conn, data[j]);
+      if (failed_sys_call) {
+        send_callback_os_error(conn, failed_sys_call, free_nothing,
+                               no_set_name);
+      }
+    }
+    i += run_len;
+  }
+}
+
+int msg_get(msg_Conn *conn, msg_Data data, void *reply_context) {
   // Look up the next reply id.
   ConnStatus *status = status_of_conn(conn);
   if (status == NULL) {
     static char err_msg[1024];
     snprintf(err_msg, 1024, "No known connection with %s",
-             address_as_str(address_of_conn(conn)));
-    return send_callback_error(conn, err_msg, free_nothing, no_set_name);
+             msg_address_str(conn));
+    send_callback_error(conn, err_msg, free_nothing, no_set_name);
+    return false;
+  }
+
+  // Push back on the caller rather than let reply ids collide.
+  size_t max_pending = msg_config.max_pending_gets;
+  if (max_pending && (size_t)status->num_replies_pending >= max_pending) {
+    return false;
   }
-  uint16_t reply_id = status->next_reply_id++;
-  map__set(status->reply_contexts, (void *)(intptr_t)reply_id, reply_context);
+  uint32_t reply_id = status->next_reply_id;
+  if (!add_reply_context(status, reply_id, reply_context)) return false;
+
+  // Remotes that don't read v3 headers only take 16-bit reply ids.
+  uint32_t max_id = status->peer_version >= 3 ? UINT32_MAX : UINT16_MAX;
+  status->next_reply_id = reply_id >= max_id ? 1 : reply_id + 1;
 
   // Set up the header.
-  set_header(data, msg_type_request, reply_id, (uint32_t)data.num_bytes);
+  set_header(conn, data, msg_type_request, reply_id, (uint32_t)data.num_bytes);
 
-  char *failed_sys_call = send_data(conn, data);
+  char *failed_sys_call = send_message(conn, data);
   if (failed_sys_call) {
+    take_reply_slot(status, reply_id, &reply_context);
     send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
+    return false;
+  }
+  add_timeout(conn, status, reply_id);
+  return true;
+}
+
+void msg_send_on_channel(msg_Conn *conn, msg_Data data, int channel,
+                         msg_Delivery delivery) {
+  if (channel < 0 || channel >= max_channels ||
+      delivery < msg_unreliable || delivery > msg_unreliable_sequenced) {
+    const char *err_msg = "Invalid channel or delivery for msg_send_on_channel";
+    return send_callback_error(conn, err_msg, free_nothing, no_set_name);
+  }
+
+  // Channel messages are one-way, even when sent from a request's callback.
+  if (conn->protocol_type == msg_tcp || delivery == msg_unreliable) {
+    int reply_id = 0;
+    set_header(conn, data, msg_type_one_way, reply_id,
+               (uint32_t)data.num_bytes);
+    char *failed_sys_call = send_message(conn, data);
+    if (failed_sys_call) {
+      send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
+    }
+    return;
+  }
+
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL) {
+    static char err_msg[1024];
+    snprintf(err_msg, 1024, "No known connection with %s",
+             msg_address_str(conn));
+    return send_callback_error(conn, err_msg, free_nothing, no_set_name);
+  }
+  Channel *state = channel_of_status(status, channel);
+
+  char *failed_sys_call;
+  if (delivery == msg_unreliable_sequenced) {
+    // Before the remote's hello arrives, the message is dropped.
+    if (!peer_sent_hello(status)) return;
+    msg_Data frame = new_channel_frame(channel, delivery,
+                                       state->next_sequenced++, data);
+    failed_sys_call = send_channel_frame(conn, status, state, frame);
+    msg_delete_data(frame);
   } else {
-    add_timeout(conn, status, reply_id);
+    // The message is held until it's acknowledged, so it has to fit the budget.
+    if (is_over_budget(channel_header_len + data.num_bytes)) {
+      const char *err_msg = "Reliable message not sent: memory budget exceeded";
+      return send_callback_error(conn, err_msg, free_nothing, no_set_name);
+    }
+    // A reliable message is sent now if it's within the window and the remote
+    // has sent its hello; otherwise the run loop sends it once they are.
+    uint32_t sequence = state->next_reliable++;
+    ReliableMessage *message = array__new_ptr(state->unacked);
+    double time_now = now();
+    *message = (ReliableMessage) {
+      .data      = new_channel_frame(channel, delivery, sequence, data),
+      .sequence  = sequence,
+      .num_sends = 0,
+      .sent_at   = 0.0,
+      .queued_at = time_now
+    };
+    memory_stats.outgoing_bytes += message->data.num_bytes;
+    failed_sys_call = send_reliable_messages(conn, status, state, time_now);
+  }
+  if (failed_sys_call) {
+    send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
+  }
+}
+
+void msg_set_compression(msg_Conn *conn, int is_on) {
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL) {
+    static char err_msg[1024];
+    snprintf(err_msg, 1024, "No known connection with %s",
+             msg_address_str(conn));
+    return send_callback_error(conn, err_msg, free_nothing, no_set_name);
   }
+  status->compress = is_on;
 }
 
 char *msg_as_str(msg_Data data) {
@@ -1582,22 +5213,61 @@ msg_Data msg_new_data(const char *str) {
   // Allocate room for the string with +1 for the null terminator.
   size_t data_size = strlen(str) + 1;
   msg_Data data = msg_new_data_space(data_size);
-  dbgcheck__inner_ptr_size(data.bytes, data.bytes - metadata_len,
-                           "msg_Data bytes", data_size);
-  strncpy(data.bytes, str, data_size);
+  memcpy(data.bytes, str, data_size);
   return data;
 }
 
 msg_Data msg_new_data_space(size_t num_bytes) {
-  msg_Data data = {.num_bytes = num_bytes,
-                   .bytes     = dbgcheck__malloc(num_bytes + metadata_len,
-                                                 "msg_Data bytes")};
-  data.bytes += metadata_len;
+  msg_Data data = try_new_data_space(num_bytes);
+  if (data.bytes == NULL) {
+    fprintf(stderr, "Error: out of memory allocating %zd bytes of msg_Data.\n",
+            num_bytes);
+    abort();
+  }
   return data;
 }
 
 void msg_delete_data(msg_Data data) {
-  dbgcheck__free(data.bytes - metadata_len, "msg_Data bytes");
+  msg_release(data);
+}
+
+msg_Data msg_retain(msg_Data data) {
+  metadata_of_data(data)->ref_count++;
+  return data;
+}
+
+void msg_release(msg_Data data) {
+  Metadata *metadata = metadata_of_data(data);
+  assert(metadata->ref_count > 0);
+  if (--metadata->ref_count) return;
+  free_buffer(data.bytes - metadata_len, metadata->size_class);
+}
+
+msg_PoolStats msg_pool_stats() {
+  return pool_stats;
+}
+
+msg_MemoryStats msg_memory_stats() {
+  msg_MemoryStats stats = memory_stats;
+  stats.total_bytes = memory_in_use();
+  return stats;
+}
+
+size_t msg_chunk_offset(msg_Data data) {
+  return metadata_of_data(data)->chunk_offset;
+}
+
+size_t msg_message_size(msg_Data data) {
+  // Incoming headers are kept in host byte-order.
+  return metadata_of_data(data)->header.num_bytes;
+}
+
+int msg_is_last_chunk(msg_Data data) {
+  return msg_chunk_offset(data) + data.num_bytes == msg_message_size(data);
+}
+
+int msg_reply_has_more(msg_Data data) {
+  return !!(metadata_of_data(data)->header.message_type & more_type_bit);
 }
 
 char *msg_ip_str(msg_Conn *conn) {
@@ -1605,14 +5275,72 @@ char *msg_ip_str(msg_Conn *conn) {
 }
 
 char *msg_address_str(msg_Conn *conn) {
-  return address_as_str(address_of_conn(conn));
+  char *unix_path = extra_of_conn(conn)->unix_path;
+  if (unix_path == NULL) return address_as_str(address_of_conn(conn));
+
+  // A listening unixgram conn's remote is named by the remote's own path.
+  SockAddr sockaddr;
+  if (is_listening_udp(conn) && conn->remote_ip) {
+    set_sockaddr_for_conn(&sockaddr, conn);
+  } else {
+    set_unix_sockaddr(&sockaddr, unix_path, NULL);
+  }
+  static char address_str[160];
+  char *prefix = conn->protocol_type == msg_udp ? "unixgram" : "unix";
+  snprintf(address_str, 160, "%s://%s", prefix, sockaddr.un.sun_path);
+  return address_str;
+}
+
+msg_Conn *msg_conn_of_id(msg_ConnId id) {
+  return conn_of_id(id);
 }
 
 char *msg_error_str(msg_Data data) {
   return msg_as_str(data);
 }
 
+msg_Config msg_config = {
+  .max_message_size            = 0,  // No limit.
+  .stream_chunk_size           = 0,  // Don't stream.
+  .udp_offload                 = false,
+  .accept_budget               = 64,
+  .conn_pool_size              = 16,
+  .memory_budget               = 0,  // No limit.
+  .compact_headers             = false,
+  .udp_fragment_size           = 0,  // Only fragment what won't fit.
+  .max_reassembly_size         = 16 << 20,
+  .heartbeat_interval          = 0,  // No heartbeats.
+  .max_missed_heartbeats       = 4,
+  .reliable_timeout            = 10.0,
+  .udp_idle_ttl                = 0,  // Never evict idle remotes.
+  .max_udp_remotes             = 0,  // No limit.
+  .compression                 = false,
+  .compression_threshold       = 64,
+  .compression_dictionary      = NULL,
+  .compression_dictionary_size = 0,
+  .max_pending_gets            = 0,  // Only the reply id window limits this.
+  .batch_delay                 = 0,  // Don't batch.
+  .max_batch_size              = 1400,
+  .udp_checksums               = false
+};
+
+const msg_SocketOptions msg_low_latency_options = {
+  .tcp_nodelay  = true,
+  .tcp_quickack = true,
+  .tos          = 0x10  // IPTOS_LOWDELAY.
+};
+
+const msg_SocketOptions msg_bulk_options = {
+  .recv_buffer_size = 4 << 20,
+  .send_buffer_size = 4 << 20,
+  .tos              = 0x08  // IPTOS_THROUGHPUT.
+};
+
 void *msg_no_context = NULL;
 
+const msg_ConnId msg_no_conn_id = 0;
+
+const int msg_num_channels = max_channels;
+
 const int msg_tcp = SOCK_STREAM;
 const int msg_udp = SOCK_DGRAM;
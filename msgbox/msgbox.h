@@ -6,10 +6,12 @@
 //
 // All calls are non-blocking.
 //
-// An address has the format (tcp|udp)://(<ip addr>|*):<port>.
+// An address has the format (tcp|udp)://(<ip addr>|*):<port>, or, for unix
+// domain sockets, (unix|unixgram)://<path>.
 // Examples:
 //   You could listen on "tcp://*:8100".
 //   You could connect to "udp://1.2.3.4:8200".
+//   You could listen on "unix:///tmp/app.sock".
 //
 // See the examples directory for basic usage examples.
 //
@@ -38,13 +40,31 @@ typedef enum {
   msg_connection_ready,
   msg_connection_closed,
   msg_connection_lost,
-  msg_error
+  msg_error,
+  msg_message_chunk,
+  msg_load_shed
 } msg_Event;
 
 struct msg_Conn;
 
 typedef void (*msg_Callback)(struct msg_Conn *, msg_Event, msg_Data);
 
+// Options applied to a socket by msg_listen_ex or msg_connect_ex. Zero-valued
+// fields leave the system defaults alone. Options that don't apply to a
+// protocol, or that the os doesn't support, are skipped.
+typedef struct {
+  int tcp_nodelay;       // If true, small tcp messages are sent immediately.
+  int tcp_quickack;      // If true, tcp acks aren't delayed (linux only).
+  int recv_buffer_size;  // SO_RCVBUF in bytes.
+  int send_buffer_size;  // SO_SNDBUF in bytes.
+  int tos;               // The IP_TOS byte; a dscp value is shifted left by 2.
+  int priority;          // SO_PRIORITY (linux only).
+} msg_SocketOptions;
+
+// A handle for a msg_Conn that, unlike a msg_Conn pointer, is safe to keep
+// after the conn is freed; see msg_conn_of_id.
+typedef uint64_t msg_ConnId;
+
 typedef struct msg_Conn {
   void *conn_context;
   void *reply_context;
@@ -56,8 +76,9 @@ typedef struct msg_Conn {
 
   int socket;
   int for_listening;
-  uint16_t reply_id;
+  uint32_t reply_id;
   int index;
+  msg_ConnId id;
 } msg_Conn;
 
 // Event loop function; expects to be called frequently.
@@ -70,35 +91,257 @@ void msg_listen (const char *address, msg_Callback callback);
 void msg_connect(const char *address, msg_Callback callback,
                  void *conn_context);
 
+// These work the same way, and also apply the given socket options, which may
+// be NULL. Tcp connections accepted by a server inherit its options.
+void msg_listen_ex (const char *address, msg_Callback callback,
+                    const msg_SocketOptions *options);
+void msg_connect_ex(const char *address, msg_Callback callback,
+                    void *conn_context, const msg_SocketOptions *options);
+
 void msg_unlisten  (msg_Conn *conn);
 void msg_disconnect(msg_Conn *conn);
 
 // Calls to send a message.
 // Call msg_get when you expect a reply; otherwise call msg_send.
 
+// msg_get returns false, without sending, if conn already has as many pending
+// msg_get calls as it can track; see msg_config.max_pending_gets.
 void msg_send(msg_Conn *conn, msg_Data data);
-void msg_get (msg_Conn *conn, msg_Data data, void *reply_context);
+int  msg_get (msg_Conn *conn, msg_Data data, void *reply_context);
+
+// This is the same as calling msg_send on each of the num_data items in order.
+// With msg_config.udp_offload on, runs of equal-sized udp messages are handed
+// to the kernel in a single call.
+void msg_send_many(msg_Conn *conn, msg_Data *data, int num_data);
+
+// Sends data as one frame of a reply with more frames to follow; the last frame
+// is sent with msg_send. Call this from a msg_request callback, or later with
+// conn->reply_id set to the request's reply_id. Each frame arrives as a
+// msg_reply with the same reply_context, and the msg_get's timeout restarts
+// with each frame. The remote must have sent a hello, which it does with
+// msg_config.compact_headers or msg_config.compression on.
+void msg_send_reply_part(msg_Conn *conn, msg_Data data);
+
+// Delivery modes for msg_send_on_channel.
+typedef enum {
+  msg_unreliable,           // As with msg_send.
+  msg_reliable_ordered,     // Resent until received; delivered in order.
+  msg_unreliable_sequenced  // Dropped if a later message has been received.
+} msg_Delivery;
+
+// Sends a one-way message on the given channel, from 0 to msg_num_channels - 1,
+// with the given delivery mode. On udp, each channel keeps the order of its
+// reliable messages, and separately of its sequenced messages, independently of
+// other channels. Tcp already delivers every message reliably and in order.
+// Udp channel messages wait for the remote's hello; see compact_headers.
+// Reliable udp messages waiting to be acknowledged count toward memory_budget,
+// and one that doesn't fit gets a msg_error instead of being sent.
+void msg_send_on_channel(msg_Conn *conn, msg_Data data, int channel,
+                         msg_Delivery delivery);
+
+// Turns compression on or off for messages sent to conn's remote; the default
+// is msg_config.compression. For a listening udp conn, this applies to the
+// remote at conn's current address. Call this once conn is ready.
+void msg_set_compression(msg_Conn *conn, int is_on);
 
 // Functions for working with msg_Data.
 
 char *msg_as_str(msg_Data data);  // Assumes the underlying data is a C string.
 msg_Data msg_new_data(const char *str);
-msg_Data msg_new_data_space(size_t num_bytes);
+msg_Data msg_new_data_space(size_t num_bytes);  // Aborts if out of memory.
 void msg_delete_data(msg_Data data);
 
+// Reference counting for msg_Data. A callback may call msg_retain to keep
+// incoming data after it returns; each msg_retain is balanced by a later
+// msg_release. msg_delete_data is the same as msg_release.
+msg_Data msg_retain (msg_Data data);
+void     msg_release(msg_Data data);
+
+// Functions for working with msg_message_chunk data.
+// A chunk holds data.num_bytes bytes starting at msg_chunk_offset(data) within
+// a message of msg_message_size(data) bytes.
+
+size_t msg_chunk_offset (msg_Data data);
+size_t msg_message_size (msg_Data data);
+int    msg_is_last_chunk(msg_Data data);
+
+// True for msg_reply data that isn't the last frame of its reply; see
+// msg_send_reply_part. Chunks of a frame give the same answer.
+int msg_reply_has_more(msg_Data data);
+
+// msg_Data buffers are recycled through per-thread pools, except for very large
+// ones. These statistics cover the calling thread's pools; the hit rate is
+// num_pool_hits / num_allocs.
+
+typedef struct {
+  size_t num_allocs;        // The number of msg_Data buffers allocated.
+  size_t num_pool_hits;     // Allocations that reused a pooled buffer.
+  size_t num_large_allocs;  // Allocations too large for the pools.
+  size_t pool_bytes;        // The memory held by the pools.
+} msg_PoolStats;
+
+msg_PoolStats msg_pool_stats();
+
 // Functions for working with msg_Conn.
 
 char *msg_ip_str(msg_Conn *conn);
 char *msg_address_str(msg_Conn *conn);
 
+// Returns the conn with the given id, or NULL once that conn has been freed,
+// which happens after its msg_connection_{closed,lost} callback. Ids of freed
+// conns don't match new conns, so an id may be kept anywhere, such as in timers
+// or in work queued by another thread; like other msgbox calls, this belongs on
+// the runloop's thread.
+msg_Conn *msg_conn_of_id(msg_ConnId id);
+
 // Functions for working with errors.
 
 char *msg_error_str(msg_Data data);
 
+// Settings.
+// These apply to all connections, and may be changed between msg_runloop calls.
+
+typedef struct {
+  // Incoming messages larger than this are rejected; 0 means no limit.
+  size_t max_message_size;
+
+  // Incoming tcp messages larger than this arrive as a sequence of
+  // msg_message_chunk events, each at most this size; 0 turns this off.
+  size_t stream_chunk_size;
+
+  // If true, udp sockets opened afterwards use the kernel's udp segmentation
+  // offload where it's available (linux): msg_send_many sends runs of
+  // equal-sized messages with a single system call, and incoming datagrams
+  // coalesced by the kernel are split back into individual messages.
+  int udp_offload;
+
+  // The most connections accepted per listening tcp socket per msg_runloop
+  // call.
+  int accept_budget;
+
+  // The number of each per-connection object allocated up front for reuse.
+  // This is read once, by the first msg_listen or msg_connect call.
+  int conn_pool_size;
+
+  // Once the memory held for remotes, as counted by msg_memory_stats, would
+  // pass this many bytes, msgbox sheds load: new tcp connections are closed,
+  // datagrams from new udp remotes are dropped, and incoming tcp messages that
+  // don't fit are refused. Each case sends a msg_load_shed event. 0 means no
+  // limit.
+  size_t memory_budget;
+
+  // If true, new connections offer to use compact headers, which take 2-8 bytes
+  // per message instead of 8. Once the remote answers, both sides switch to
+  // them. The offer is a hello, which versions of msgbox from before compact
+  // headers can't read, so both sides must be upgraded first. Fragments,
+  // channel messages and heartbeats are also only sent to remotes that have
+  // sent a hello.
+  int compact_headers;
+
+  // Udp messages that would make a datagram larger than this many bytes are
+  // sent as fragments of at most this size, and put back together by the
+  // receiver. A size under the path mtu avoids ip fragmentation. 0 means to
+  // fragment only messages too large for a single datagram. Only remotes that
+  // have sent a hello get fragments; see compact_headers.
+  size_t udp_fragment_size;
+
+  // Fragmented udp messages larger than this many bytes are rejected, so that a
+  // forged fragment can't set aside more memory than this; 0 means no limit.
+  size_t max_reassembly_size;
+
+  // If positive, msgbox checks on each udp remote about this often, in seconds.
+  // A remote that's been quiet for an interval is sent a heartbeat, which
+  // msgbox on the other side answers. A remote quiet for more than
+  // max_missed_heartbeats intervals is reported with msg_connection_lost and
+  // forgotten; each of its pending msg_get calls first gets a msg_error. 0
+  // turns heartbeats off.
+  double heartbeat_interval;
+  int    max_missed_heartbeats;
+
+  // A udp remote that hasn't acknowledged a reliable channel message within
+  // this many seconds of its msg_send_on_channel call is reported with
+  // msg_connection_lost and forgotten, as with heartbeats. 0 means reliable
+  // messages are resent for as long as the connection lasts.
+  double reliable_timeout;
+
+  // Listening udp conns keep state for every remote they hear from. A remote
+  // not heard from for udp_idle_ttl seconds is evicted, and the least recently
+  // heard from remotes are evicted to keep at most max_udp_remotes of them. An
+  // eviction is reported as msg_connection_lost. 0 turns off either limit.
+  double udp_idle_ttl;
+  size_t max_udp_remotes;
+
+  // If true, messages of at least compression_threshold bytes are compressed
+  // when that makes them shorter, for remotes running a version of msgbox that
+  // reads them. Connections say that they read compressed messages in the hello
+  // sent when either this or compact_headers is on; a listening udp conn only
+  // answers hellos. Compressed tcp messages aren't delivered as chunks.
+  int    compression;
+  size_t compression_threshold;
+
+  // An optional dictionary of bytes typical of messages, which helps compress
+  // short ones. It's used only with remotes that hold the same dictionary, and
+  // it must not change while connections are open. Only its last 64k bytes are
+  // used.
+  const char *compression_dictionary;
+  size_t      compression_dictionary_size;
+
+  // The most msg_get calls that may await replies on a connection at once; a
+  // msg_get past this returns false. 0 means the only limit is that pending
+  // reply ids span at most 65536 ids, so an old unanswered request holds back
+  // later ones once that many have been sent after it.
+  size_t max_pending_gets;
+
+  // If positive, small messages to a remote are held for up to this many
+  // seconds and sent together in one frame of at most max_batch_size bytes,
+  // which the remote unpacks into the usual events. Messages stay in order, and
+  // only remotes running a version of msgbox that reads batches get them; see
+  // compact_headers. The wait is rounded up to whole milliseconds by
+  // msg_runloop. 0 turns batching off.
+  double batch_delay;
+  size_t max_batch_size;
+
+  // If true, udp datagrams end with a crc32c of their contents, for remotes
+  // running a version of msgbox that checks them; see compact_headers.
+  // Datagrams that fail the check are dropped, and counted in msg_memory_stats.
+  // Datagrams with checksums are checked whether or not this is on.
+  int udp_checksums;
+} msg_Config;
+
+extern msg_Config msg_config;
+
+// Memory held by msgbox for remotes, and counts of load shedding decisions and
+// of corrupted datagrams.
+
+typedef struct {
+  size_t incoming_bytes;      // Partially received messages.
+  size_t pending_call_bytes;  // Events waiting to be sent to callbacks.
+  size_t outgoing_bytes;      // Data waiting to be sent or acknowledged.
+  size_t status_bytes;        // Per-remote state, including pending msg_gets.
+  size_t total_bytes;         // The sum of the above.
+
+  size_t num_conns_rejected;    // New tcp connections closed.
+  size_t num_peers_dropped;     // Datagrams dropped from new udp remotes.
+  size_t num_messages_refused;  // Incoming messages refused.
+  size_t num_bad_checksums;     // Udp datagrams dropped for a bad checksum.
+} msg_MemoryStats;
+
+msg_MemoryStats msg_memory_stats();
+
 // Constants.
 
 extern void *msg_no_context;
 
+// This is never the id of a conn.
+extern const msg_ConnId msg_no_conn_id;
+
+// The number of channels available to msg_send_on_channel.
+extern const int msg_num_channels;
+
+// Socket option presets for use with msg_listen_ex and msg_connect_ex.
+extern const msg_SocketOptions msg_low_latency_options;
+extern const msg_SocketOptions msg_bulk_options;
+
 // Valid values for msg_Conn.protocol_type.
 extern const int msg_udp;
 extern const int msg_tcp;
@@ -0,0 +1,168 @@
+// accept_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for accepting a backlog of tcp connections in batches.
+//
+
+// This is the basic protocol followed by this client/server setup:
+//
+// The server listens, then waits before running its run loop so that the
+// client's connections pile up in the accept backlog.
+//
+// c: open num_clients connections in one burst
+//    s: accept them at most accept_budget per run loop, and see a
+//       msg_connection_ready for every one
+// c: stay connected until the server is done
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int tcp_port;
+
+#define num_clients 50
+#define budget      8
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int num_ready;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event != msg_connection_ready) {
+    test_printf("Server: Received event %s\n", event_names[event]);
+  }
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) num_ready++;
+}
+
+int server() {
+  num_ready = 0;
+  msg_config.accept_budget = budget;
+
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", tcp_port);
+  msg_listen(address, server_update);
+
+  // Let the client's connections fill the backlog.
+  usleep(200000);
+
+  int timeout_in_ms = 5;
+  int max_per_loop  = 0;
+  int num_loops     = 0;
+  while (num_ready < num_clients && num_loops++ < 1000) {
+    int ready_before = num_ready;
+    msg_runloop(timeout_in_ms);
+    int num_accepted = num_ready - ready_before;
+    if (num_accepted > max_per_loop) max_per_loop = num_accepted;
+  }
+
+  test_printf("Server: %d connections, at most %d per run loop.\n",
+              num_ready, max_per_loop);
+  test_that(num_ready == num_clients);
+  test_that(max_per_loop == budget);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int num_client_ready;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event != msg_connection_ready) {
+    test_printf("Client: Received event %s\n", event_names[event]);
+  }
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) num_client_ready++;
+}
+
+int client(pid_t server_pid) {
+  num_client_ready = 0;
+
+  // Sleep for 10ms to give the server time to start.
+  usleep(10000);
+
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", tcp_port);
+  for (int i = 0; i < num_clients; ++i) {
+    msg_connect(address, client_update, msg_no_context);
+  }
+
+  // The server ends once it has seen every connection.
+  int timeout_in_ms = 5;
+  int status;
+  while (!waitpid(server_pid, &status, WNOHANG)) msg_runloop(timeout_in_ms);
+  test_that(num_client_ready == num_clients);
+
+  return WEXITSTATUS(status) ? test_failure : test_success;
+}
+
+int accept_test() {
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server());
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    return client(child_pid);
+  }
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  tcp_port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(accept_test);
+  return end_all_tests();
+}
@@ -0,0 +1,308 @@
+// batch_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for batches of small messages sent together in one datagram.
+//
+
+
+// This is the basic protocol followed by this client/server setup:
+//
+// Both sides turn on batching, along with compact headers so that they hear
+// each other's hellos. The client talks to the server through a relay in the
+// server process that counts the datagrams it forwards from the client.
+//
+// c: send "ping"
+//    s: send "pong"
+// c: send num_msgs small messages in one go, every get_every-th of which is a
+//    msg_get
+//    s: check that all messages arrive in order, and reply to each request
+// c: once all replies are in, send "done"
+//    s: check that the messages took far fewer datagrams than there were
+//       messages
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int udp_port;
+int relay_port;
+
+#define num_msgs    200
+#define get_every   5
+#define num_gets    (num_msgs / get_every)
+#define delay_sec   0.05
+
+static void setup_batching() {
+  msg_config.compact_headers = true;
+  msg_config.batch_delay     = delay_sec;
+}
+
+static double seconds_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// relay
+
+int    relay_sock;
+int    num_client_datagrams;
+struct sockaddr_in relay_client_addr;
+
+static void start_relay() {
+  relay_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr = {
+    .sin_family      = AF_INET,
+    .sin_port        = htons(relay_port),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+  };
+  bind(relay_sock, (struct sockaddr *)&addr, sizeof(addr));
+  num_client_datagrams = 0;
+}
+
+// Forwards waiting datagrams between the client and the server.
+static void run_relay() {
+  char buffer[65536];
+  struct sockaddr_in from;
+  socklen_t from_len = sizeof(from);
+  long num_bytes;
+  while ((num_bytes = recvfrom(relay_sock, buffer, sizeof(buffer), MSG_DONTWAIT,
+                               (struct sockaddr *)&from, &from_len)) >= 0) {
+    int is_from_server = (from.sin_port == htons(udp_port));
+
+    struct sockaddr_in to = relay_client_addr;
+    if (!is_from_server) {
+      num_client_datagrams++;
+      relay_client_addr  = from;
+      to.sin_port        = htons(udp_port);
+      to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    sendto(relay_sock, buffer, num_bytes, 0, (struct sockaddr *)&to,
+           sizeof(to));
+    from_len = sizeof(from);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_done;
+int num_recd;
+int datagrams_before;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event != msg_message && event != msg_request) {
+    test_printf("Server: Received event %s\n", event_names[event]);
+  }
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event != msg_message && event != msg_request) return;
+
+  const char *str = msg_as_str(data);
+  if (strcmp(str, "ping") == 0) {
+    datagrams_before = num_client_datagrams;
+    msg_Data pong = msg_new_data("pong");
+    msg_send(conn, pong);
+    msg_delete_data(pong);
+    return;
+  }
+  if (strcmp(str, "done") == 0) {
+    test_that(num_recd == num_msgs);
+    server_done = true;
+    return;
+  }
+
+  char kind;
+  int  i;
+  test_that(sscanf(str, "%c %d", &kind, &i) == 2);
+  test_that(i == num_recd);
+  num_recd++;
+  test_that((event == msg_request) == (kind == 'g'));
+  if (event == msg_request) {
+    msg_Data reply = msg_new_data(str);
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+}
+
+int server() {
+  server_done      = false;
+  num_recd         = 0;
+  datagrams_before = 0;
+  setup_batching();
+  start_relay();
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", udp_port);
+  msg_listen(address, server_update);
+
+  while (!server_done) {
+    msg_runloop(1);
+    run_relay();
+  }
+
+  int num_datagrams = num_client_datagrams - datagrams_before;
+  test_printf("Server: %d messages took %d client datagrams.\n",
+              num_msgs + 1, num_datagrams);
+  test_that(num_datagrams < num_msgs / 10);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_done;
+int num_replies;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event != msg_reply) {
+    test_printf("Client: Received event %s\n", event_names[event]);
+  }
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    msg_Data data = msg_new_data("ping");
+    msg_send(conn, data);
+    msg_delete_data(data);
+  }
+
+  if (event == msg_message) {
+    test_str_eq(msg_as_str(data), "pong");
+    for (int i = 0; i < num_msgs; ++i) {
+      int is_get = (i % get_every == get_every - 1);
+      char str[64];
+      snprintf(str, 64, "%c %d", is_get ? 'g' : 'm', i);
+      msg_Data data = msg_new_data(str);
+      if (is_get) {
+        test_that(msg_get(conn, data, (void *)(intptr_t)(i + 1)));
+      } else {
+        msg_send(conn, data);
+      }
+      msg_delete_data(data);
+    }
+  }
+
+  if (event == msg_reply) {
+    // Each reply matches its request.
+    int i;
+    test_that(sscanf(msg_as_str(data), "g %d", &i) == 1);
+    test_that(conn->reply_context == (void *)(intptr_t)(i + 1));
+    if (++num_replies == num_gets) {
+      msg_Data done = msg_new_data("done");
+      msg_send(conn, done);
+      msg_delete_data(done);
+      client_done = true;
+    }
+  }
+}
+
+int client(pid_t server_pid) {
+  client_done = false;
+  num_replies = 0;
+  setup_batching();
+
+  // Sleep for 10ms to give the server time to start.
+  usleep(10000);
+
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", relay_port);
+  msg_connect(address, client_update, msg_no_context);
+
+  while (!client_done) {
+    msg_runloop(1);
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (!client_done && waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  // Keep running until the batch holding "done" has gone out.
+  double end_at = seconds_now() + 2 * delay_sec;
+  while (seconds_now() < end_at) msg_runloop(1);
+
+  return test_success;
+}
+
+int batch_test() {
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server());
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  udp_port   = rand() % 1024 + 1024;
+  relay_port = udp_port + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(batch_test);
+  return end_all_tests();
+}
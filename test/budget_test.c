@@ -0,0 +1,216 @@
+// budget_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for load shedding under msg_config.memory_budget.
+//
+
+// This is the basic protocol followed by this client/server setup:
+//
+// tcp:
+// c: send a message too large for the server's memory budget
+//    s: refuse it with msg_load_shed; the connection is lost
+//
+// udp:
+// c: send "hello"
+//    s: drop it with msg_load_shed since the remote is new and the budget is
+//       full
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int udp_port;
+int tcp_port;
+
+#define tcp_budget   (64 << 10)
+#define message_size (1 << 20)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_done;
+int num_shed_events;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  // The message never gets through.
+  test_that(event != msg_message);
+
+  if (event == msg_load_shed) {
+    test_printf("Server: %s\n", msg_as_str(data));
+    num_shed_events++;
+    msg_MemoryStats stats = msg_memory_stats();
+    if (conn->protocol_type == msg_tcp) {
+      test_that(stats.num_messages_refused == 1);
+    } else {
+      test_that(stats.num_peers_dropped == 1);
+      server_done = true;
+    }
+  }
+
+  if (event == msg_connection_lost) server_done = true;
+}
+
+int server(int protocol_type) {
+  server_done     = false;
+  num_shed_events = 0;
+
+  // A udp server with a tiny budget has no room for any new remote.
+  msg_config.memory_budget = (protocol_type == msg_tcp ? tcp_budget : 1);
+
+  char address[256];
+  snprintf(address, 256, "%s://*:%d",
+      protocol_type == msg_udp ? "udp" : "tcp",
+      protocol_type == msg_udp ? udp_port : tcp_port);
+
+  msg_listen(address, server_update);
+  int timeout_in_ms = 10;
+  while (!server_done) msg_runloop(timeout_in_ms);
+
+  test_that(num_shed_events == 1);
+
+  // Sleep for 1ms as the client expects to finish before the server.
+  // (Early server termination could be an error, so we check for it.)
+  usleep(1000);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_done;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  // A tcp client may see a send error as the server drops the connection.
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+
+  if (event == msg_connection_ready) {
+    if (conn->protocol_type == msg_tcp) {
+      msg_Data data = msg_new_data_space(message_size);
+      memset(data.bytes, 'x', data.num_bytes);
+      msg_send(conn, data);
+      msg_delete_data(data);
+    } else {
+      msg_Data data = msg_new_data("hello");
+      msg_send(conn, data);
+      msg_delete_data(data);
+      msg_disconnect(conn);
+    }
+  }
+
+  if (event == msg_connection_closed || event == msg_connection_lost) {
+    client_done = true;
+  }
+}
+
+int client(int protocol_type, pid_t server_pid) {
+  client_done = false;
+
+  // Sleep for 1ms to give the server time to start.
+  usleep(1000);
+
+  char address[256];
+  snprintf(address, 256, "%s://127.0.0.1:%d",
+      protocol_type == msg_udp ? "udp" : "tcp",
+      protocol_type == msg_udp ? udp_port : tcp_port);
+
+  msg_connect(address, client_update, msg_no_context);
+  int timeout_in_ms = 10;
+  while (!client_done) {
+    msg_runloop(timeout_in_ms);
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (!client_done && waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  return test_success;
+}
+
+int budget_test(int protocol_type) {
+
+  test_printf("Test: Starting %s budget test.\n",
+              protocol_type == msg_udp ? "udp" : "tcp");
+
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server(protocol_type));
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(protocol_type, child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int udp_test() { return budget_test(msg_udp); }
+
+int tcp_test() { return budget_test(msg_tcp); }
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  udp_port = rand() % 1024 + 1024;
+  tcp_port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(udp_test, tcp_test);
+  return end_all_tests();
+}
@@ -0,0 +1,287 @@
+// channel_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for msg_send_on_channel over a lossy udp link.
+//
+
+// This is the basic protocol followed by this client/server setup:
+//
+// The client talks to the server through a relay in the server process that
+// drops every fourth datagram in either direction. The client turns on compact
+// headers so that the two exchange the hellos that channel messages wait for;
+// the relay may drop those too.
+//
+// c: send num_msgs reliable-ordered messages on channel 0 as soon as it's
+//    connected; they wait for the server's hello
+// c: send an unreliable-sequenced message on channel 1 from each run loop
+//    until it's done; those sent before the server's hello are dropped
+//    s: check that every reliable message arrives once and in order, and that
+//       sequenced messages arrive in order
+//    s: once all reliable messages are in, send "done" on channel 0
+// c: finish once "done" arrives
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int udp_port;
+int relay_port;
+
+// More than the reliable window, so some messages wait for acks to be sent.
+#define num_msgs 100
+
+#define reliable_channel  0
+#define sequenced_channel 1
+
+static double seconds_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// relay
+
+int relay_sock;
+int num_relayed;
+struct sockaddr_in relay_client_addr;
+
+static void start_relay() {
+  relay_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr = {
+    .sin_family      = AF_INET,
+    .sin_port        = htons(relay_port),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+  };
+  bind(relay_sock, (struct sockaddr *)&addr, sizeof(addr));
+  num_relayed = 0;
+}
+
+// Forwards waiting datagrams between the client and the server, dropping every
+// fourth one.
+static void run_relay() {
+  char buffer[65536];
+  struct sockaddr_in from;
+  socklen_t from_len = sizeof(from);
+  long num_bytes;
+  while ((num_bytes = recvfrom(relay_sock, buffer, sizeof(buffer), MSG_DONTWAIT,
+                               (struct sockaddr *)&from, &from_len)) >= 0) {
+    int is_from_server = (from.sin_port == htons(udp_port));
+    if (!is_from_server) relay_client_addr = from;
+    if (++num_relayed % 4 == 0) continue;
+
+    struct sockaddr_in to = relay_client_addr;
+    if (!is_from_server) {
+      to.sin_port        = htons(udp_port);
+      to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    sendto(relay_sock, buffer, num_bytes, 0, (struct sockaddr *)&to,
+           sizeof(to));
+    from_len = sizeof(from);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int num_reliable_recd;
+int num_sequenced_recd;
+int last_sequenced;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event != msg_message) {
+    test_printf("Server: Received event %s\n", event_names[event]);
+  }
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event != msg_message) return;
+
+  char kind;
+  int  i;
+  test_that(sscanf(msg_as_str(data), "%c %d", &kind, &i) == 2);
+  if (kind == 'r') {
+    test_that(i == num_reliable_recd);
+    num_reliable_recd++;
+    if (num_reliable_recd == num_msgs) {
+      msg_Data done = msg_new_data("done");
+      msg_send_on_channel(conn, done, reliable_channel, msg_reliable_ordered);
+      msg_delete_data(done);
+    }
+  } else {
+    test_that(kind == 's');
+    test_that(i > last_sequenced);
+    last_sequenced = i;
+    num_sequenced_recd++;
+  }
+}
+
+int server() {
+  num_reliable_recd  = 0;
+  num_sequenced_recd = 0;
+  last_sequenced     = -1;
+  start_relay();
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", udp_port);
+  msg_listen(address, server_update);
+
+  // Keep answering for a while after the last message so that the client's
+  // resends of "done" get through.
+  double end_at = 0;
+  while (end_at == 0 || seconds_now() < end_at) {
+    msg_runloop(1);
+    run_relay();
+    if (end_at == 0 && num_reliable_recd == num_msgs) {
+      end_at = seconds_now() + 2.0;
+    }
+  }
+
+  test_printf("Server: %d sequenced messages arrived.\n", num_sequenced_recd);
+  test_that(num_sequenced_recd > 0);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+msg_Conn *client_conn;
+int       client_done;
+int       num_sequenced_sent;
+
+static void send_sequenced_message() {
+  char str[64];
+  snprintf(str, 64, "s %d", num_sequenced_sent++);
+  msg_Data data = msg_new_data(str);
+  msg_send_on_channel(client_conn, data, sequenced_channel,
+                      msg_unreliable_sequenced);
+  msg_delete_data(data);
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    client_conn = conn;
+    char str[64];
+    for (int i = 0; i < num_msgs; ++i) {
+      snprintf(str, 64, "r %d", i);
+      msg_Data data = msg_new_data(str);
+      msg_send_on_channel(conn, data, reliable_channel, msg_reliable_ordered);
+      msg_delete_data(data);
+    }
+  }
+
+  if (event == msg_message) {
+    test_str_eq(msg_as_str(data), "done");
+    client_done = true;
+  }
+}
+
+int client(pid_t server_pid) {
+  client_conn        = NULL;
+  client_done        = false;
+  num_sequenced_sent = 0;
+  msg_config.compact_headers = true;
+
+  // Sleep for 10ms to give the server time to start.
+  usleep(10000);
+
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", relay_port);
+  msg_connect(address, client_update, msg_no_context);
+  while (!client_done) {
+    msg_runloop(1);
+    if (client_conn) send_sequenced_message();
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (!client_done && waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  return test_success;
+}
+
+int channel_test() {
+  test_printf("Test: Starting udp channel test.\n");
+
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server());
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  udp_port   = rand() % 1024 + 1024;
+  relay_port = udp_port + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(channel_test);
+  return end_all_tests();
+}
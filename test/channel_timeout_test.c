@@ -0,0 +1,187 @@
+// channel_timeout_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for reliable channel messages that are never acknowledged, and for
+// reliable messages that don't fit in the memory budget.
+//
+
+// This test runs in one process. The remote is a plain udp socket that never
+// answers, so neither its hello nor any acks arrive:
+//
+// c: send a reliable message larger than the memory budget allows
+//    c: receive a msg_error; the message isn't held
+// c: get "ping"; send a small reliable message
+// c: after reliable_timeout, receive a msg_error for "ping", then
+//    msg_connection_lost; the held message is freed
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+#define timeout_sec 0.3
+
+int udp_port;
+
+char ping_context[] = "ping";
+
+static double seconds_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Returns a udp socket bound to udp_port that is never read from.
+static int open_silent_remote() {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(udp_port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int    client_done;
+int    num_budget_errors;
+int    num_get_errors;
+double sent_at;
+double lost_at;
+
+static void send_reliable(msg_Conn *conn, size_t num_bytes) {
+  msg_Data data = msg_new_data_space(num_bytes);
+  memset(data.bytes, 'r', num_bytes);
+  msg_send_on_channel(conn, data, 0, msg_reliable_ordered);
+  msg_delete_data(data);
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+
+  if (event == msg_connection_ready) {
+    // A message that doesn't fit in the budget is refused at once; its
+    // msg_error arrives later.
+    size_t outgoing_bytes = msg_memory_stats().outgoing_bytes;
+    msg_config.memory_budget = msg_memory_stats().total_bytes + 100;
+    send_reliable(conn, 1000);
+    test_that(msg_memory_stats().outgoing_bytes == outgoing_bytes);
+    msg_config.memory_budget = 0;
+
+    msg_Data ping = msg_new_data("ping");
+    msg_get(conn, ping, ping_context);
+    msg_delete_data(ping);
+
+    send_reliable(conn, 100);
+    test_that(msg_memory_stats().outgoing_bytes > outgoing_bytes);
+    sent_at = seconds_now();
+    return;
+  }
+
+  if (event == msg_error && num_get_errors == 0 &&
+      conn->reply_context == ping_context) {
+    test_str_eq(msg_as_str(data), "udp get failed: connection lost");
+    num_get_errors++;
+    return;
+  }
+
+  if (event == msg_error) {
+    test_that(strstr(msg_as_str(data), "memory budget") != NULL);
+    num_budget_errors++;
+    return;
+  }
+
+  test_that(event == msg_connection_lost);
+  test_that(num_budget_errors == 1);
+  test_that(num_get_errors == 1);
+  lost_at     = seconds_now();
+  client_done = true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+int channel_timeout_test() {
+  client_done       = false;
+  num_budget_errors = 0;
+  num_get_errors    = 0;
+  size_t outgoing_bytes = msg_memory_stats().outgoing_bytes;
+
+  int remote = open_silent_remote();
+  test_that(remote != -1);
+
+  msg_config.compact_headers  = true;
+  msg_config.reliable_timeout = timeout_sec;
+
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", udp_port);
+  msg_connect(address, client_update, msg_no_context);
+
+  double give_up_at = seconds_now() + 5.0;
+  while (!client_done && seconds_now() < give_up_at) msg_runloop(10);
+  close(remote);
+
+  test_that(client_done);
+  test_printf("Lost after %.3fs\n", lost_at - sent_at);
+  test_that(lost_at - sent_at >= timeout_sec);
+  test_that(lost_at - sent_at < timeout_sec + 1.0);
+  test_that(msg_memory_stats().outgoing_bytes == outgoing_bytes);
+
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use'.
+  srand(time(NULL));
+  udp_port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(channel_timeout_test);
+  return end_all_tests();
+}
@@ -0,0 +1,264 @@
+// checksum_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for udp checksums, and the dropping of corrupted datagrams.
+//
+
+// This is the basic protocol followed by this client/server setup:
+//
+// Both sides turn on checksums, along with compact headers so that they hear
+// each other's hellos. The client talks to the server through a relay in the
+// server process that corrupts every client datagram holding the text "bad".
+//
+// c: send "ping"
+//    s: send "pong"
+// c: send num_msgs messages, alternating between "good <i>" and "bad <i>"
+// c: send "done"
+//    s: check that every good message arrived, that no bad one did, and that
+//       each bad one was counted as a bad checksum
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int udp_port;
+int relay_port;
+
+#define num_msgs 20
+#define num_bad  (num_msgs / 2)
+
+static void setup_checksums() {
+  msg_config.compact_headers = true;
+  msg_config.udp_checksums   = true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// relay
+
+int    relay_sock;
+struct sockaddr_in relay_client_addr;
+
+static void start_relay() {
+  relay_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr = {
+    .sin_family      = AF_INET,
+    .sin_port        = htons(relay_port),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+  };
+  bind(relay_sock, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+// Forwards waiting datagrams between the client and the server, turning "bad"
+// into "bae" on the way to the server.
+static void run_relay() {
+  char buffer[65536];
+  struct sockaddr_in from;
+  socklen_t from_len = sizeof(from);
+  long num_bytes;
+  while ((num_bytes = recvfrom(relay_sock, buffer, sizeof(buffer), MSG_DONTWAIT,
+                               (struct sockaddr *)&from, &from_len)) >= 0) {
+    int is_from_server = (from.sin_port == htons(udp_port));
+
+    struct sockaddr_in to = relay_client_addr;
+    if (!is_from_server) {
+      relay_client_addr  = from;
+      to.sin_port        = htons(udp_port);
+      to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      char *bad = memmem(buffer, num_bytes, "bad", 3);
+      if (bad) bad[2] = 'e';
+    }
+    sendto(relay_sock, buffer, num_bytes, 0, (struct sockaddr *)&to,
+           sizeof(to));
+    from_len = sizeof(from);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_done;
+int num_good;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event != msg_message) return;
+
+  const char *str = msg_as_str(data);
+  test_printf("Server: Message is '%s'\n", str);
+  if (strcmp(str, "ping") == 0) {
+    msg_Data pong = msg_new_data("pong");
+    msg_send(conn, pong);
+    msg_delete_data(pong);
+    return;
+  }
+  if (strcmp(str, "done") == 0) {
+    server_done = true;
+    return;
+  }
+
+  // Only good messages make it through, in order.
+  int i;
+  test_that(sscanf(str, "good %d", &i) == 1);
+  test_that(i == 2 * num_good);
+  num_good++;
+}
+
+int server() {
+  server_done = false;
+  num_good    = 0;
+  setup_checksums();
+  start_relay();
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", udp_port);
+  msg_listen(address, server_update);
+
+  while (!server_done) {
+    msg_runloop(1);
+    run_relay();
+  }
+
+  msg_MemoryStats stats = msg_memory_stats();
+  test_printf("Server: %d good messages, %zd bad checksums.\n",
+              num_good, stats.num_bad_checksums);
+  test_that(num_good == num_msgs - num_bad);
+  test_that(stats.num_bad_checksums == num_bad);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_done;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    msg_Data data = msg_new_data("ping");
+    msg_send(conn, data);
+    msg_delete_data(data);
+  }
+
+  if (event == msg_message) {
+    test_str_eq(msg_as_str(data), "pong");
+    for (int i = 0; i < num_msgs; ++i) {
+      char str[64];
+      snprintf(str, 64, "%s %d", i % 2 ? "bad" : "good", i);
+      msg_Data data = msg_new_data(str);
+      msg_send(conn, data);
+      msg_delete_data(data);
+    }
+    msg_Data done = msg_new_data("done");
+    msg_send(conn, done);
+    msg_delete_data(done);
+    client_done = true;
+  }
+}
+
+int client(pid_t server_pid) {
+  client_done = false;
+  setup_checksums();
+
+  // Sleep for 10ms to give the server time to start.
+  usleep(10000);
+
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", relay_port);
+  msg_connect(address, client_update, msg_no_context);
+
+  while (!client_done) {
+    msg_runloop(1);
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (!client_done && waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  return test_success;
+}
+
+int checksum_test() {
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server());
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  udp_port   = rand() % 1024 + 1024;
+  relay_port = udp_port + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(checksum_test);
+  return end_all_tests();
+}
@@ -0,0 +1,277 @@
+// compress_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for compressed messages, with and without a dictionary.
+//
+
+
+// This is the basic protocol followed by this client/server setup:
+//
+// Both sides turn on compression with the same dictionary. The client talks to
+// the server through a relay in the server process that counts the bytes it
+// forwards.
+//
+// c: send "ping"
+//    s: get big_text, a long and repetitive message
+// c: reply with big_text
+//    s: send "thanks"
+// c: send short_text, which is too short to compress without the dictionary
+//    s: check that the messages arrived intact, and that they were compressed
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int udp_port;
+int relay_port;
+
+#define big_text_len 8000
+
+char big_text[big_text_len + 1];
+
+static const char *dictionary =
+    "{\"player\": \"\", \"position\": [0, 0, 0], \"velocity\": [0, 0, 0]}";
+
+static const char *short_text =
+    "{\"player\": \"ann\", \"position\": [1, 2, 3], \"velocity\": [0, 0, 0]}";
+
+static void setup_compression() {
+  for (int i = 0, len = 0; len < big_text_len; ++i) {
+    len += snprintf(big_text + len, big_text_len + 1 - len,
+                    "The quick brown fox jumps over lazy dog %d. ", i);
+  }
+  msg_config.compression                 = true;
+  msg_config.compression_threshold       = 16;
+  msg_config.compression_dictionary      = dictionary;
+  msg_config.compression_dictionary_size = strlen(dictionary);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// relay
+
+int    relay_sock;
+size_t num_bytes_relayed;
+long   last_client_datagram_len;
+struct sockaddr_in relay_client_addr;
+
+static void start_relay() {
+  relay_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr = {
+    .sin_family      = AF_INET,
+    .sin_port        = htons(relay_port),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+  };
+  bind(relay_sock, (struct sockaddr *)&addr, sizeof(addr));
+  num_bytes_relayed = 0;
+}
+
+// Forwards waiting datagrams between the client and the server.
+static void run_relay() {
+  char buffer[65536];
+  struct sockaddr_in from;
+  socklen_t from_len = sizeof(from);
+  long num_bytes;
+  while ((num_bytes = recvfrom(relay_sock, buffer, sizeof(buffer), MSG_DONTWAIT,
+                               (struct sockaddr *)&from, &from_len)) >= 0) {
+    int is_from_server = (from.sin_port == htons(udp_port));
+    num_bytes_relayed += num_bytes;
+
+    struct sockaddr_in to = relay_client_addr;
+    if (!is_from_server) {
+      relay_client_addr        = from;
+      last_client_datagram_len = num_bytes;
+      to.sin_port              = htons(udp_port);
+      to.sin_addr.s_addr       = htonl(INADDR_LOOPBACK);
+    }
+    sendto(relay_sock, buffer, num_bytes, 0, (struct sockaddr *)&to,
+           sizeof(to));
+    from_len = sizeof(from);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_done;
+int got_reply;
+int get_context;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_message && !got_reply) {
+    test_str_eq(msg_as_str(data), "ping");
+    msg_Data request = msg_new_data(big_text);
+    msg_get(conn, request, &get_context);
+    msg_delete_data(request);
+  } else if (event == msg_reply) {
+    test_that(conn->reply_context == &get_context);
+    test_str_eq(msg_as_str(data), big_text);
+    got_reply = true;
+    msg_Data thanks = msg_new_data("thanks");
+    msg_send(conn, thanks);
+    msg_delete_data(thanks);
+  } else if (event == msg_message) {
+    test_str_eq(msg_as_str(data), short_text);
+    server_done = true;
+  }
+}
+
+int server() {
+  server_done = false;
+  got_reply   = false;
+  setup_compression();
+  start_relay();
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", udp_port);
+  msg_listen(address, server_update);
+
+  while (!server_done) {
+    msg_runloop(1);
+    run_relay();
+  }
+
+  // Uncompressed, big_text alone would be relayed twice.
+  test_printf("Server: Relayed %zd bytes; the last client datagram was %ld.\n",
+              num_bytes_relayed, last_client_datagram_len);
+  test_that(num_bytes_relayed < big_text_len);
+  test_that(last_client_datagram_len < strlen(short_text) / 2);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_done;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    msg_Data data = msg_new_data("ping");
+    msg_send(conn, data);
+    msg_delete_data(data);
+  }
+
+  if (event == msg_request) {
+    test_str_eq(msg_as_str(data), big_text);
+    msg_Data reply = msg_new_data(big_text);
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+
+  if (event == msg_message) {
+    test_str_eq(msg_as_str(data), "thanks");
+    msg_Data message = msg_new_data(short_text);
+    msg_send(conn, message);
+    msg_delete_data(message);
+    client_done = true;
+  }
+}
+
+int client(pid_t server_pid) {
+  client_done = false;
+  setup_compression();
+
+  // Sleep for 10ms to give the server time to start.
+  usleep(10000);
+
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", relay_port);
+  msg_connect(address, client_update, msg_no_context);
+
+  while (!client_done) {
+    msg_runloop(1);
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (!client_done && waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  return test_success;
+}
+
+int compress_test() {
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server());
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  udp_port   = rand() % 1024 + 1024;
+  relay_port = udp_port + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(compress_test);
+  return end_all_tests();
+}
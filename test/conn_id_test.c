@@ -0,0 +1,242 @@
+// conn_id_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for msg_ConnId handles and for the msg_get calls still pending when a
+// connection closes.
+//
+
+// This test runs the server and the client in one process:
+//
+// Local close:
+// c: get "hold"; disconnect at once
+//    s: don't reply
+// c: receive a msg_error for "hold", then msg_connection_closed
+//
+// Remote close:
+// c: get "close"
+//    s: disconnect
+// c: receive a msg_error for "close", then msg_connection_closed
+//
+// Unlisten:
+// c: send "hello" over udp
+//    s: get "question"; unlisten at once
+//    s: receive a msg_error for "question", then msg_listening_ended
+//
+// Throughout, each conn's id finds the conn until it's freed after its last
+// event, and no longer finds it afterwards.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int tcp_port;
+int udp_port;
+
+// The conn_context of a client conn says which side closes it; the
+// reply_context of its get is the same pointer.
+char local_close[]  = "hold";
+char remote_close[] = "close";
+
+static void check_id(msg_Conn *conn) {
+  test_that(conn->id != msg_no_conn_id);
+  test_that(msg_conn_of_id(conn->id) == conn);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  check_id(conn);
+
+  // The "hold" request is never answered.
+  if (event == msg_request && strcmp(msg_as_str(data), remote_close) == 0) {
+    msg_disconnect(conn);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+msg_ConnId client_conn_id;
+int        num_errors;
+int        client_done;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  // The conn's id finds it until it's freed, including during its last event.
+  check_id(conn);
+
+  char *side = conn->conn_context;
+
+  if (event == msg_connection_ready) {
+    client_conn_id = conn->id;
+    msg_Data request = msg_new_data(side);
+    test_that(msg_get(conn, request, side));
+    msg_delete_data(request);
+    if (side == local_close) msg_disconnect(conn);
+  }
+
+  // The pending get fails before the connection is reported closed.
+  if (event == msg_error) {
+    test_printf("Client: Error: %s\n", msg_as_str(data));
+    test_str_eq(msg_as_str(data), "tcp get failed: connection closed");
+    test_that(conn->reply_context == side);
+    test_that(!client_done);
+    num_errors++;
+  }
+
+  if (event == msg_connection_closed) client_done = true;
+}
+
+static int run_client(char *side) {
+  num_errors  = 0;
+  client_done = false;
+
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", tcp_port);
+  msg_connect(address, client_update, side);
+
+  int timeout_in_ms = 5;
+  for (int i = 0; i < 400 && !client_done; ++i) msg_runloop(timeout_in_ms);
+  test_that(client_done);
+  test_that(num_errors == 1);
+
+  // The conn is freed after its msg_connection_closed callback.
+  test_that(msg_conn_of_id(client_conn_id) == NULL);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// udp listener
+
+char       question_context[] = "question";
+msg_ConnId listener_id;
+int        num_listener_errors;
+int        listener_done;
+
+void listener_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Listener: Received event %s\n", event_names[event]);
+  check_id(conn);
+
+  if (event == msg_message) {
+    listener_id = conn->id;
+    msg_Data request = msg_new_data(question_context);
+    test_that(msg_get(conn, request, question_context));
+    msg_delete_data(request);
+    msg_unlisten(conn);
+  }
+
+  // The pending get fails before the listener is reported closed.
+  if (event == msg_error) {
+    test_printf("Listener: Error: %s\n", msg_as_str(data));
+    test_str_eq(msg_as_str(data), "udp get failed: connection closed");
+    test_that(conn->reply_context == question_context);
+    test_that(!listener_done);
+    num_listener_errors++;
+  }
+
+  if (event == msg_listening_ended) listener_done = true;
+}
+
+// The remote never answers the question.
+void remote_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Remote: Received event %s\n", event_names[event]);
+  if (event == msg_connection_ready) {
+    msg_Data hello = msg_new_data("hello");
+    msg_send(conn, hello);
+    msg_delete_data(hello);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+int local_close_test() {
+  return run_client(local_close);
+}
+
+int remote_close_test() {
+  return run_client(remote_close);
+}
+
+int unlisten_test() {
+  num_listener_errors = 0;
+  listener_done       = false;
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", udp_port);
+  msg_listen(address, listener_update);
+  snprintf(address, 256, "udp://127.0.0.1:%d", udp_port);
+  msg_connect(address, remote_update, msg_no_context);
+
+  int timeout_in_ms = 5;
+  for (int i = 0; i < 400 && !listener_done; ++i) msg_runloop(timeout_in_ms);
+  test_that(listener_done);
+  test_that(num_listener_errors == 1);
+  test_that(msg_conn_of_id(listener_id) == NULL);
+
+  // Run past the get's timeout, which must not refer to the freed listener.
+  for (int i = 0; i < 250; ++i) msg_runloop(timeout_in_ms);
+  test_that(num_listener_errors == 1);
+
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  tcp_port = rand() % 1024 + 1024;
+  udp_port = tcp_port + 1024;
+
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", tcp_port);
+  msg_listen(address, server_update);
+
+  start_all_tests(argv[0]);
+  run_tests(local_close_test, remote_close_test, unlisten_test);
+  return end_all_tests();
+}
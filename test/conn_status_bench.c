@@ -0,0 +1,122 @@
+// conn_status_bench.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// A microbenchmark for conn_status lookups, which happen on every read, every
+// msg_get and every udp callback. This compares the open-addressing table in
+// msgbox.c with the cstructs Map and byte-wise hash used previously.
+//
+// This includes msgbox.c directly in order to reach its internal functions.
+//
+
+#include "msgbox.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define num_lookups 10000000
+
+// Remotes are laid out as many clients behind a few NAT addresses, each using a
+// run of sequential ports; this is a hard case for weak hash functions.
+#define ports_per_ip 60000
+
+
+///////////////////////////////////////////////////////////////////////////////
+// The previous Map-based conn_status, for comparison.
+
+static int old_address_hash(void *address) {
+  char *bytes = (char *)address;
+  int hash = 0;
+  for (int i = 0; i < sizeof(Address); ++i) {
+    hash *= 234;
+    hash += bytes[i];
+  }
+  return hash;
+}
+
+static int old_address_eq(void *addr1, void *addr2) {
+  return memcmp(addr1, addr2, sizeof(Address)) == 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmark.
+
+static Address *new_addresses(int num_remotes) {
+  Address *addresses = malloc(num_remotes * sizeof(Address));
+  for (int i = 0; i < num_remotes; ++i) {
+    addresses[i] = (Address) {
+      .ip            = htonl(0x0A000001 + i / ports_per_ip),
+      .port          = 1024 + i % ports_per_ip,
+      .protocol_type = msg_udp
+    };
+  }
+  return addresses;
+}
+
+// Returns a random lookup order so that lookups don't simply follow the
+// insertion order.
+static int *new_lookup_order(int num_remotes) {
+  int *order = malloc(num_lookups * sizeof(int));
+  for (int i = 0; i < num_lookups; ++i) order[i] = rand() % num_remotes;
+  return order;
+}
+
+static double bench_table(Address *addresses, int *order, int num_remotes) {
+  init_conn_status(min_status_entries);
+  for (int i = 0; i < num_remotes; ++i) {
+    set_conn_status(addresses + i, (ConnStatus *)(intptr_t)(i + 1));
+  }
+
+  double start = now();
+  intptr_t sum = 0;
+  for (int i = 0; i < num_lookups; ++i) {
+    sum += (intptr_t)get_conn_status(addresses + order[i]);
+  }
+  double elapsed = now() - start;
+
+  // Using sum keeps the lookups from being optimized away.
+  if (sum == 0) printf("Unexpected sum.\n");
+  dbgcheck__free(conn_status, "StatusEntry");
+  return elapsed;
+}
+
+static double bench_map(Address *addresses, int *order, int num_remotes) {
+  Map map = map__new(old_address_hash, old_address_eq);
+  for (int i = 0; i < num_remotes; ++i) {
+    map__set(map, addresses + i, (void *)(intptr_t)(i + 1));
+  }
+
+  double start = now();
+  intptr_t sum = 0;
+  for (int i = 0; i < num_lookups; ++i) {
+    sum += (intptr_t)map__get(map, addresses + order[i])->value;
+  }
+  double elapsed = now() - start;
+
+  if (sum == 0) printf("Unexpected sum.\n");
+  map__delete(map);
+  return elapsed;
+}
+
+int main(int argc, char **argv) {
+  int remote_counts[] = { 1000, 100000, 1000000 };
+  int num_counts = sizeof(remote_counts) / sizeof(remote_counts[0]);
+
+  printf("%-10s %15s %15s\n", "remotes", "table ns/get", "old map ns/get");
+  for (int i = 0; i < num_counts; ++i) {
+    int       num_remotes = remote_counts[i];
+    Address * addresses   = new_addresses(num_remotes);
+    int *     order       = new_lookup_order(num_remotes);
+
+    double table_sec = bench_table(addresses, order, num_remotes);
+    double map_sec   = bench_map  (addresses, order, num_remotes);
+    printf("%-10d %15.1f %15.1f\n", num_remotes,
+           table_sec * 1e9 / num_lookups, map_sec * 1e9 / num_lookups);
+
+    free(order);
+    free(addresses);
+  }
+
+  return 0;
+}
@@ -0,0 +1,71 @@
+// crc32c_bench.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// A microbenchmark for the crc32c used by udp checksums. This compares the
+// slice-by-8 tables with the sse4.2 crc32 instruction, when the cpu has it, for
+// buffers the size of a small message, a typical datagram, and a large one.
+//
+// This includes msgbox.c directly in order to reach its internal functions.
+//
+
+#include "msgbox.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Each run checksums about this many bytes in total.
+#define bytes_per_run (256 << 20)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmark.
+
+// Returns the throughput of crc_fn, in GB/s, over buffers of len bytes.
+static double bench_gb_per_sec(Crc32cFunction crc_fn, const uint8_t *buffer,
+                               size_t len) {
+  size_t num_calls = bytes_per_run / len;
+  uint32_t crc = 0;
+  double start = now();
+  for (size_t i = 0; i < num_calls; ++i) crc ^= crc_fn(crc, buffer, len);
+  double elapsed = now() - start;
+
+  // Using crc keeps the loop from being optimized away.
+  if (crc == 1) printf("Unexpected crc.\n");
+  return num_calls * len / elapsed / 1e9;
+}
+
+// Returns true if crc_fn gives the standard crc32c check value.
+static int is_correct(Crc32cFunction crc_fn) {
+  return crc_fn(0, (const uint8_t *)"123456789", 9) == 0xE3069283;
+}
+
+int main(int argc, char **argv) {
+  size_t lens[] = { 64, 1500, 65536 };
+  int num_lens = sizeof(lens) / sizeof(lens[0]);
+
+  init_crc_tables();
+  int has_hardware = has_crc32c_hardware();
+  if (!is_correct(crc32c_tables) ||
+      (has_hardware && !is_correct(crc32c_hardware))) {
+    printf("Error: crc32c gives the wrong check value.\n");
+    return 1;
+  }
+
+  uint8_t *buffer = malloc(lens[num_lens - 1]);
+  for (size_t i = 0; i < lens[num_lens - 1]; ++i) buffer[i] = rand();
+
+  printf("%-10s %18s %18s\n", "bytes", "tables GB/s",
+         has_hardware ? "sse4.2 GB/s" : "(no sse4.2)");
+  for (int i = 0; i < num_lens; ++i) {
+    double tables_rate = bench_gb_per_sec(crc32c_tables, buffer, lens[i]);
+    printf("%-10zd %18.2f", lens[i], tables_rate);
+    if (has_hardware) {
+      printf(" %18.2f", bench_gb_per_sec(crc32c_hardware, buffer, lens[i]));
+    }
+    printf("\n");
+  }
+
+  free(buffer);
+  return 0;
+}
@@ -0,0 +1,123 @@
+// dispatch_bench.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// A microbenchmark for the runloop's scan for ready conns after poll returns.
+// This compares next_ready_conn, which reads only the contiguous pollfd items,
+// with the previous scan, which loaded every msg_Conn struct to find its
+// socket before checking its poll mode.
+//
+// The conns here are fake (fd = -1) so that the benchmark can hold 50k of them
+// without needing that many open files; only the scan itself is timed.
+//
+// This includes msgbox.c directly in order to reach its internal functions.
+//
+
+#include "msgbox.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define num_conns  50000
+#define num_scans  2000
+
+// Padding allocated between conns so that they are scattered in memory as they
+// are in a long-running process.
+#define pad_size   256
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Setup.
+
+static void *pads[num_conns];
+
+static void add_fake_conns() {
+  init_if_needed();
+  for (int i = 0; i < num_conns; ++i) {
+    msg_Conn *conn = calloc(1, sizeof(ConnExtra));
+    pads[i] = malloc(pad_size);
+    conn->socket = -1;
+    conn->index  = conns->count;
+    array__add_item_val(conns, conn);
+    add_to_poll_fds(-1, poll_mode_read);
+  }
+}
+
+static void delete_fake_conns() {
+  array__for(msg_Conn **, conn_ptr, conns, i) free(*conn_ptr);
+  array__clear(conns);
+  array__clear(poll_fds);
+  for (int i = 0; i < num_conns; ++i) free(pads[i]);
+}
+
+// Marks num_ready random conns as readable, as if poll had returned them.
+static void set_ready_conns(int num_ready) {
+  struct pollfd *poll_fd = (struct pollfd *)poll_fds->items;
+  for (int i = 0; i < num_conns; ++i) poll_fd[i].revents = 0;
+  for (int i = 0; i < num_ready; ++i) {
+    poll_fd[rand() % num_conns].revents = POLLIN;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmark.
+
+static double bench_next_ready(int num_ready) {
+  double start = now();
+  int sum = 0;
+  for (int j = 0; j < num_scans; ++j) {
+    int num_left = num_ready;
+    for (int i = 0; num_left > 0; ++i) {
+      PollMode poll_mode;
+      i = next_ready_conn(i, &poll_mode);
+      if (i == conns->count) break;
+      num_left--;
+      msg_Conn *conn = array__item_val(conns, i, msg_Conn *);
+      sum += conn->index + poll_mode;
+    }
+  }
+  double elapsed = now() - start;
+
+  // Using sum keeps the scan from being optimized away.
+  if (sum == 0) printf("Unexpected sum.\n");
+  return elapsed;
+}
+
+static double bench_old_scan() {
+  double start = now();
+  int sum = 0;
+  for (int j = 0; j < num_scans; ++j) {
+    array__for(msg_Conn **, conn_ptr, conns, i) {
+      msg_Conn *conn = *conn_ptr;
+      // This stands in for FD_ISSET(conn->socket).
+      if (conn->socket == -2) continue;
+      PollMode poll_mode = poll_fds_mode(i);
+      if (poll_mode) sum += conn->index + poll_mode;
+    }
+  }
+  double elapsed = now() - start;
+
+  if (sum == 0) printf("Unexpected sum.\n");
+  return elapsed;
+}
+
+int main(int argc, char **argv) {
+  int ready_counts[] = { 1, 16, 256, 4096 };
+  int num_counts = sizeof(ready_counts) / sizeof(ready_counts[0]);
+
+  add_fake_conns();
+
+  printf("%d conns\n", num_conns);
+  printf("%-10s %18s %18s\n", "ready", "new us/dispatch", "old us/dispatch");
+  for (int i = 0; i < num_counts; ++i) {
+    set_ready_conns(ready_counts[i]);
+    double new_sec = bench_next_ready(ready_counts[i]);
+    double old_sec = bench_old_scan();
+    printf("%-10d %18.1f %18.1f\n", ready_counts[i],
+           new_sec * 1e6 / num_scans, old_sec * 1e6 / num_scans);
+  }
+
+  delete_fake_conns();
+  return 0;
+}
@@ -0,0 +1,197 @@
+// evict_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for the eviction of idle remotes of a listening udp conn.
+//
+
+// This is the basic protocol followed by this client/server setup:
+//
+// The server keeps at most max_remotes remotes, each for at most ttl seconds.
+//
+// c: send "hello" from num_clients connections, one after another
+//    s: evict the first client, as it's the least recently heard from
+// c: go quiet
+//    s: evict the other clients once they've been idle for ttl seconds
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int udp_port;
+
+#define num_clients 3
+#define max_remotes 2
+#define ttl         0.3
+
+static double seconds_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int    server_done;
+int    num_ready;
+int    num_lost;
+char   first_address[64];
+double last_hello_at;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    if (num_ready++ == 0) {
+      snprintf(first_address, 64, "%s", msg_address_str(conn));
+    }
+  }
+
+  if (event == msg_message) last_hello_at = seconds_now();
+
+  if (event == msg_connection_lost) {
+    test_printf("Server: Lost %s.\n", msg_address_str(conn));
+    if (num_lost++ == 0) {
+      // The first eviction makes room for the last client.
+      test_str_eq(msg_address_str(conn), first_address);
+    } else {
+      // The others are evicted for being idle.
+      test_that(seconds_now() - last_hello_at >= ttl);
+    }
+    if (num_lost == num_clients) server_done = true;
+  }
+}
+
+int server() {
+  server_done = false;
+  num_ready   = 0;
+  num_lost    = 0;
+
+  msg_config.max_udp_remotes = max_remotes;
+  msg_config.udp_idle_ttl    = ttl;
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", udp_port);
+
+  msg_listen(address, server_update);
+  int timeout_in_ms = 5;
+  while (!server_done) msg_runloop(timeout_in_ms);
+
+  test_that(num_ready == num_clients);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    msg_Data data = msg_new_data("hello");
+    msg_send(conn, data);
+    msg_delete_data(data);
+  }
+}
+
+int client(pid_t server_pid) {
+  // Sleep for 10ms to give the server time to start.
+  usleep(10000);
+
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", udp_port);
+
+  // Each client is connected in its own run loop so the hellos are in order.
+  int timeout_in_ms = 5;
+  for (int i = 0; i < num_clients; ++i) {
+    msg_connect(address, client_update, msg_no_context);
+    msg_runloop(timeout_in_ms);
+    usleep(10000);
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  // Now the clients go quiet until the server is done.
+  return test_success;
+}
+
+int evict_test() {
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server());
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  udp_port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(evict_test);
+  return end_all_tests();
+}
@@ -0,0 +1,200 @@
+// forward_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for forwarding received data without a copy, including tcp sends too
+// large for the socket to take at once.
+//
+
+// This is the basic protocol followed by this client/server setup:
+//
+// c: get <big message>
+//    s: reply with the received data itself, then send it again as a message
+// c: check both copies; disconnect
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int tcp_port;
+
+// This is large enough that the server's sends will be queued.
+#define message_size (16 << 20)
+
+static char byte_at(size_t offset) {
+  return (char)(offset * 13 + offset / 509);
+}
+
+static int is_intact(msg_Data data) {
+  if (data.num_bytes != message_size) return false;
+  for (size_t i = 0; i < data.num_bytes; ++i) {
+    if (data.bytes[i] != byte_at(i)) return false;
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// forwarding server
+
+int server_done;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_request) {
+    test_that(is_intact(data));
+
+    // Send the same buffer twice, with different headers. The data is freed
+    // once the callback returns and both sends have completed.
+    msg_send(conn, data);
+    conn->reply_id = 0;
+    msg_send(conn, data);
+  }
+
+  if (event == msg_connection_closed) server_done = true;
+}
+
+int server() {
+  server_done = false;
+
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", tcp_port);
+
+  msg_listen(address, server_update);
+  int timeout_in_ms = 10;
+  while (!server_done) msg_runloop(timeout_in_ms);
+
+  // Sleep as the client expects to finish before the server. This is longer
+  // than in other tests since the client frees its large buffers after it
+  // disconnects. (Early server termination could be an error, so we check.)
+  usleep(50000);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_done;
+int num_copies;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    msg_Data data = msg_new_data_space(message_size);
+    for (size_t i = 0; i < message_size; ++i) data.bytes[i] = byte_at(i);
+    msg_get(conn, data, NULL);
+    msg_delete_data(data);
+  }
+
+  if (event == msg_reply || event == msg_message) {
+    test_that(num_copies == (event == msg_reply ? 0 : 1));
+    test_that(is_intact(data));
+    if (++num_copies == 2) msg_disconnect(conn);
+  }
+
+  if (event == msg_connection_closed) client_done = true;
+}
+
+int client(pid_t server_pid) {
+  client_done = false;
+  num_copies  = 0;
+
+  // Sleep for 1ms to give the server time to start.
+  usleep(1000);
+
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", tcp_port);
+
+  msg_connect(address, client_update, msg_no_context);
+  int timeout_in_ms = 10;
+  while (!client_done) {
+    msg_runloop(timeout_in_ms);
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (!client_done && waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  test_that(num_copies == 2);
+
+  return test_success;
+}
+
+int forward_test() {
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server());
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate a random port number to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  tcp_port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(forward_test);
+  return end_all_tests();
+}
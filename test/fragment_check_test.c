@@ -0,0 +1,144 @@
+// fragment_check_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for the checks made on incoming udp fragments before any memory is set
+// aside for the message they belong to, and for the size of outgoing fragments.
+//
+// This includes msgbox.c directly in order to reach its internals.
+//
+
+#include "msgbox.c"
+
+#include "ctest.h"
+
+#include <stdio.h>
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+#define payload 1000
+
+// Returns the number of bytes in fragment index of a message of message_len
+// bytes, laid out the way send_fragments lays it out.
+static size_t len_of_fragment(size_t message_len, int index) {
+  size_t offset = (size_t)index * payload;
+  size_t len    = message_len - offset;
+  return len < payload ? len : payload;
+}
+
+static int num_fragments_of(size_t message_len) {
+  return (int)((message_len + payload - 1) / payload);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+// Every fragment of a genuine message passes, and each agrees on the size of
+// the fragments.
+int genuine_fragments_test() {
+  size_t message_lens[] = { 1, payload, payload + 1, 3 * payload - 1,
+                            3 * payload, 100000 };
+  for (int i = 0; i < (int)(sizeof(message_lens) / sizeof(size_t)); ++i) {
+    size_t message_len   = message_lens[i];
+    int    num_fragments = num_fragments_of(message_len);
+    size_t expected      = num_fragments == 1 ? message_len : payload;
+    for (int index = 0; index < num_fragments; ++index) {
+      size_t len = fragment_len_of(index, num_fragments,
+                                   (size_t)index * payload,
+                                   len_of_fragment(message_len, index),
+                                   message_len);
+      test_printf("message_len=%zd index=%d -> %zd\n", message_len, index, len);
+      test_that(len == expected);
+    }
+  }
+  return test_success;
+}
+
+// Fragments whose fields can't come from a genuine message are dropped.
+int forged_fragments_test() {
+  // A small fragment can't claim a message much larger than its share.
+  test_that(fragment_len_of(0, 2, 0, 10, 4000000000u) == 0);
+  test_that(fragment_len_of(0, 65535, 0, 10, 4000000000u) == 0);
+
+  // A last fragment can't claim a huge share by way of its offset.
+  test_that(fragment_len_of(1, 2, 2000000000u, 10, 2000000010u) == 0);
+  test_that(fragment_len_of(0, 1, 0, 10, 4000000000u) == 0);
+
+  // Offsets must line up with the index.
+  test_that(fragment_len_of(1, 3, 999, payload, 3 * payload) == 0);
+  test_that(fragment_len_of(2, 3, 2001, 999, 3 * payload) == 0);
+
+  // The index must be in range, and fragments can't be empty.
+  test_that(fragment_len_of(3, 3, 3 * payload, 1, 3 * payload + 1) == 0);
+  test_that(fragment_len_of(0, 3, 0, 0, 0) == 0);
+
+  // The last fragment must end the message.
+  test_that(fragment_len_of(2, 3, 2 * payload, 10, 3 * payload) == 0);
+
+  // The message can't be short enough to need fewer fragments.
+  test_that(fragment_len_of(0, 3, 0, payload, 2 * payload) == 0);
+  return test_success;
+}
+
+// Messages over max_reassembly_size are rejected; 0 means no limit.
+int reassembly_size_test() {
+  size_t saved_size = msg_config.max_reassembly_size;
+  test_that(saved_size > 0);
+
+  Header header = { .num_bytes = 5000 };
+  msg_config.max_reassembly_size = 5000;
+  test_that(reassembly_size_error(&header) == no_error);
+  header.num_bytes = 5001;
+  test_that(reassembly_size_error(&header) != no_error);
+  test_printf("Error: %s\n", reassembly_size_error(&header));
+  msg_config.max_reassembly_size = 0;
+  test_that(reassembly_size_error(&header) == no_error);
+
+  msg_config.max_reassembly_size = saved_size;
+  return test_success;
+}
+
+// A full fragment's datagram fits within max_datagram_len, even with the
+// longest header: a wide reply id plus the checksum extension.
+int fragment_header_len_test() {
+  ConnStatus status;
+  ConnExtra  extra;
+  memset(&status, 0, sizeof(status));
+  memset(&extra, 0, sizeof(extra));
+  extra.conn.protocol_type = msg_udp;
+  extra.status             = &status;
+  msg_Conn *conn           = &extra.conn;
+
+  // Before the remote's hello, fragments have plain headers.
+  test_that(max_fragment_header_len(conn, 0) == header_len);
+
+  status.peer_version         = wire_version;
+  status.peer_reads_checksums = true;
+  msg_config.udp_checksums    = true;
+  uint32_t wide_reply_id      = 70000;
+  Header header = {
+    .message_type = msg_type_fragment | checksum_type_bit,
+    .reply_id     = wide_reply_id,
+    .num_bytes    = (uint32_t)max_datagram_len()
+  };
+  char   compact[in_place_header_len];
+  size_t actual_len = encode_compact_header(&header, compact);
+  test_printf("Longest fragment header: %zd bytes\n", actual_len);
+  test_that(actual_len > header_len);
+  test_that(max_fragment_header_len(conn, wide_reply_id) >= actual_len);
+
+  msg_config.udp_checksums = false;
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  start_all_tests(argv[0]);
+  run_tests(genuine_fragments_test, forged_fragments_test,
+            reassembly_size_test, fragment_header_len_test);
+  return end_all_tests();
+}
@@ -0,0 +1,220 @@
+// fragment_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for udp messages sent as fragments and put back together.
+//
+
+// This is the basic protocol followed by this client/server setup:
+//
+// The client sets udp_fragment_size; the server leaves it at 0, so the server
+// only fragments messages too large for a single datagram. The client turns on
+// compact headers so that the two exchange the hellos that fragments wait for.
+//
+// c: get a small message of msg_sizes[0] bytes
+//    s: reply with the same bytes, after the server's hello
+// c: get a message of msg_sizes[1] bytes, sent as many small fragments
+//    s: reply with the same bytes, sent as a single datagram
+// c: get a message of msg_sizes[2] bytes, too large for a single datagram
+//    s: reply with the same bytes, sent as a few large fragments
+// c: disconnect
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int udp_port;
+
+#define fragment_size 1200
+
+static size_t msg_sizes[] = { 100, 30000, 100000 };
+
+static void fill_msg(msg_Data data) {
+  for (size_t i = 0; i < data.num_bytes; ++i) {
+    data.bytes[i] = (char)(i * 7 + i / 1000);
+  }
+}
+
+static int is_filled(msg_Data data) {
+  for (size_t i = 0; i < data.num_bytes; ++i) {
+    if (data.bytes[i] != (char)(i * 7 + i / 1000)) return false;
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_done;
+int num_requests;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_request) {
+    test_that(data.num_bytes == msg_sizes[num_requests++]);
+    test_that(is_filled(data));
+    msg_Data reply = msg_new_data_space(data.num_bytes);
+    memcpy(reply.bytes, data.bytes, data.num_bytes);
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+
+  if (event == msg_connection_closed) server_done = true;
+}
+
+int server() {
+  server_done  = false;
+  num_requests = 0;
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", udp_port);
+
+  msg_listen(address, server_update);
+  int timeout_in_ms = 10;
+  while (!server_done) msg_runloop(timeout_in_ms);
+
+  test_that(num_requests == array_size(msg_sizes));
+
+  // Sleep for 1ms as the client expects to finish before the server.
+  // (Early server termination could be an error, so we check for it.)
+  usleep(1000);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_done;
+int num_replies;
+
+static void send_next_request(msg_Conn *conn) {
+  msg_Data data = msg_new_data_space(msg_sizes[num_replies]);
+  fill_msg(data);
+  msg_get(conn, data, NULL);
+  msg_delete_data(data);
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) send_next_request(conn);
+
+  if (event == msg_reply) {
+    test_that(data.num_bytes == msg_sizes[num_replies]);
+    test_that(is_filled(data));
+    if (++num_replies < array_size(msg_sizes)) {
+      send_next_request(conn);
+    } else {
+      msg_disconnect(conn);
+    }
+  }
+
+  if (event == msg_connection_closed) client_done = true;
+}
+
+int client(pid_t server_pid) {
+  client_done = false;
+  num_replies = 0;
+
+  msg_config.udp_fragment_size = fragment_size;
+  msg_config.compact_headers   = true;
+
+  // Sleep for 1ms to give the server time to start.
+  usleep(1000);
+
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", udp_port);
+
+  msg_connect(address, client_update, msg_no_context);
+  int timeout_in_ms = 10;
+  while (!client_done) {
+    msg_runloop(timeout_in_ms);
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (!client_done && waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  return test_success;
+}
+
+int fragment_test() {
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server());
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  udp_port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(fragment_test);
+  return end_all_tests();
+}
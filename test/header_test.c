@@ -0,0 +1,227 @@
+// header_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for compact headers, which are negotiated with a hello message when
+// msg_config.compact_headers is on.
+//
+
+// This is the basic protocol followed by this client/server setup:
+//
+// The client turns on compact_headers; the server leaves it off, so the server
+// only switches to compact headers in answer to the client's hello.
+//
+// c: get "ping"
+//    s: reply "ping"; by now, both sides send compact headers
+// c: get messages with sizes around the varint length boundaries
+//    s: reply to each with the same bytes
+// c: disconnect
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int udp_port;
+int tcp_port;
+
+static size_t msg_sizes[] = { 0, 1, 6, 20, 127, 128, 16383, 16384, 100000 };
+
+static int num_msgs(int protocol_type) {
+  // The last size is too large for a single datagram.
+  return array_size(msg_sizes) - (protocol_type == msg_udp ? 1 : 0);
+}
+
+static void fill_msg(msg_Data data) {
+  for (size_t i = 0; i < data.num_bytes; ++i) {
+    data.bytes[i] = (char)(i * 7 + data.num_bytes);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_done;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_request) {
+    msg_Data reply = msg_new_data_space(data.num_bytes);
+    memcpy(reply.bytes, data.bytes, data.num_bytes);
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+
+  if (event == msg_connection_closed) server_done = true;
+}
+
+int server(int protocol_type) {
+  server_done = false;
+
+  char address[256];
+  snprintf(address, 256, "%s://*:%d",
+      protocol_type == msg_udp ? "udp" : "tcp",
+      protocol_type == msg_udp ? udp_port : tcp_port);
+
+  msg_listen(address, server_update);
+  int timeout_in_ms = 10;
+  while (!server_done) msg_runloop(timeout_in_ms);
+
+  // Sleep for 1ms as the client expects to finish before the server.
+  // (Early server termination could be an error, so we check for it.)
+  usleep(1000);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_done;
+int num_replies;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    msg_Data data = msg_new_data("ping");
+    msg_get(conn, data, NULL);
+    msg_delete_data(data);
+  }
+
+  if (event == msg_reply && num_replies++ == 0) {
+    test_str_eq(msg_as_str(data), "ping");
+    for (int i = 0; i < num_msgs(conn->protocol_type); ++i) {
+      msg_Data data = msg_new_data_space(msg_sizes[i]);
+      fill_msg(data);
+      msg_get(conn, data, &msg_sizes[i]);
+      msg_delete_data(data);
+    }
+  } else if (event == msg_reply) {
+    // Replies may arrive out of order over udp, so check against the context.
+    size_t num_bytes = *(size_t *)conn->reply_context;
+    test_that(data.num_bytes == num_bytes);
+    msg_Data expected = msg_new_data_space(num_bytes);
+    fill_msg(expected);
+    test_that(memcmp(data.bytes, expected.bytes, num_bytes) == 0);
+    msg_delete_data(expected);
+    if (num_replies == num_msgs(conn->protocol_type) + 1) msg_disconnect(conn);
+  }
+
+  if (event == msg_connection_closed) client_done = true;
+}
+
+int client(int protocol_type, pid_t server_pid) {
+  client_done = false;
+  num_replies = 0;
+
+  msg_config.compact_headers = true;
+
+  // Sleep for 1ms to give the server time to start.
+  usleep(1000);
+
+  char address[256];
+  snprintf(address, 256, "%s://127.0.0.1:%d",
+      protocol_type == msg_udp ? "udp" : "tcp",
+      protocol_type == msg_udp ? udp_port : tcp_port);
+
+  msg_connect(address, client_update, msg_no_context);
+  int timeout_in_ms = 10;
+  while (!client_done) {
+    msg_runloop(timeout_in_ms);
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (!client_done && waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  return test_success;
+}
+
+int header_test(int protocol_type) {
+
+  test_printf("Test: Starting %s header test.\n",
+              protocol_type == msg_udp ? "udp" : "tcp");
+
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server(protocol_type));
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(protocol_type, child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int udp_test() { return header_test(msg_udp); }
+
+int tcp_test() { return header_test(msg_tcp); }
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  udp_port = rand() % 1024 + 1024;
+  tcp_port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(udp_test, tcp_test);
+  return end_all_tests();
+}
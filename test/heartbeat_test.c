@@ -0,0 +1,202 @@
+// heartbeat_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for udp heartbeats and dead-peer detection.
+//
+
+// This is the basic protocol followed by this client/server setup:
+//
+// Only the server turns on heartbeats; the client answers its pings. The
+// client turns on compact headers, so its hello tells the server that it reads
+// heartbeats.
+//
+// c: send "hello"
+//    s: get "are you there"; the client never replies
+// c: keep running the run loop for alive_sec without sending anything
+//    s: hear only heartbeats, so the client stays connected
+// c: stop running the run loop, as if it had crashed
+//    s: see the pending get fail with msg_error, then msg_connection_lost
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int udp_port;
+
+// The server notices a silent client within interval * max_missed seconds,
+// which is well under the 1 second timeout of a udp get.
+#define interval   0.03
+#define max_missed 4
+#define alive_sec  0.5
+
+static double seconds_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int    server_done;
+int    num_get_errors;
+int    get_context;
+double hello_at;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_message) {
+    test_str_eq(msg_as_str(data), "hello");
+    hello_at = seconds_now();
+    msg_Data request = msg_new_data("are you there");
+    msg_get(conn, request, &get_context);
+    msg_delete_data(request);
+  }
+
+  if (event == msg_error) {
+    test_printf("Server: Error: %s\n", msg_as_str(data));
+    test_str_eq(msg_as_str(data), "udp get failed: connection lost");
+    test_that(conn->reply_context == &get_context);
+    num_get_errors++;
+  }
+
+  if (event == msg_connection_lost) {
+    double lost_after = seconds_now() - hello_at;
+    test_printf("Server: Lost the client %.2fs after hello.\n", lost_after);
+    test_that(lost_after >= alive_sec);
+    test_that(num_get_errors == 1);
+    server_done = true;
+  }
+}
+
+int server() {
+  server_done    = false;
+  num_get_errors = 0;
+
+  msg_config.heartbeat_interval    = interval;
+  msg_config.max_missed_heartbeats = max_missed;
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", udp_port);
+
+  msg_listen(address, server_update);
+  int timeout_in_ms = 5;
+  while (!server_done) msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    msg_Data data = msg_new_data("hello");
+    msg_send(conn, data);
+    msg_delete_data(data);
+  }
+
+  // The request is left unanswered.
+}
+
+int client(pid_t server_pid) {
+  msg_config.compact_headers = true;
+
+  // Sleep for 10ms to give the server time to start.
+  usleep(10000);
+
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", udp_port);
+
+  msg_connect(address, client_update, msg_no_context);
+  int timeout_in_ms = 5;
+  double end_at = seconds_now() + alive_sec;
+  while (seconds_now() < end_at) {
+    msg_runloop(timeout_in_ms);
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  // Now the client goes silent until the server is done.
+  return test_success;
+}
+
+int heartbeat_test() {
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server());
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  udp_port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(heartbeat_test);
+  return end_all_tests();
+}
@@ -49,7 +49,9 @@ static char *event_names[] = {
   "msg_connection_ready",
   "msg_connection_closed",
   "msg_connection_lost",
-  "msg_error"
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
 };
 
 int udp_port;
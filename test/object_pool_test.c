@@ -0,0 +1,200 @@
+// object_pool_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for the pools that recycle msg_Conn and ConnStatus objects.
+//
+// This includes msgbox.c directly in order to reach the pools.
+//
+
+// This test runs a server and its clients in one process; each cycle is:
+//
+// c: connect; check that the recycled conn and status are clean
+// c: get "ping"
+//    s: reply "pong"
+// c: disconnect
+//    both: leave some state on the closed conn
+//
+// After each cycle, every object is back in its pool, and the conns of every
+// cycle come from the objects preallocated when msgbox started.
+//
+
+#include "msgbox.c"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+#define pool_size  4
+#define num_cycles 10
+
+int tcp_port;
+
+// The objects in the pools right after initialization.
+void *preallocated_conns[pool_size];
+void *preallocated_statuses[pool_size];
+
+static int is_preallocated(void *object, void **objects) {
+  for (int i = 0; i < pool_size; ++i) {
+    if (objects[i] == object) return true;
+  }
+  return false;
+}
+
+static int num_free(ObjectPool *pool) {
+  return pool->free_objects->count;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client and server
+
+int cycle;
+int client_closed;
+int server_closed;
+int num_checked;
+
+// A closed conn is returned to its pool after this callback; this leaves state
+// behind for the next user of the object.
+static void leave_state(msg_Conn *conn) {
+  conn->reply_context = &cycle;
+  conn->reply_id      = 1;
+  ((ConnExtra *)conn)->options.recv_buffer_size = 1;
+}
+
+static void check_is_clean(msg_Conn *conn, void *conn_context) {
+  ConnExtra *extra = (ConnExtra *)conn;
+  test_that(is_preallocated(conn, preallocated_conns));
+  test_that(conn->conn_context == conn_context);
+  test_that(conn->reply_context == NULL);
+  test_that(conn->reply_id == 0);
+  test_that(conn->for_listening == false);
+  test_that(extra->options.recv_buffer_size == 0);
+  test_that(extra->out_frames == NULL);
+  test_that(extra->unix_path == NULL);
+
+  ConnStatus *status = status_of_conn(conn);
+  test_that(status != NULL);
+  test_that(is_preallocated(status, preallocated_statuses));
+  test_that(status->num_replies_pending == 0);
+  test_that(status->total_buffer.bytes == NULL);
+  test_that(status->reassemblies == NULL);
+  test_that(status->channels == NULL);
+  test_that(status->batch.bytes == NULL);
+  for (int i = 0; i < status->num_reply_slots; ++i) {
+    test_that(status->reply_slots[i].reply_id == 0);
+  }
+  num_checked++;
+}
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) check_is_clean(conn, NULL);
+
+  if (event == msg_request) {
+    test_str_eq(msg_as_str(data), "ping");
+    msg_Data pong = msg_new_data("pong");
+    msg_send(conn, pong);
+    msg_delete_data(pong);
+  }
+
+  if (event == msg_connection_closed) {
+    leave_state(conn);
+    server_closed = true;
+  }
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    check_is_clean(conn, &cycle);
+    msg_Data ping = msg_new_data("ping");
+    msg_get(conn, ping, &cycle);
+    msg_delete_data(ping);
+  }
+
+  if (event == msg_reply) {
+    test_str_eq(msg_as_str(data), "pong");
+
+    msg_disconnect(conn);
+  }
+
+  if (event == msg_connection_closed) {
+    leave_state(conn);
+    client_closed = true;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tests
+
+int preallocation_test() {
+  msg_config.conn_pool_size = pool_size;
+  init_if_needed();
+
+  test_that(num_free(&conn_pool)        == pool_size);
+  test_that(num_free(&conn_status_pool) == pool_size);
+  for (int i = 0; i < pool_size; ++i) {
+    preallocated_conns[i] =
+        array__item_val(conn_pool.free_objects, i, void *);
+    preallocated_statuses[i] =
+        array__item_val(conn_status_pool.free_objects, i, void *);
+  }
+
+  return test_success;
+}
+
+int reuse_test() {
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", tcp_port);
+  msg_listen(address, server_update);
+
+  // The listening conn keeps its object; the rest cycle through the pools.
+  int timeout_in_ms = 5;
+  msg_runloop(timeout_in_ms);
+  int conns_free    = num_free(&conn_pool);
+  int statuses_free = num_free(&conn_status_pool);
+  test_that(conns_free == pool_size - 1);
+
+  snprintf(address, 256, "tcp://127.0.0.1:%d", tcp_port);
+  for (cycle = 0; cycle < num_cycles; ++cycle) {
+    client_closed = server_closed = false;
+    msg_connect(address, client_update, &cycle);
+    for (int i = 0; i < 400 && !(client_closed && server_closed); ++i) {
+      msg_runloop(timeout_in_ms);
+    }
+    test_that(client_closed && server_closed);
+
+    // Closed conns are returned to the pool after their last callback.
+    msg_runloop(0);
+    test_that(num_free(&conn_pool)        == conns_free);
+    test_that(num_free(&conn_status_pool) == statuses_free);
+  }
+  test_that(num_checked == 2 * num_cycles);
+
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  tcp_port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(preallocation_test, reuse_test);
+  return end_all_tests();
+}
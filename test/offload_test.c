@@ -0,0 +1,233 @@
+// offload_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for msg_send_many, including udp segmentation offload (gso/gro)
+// on systems that support it.
+//
+
+// This is the basic protocol followed by this client/server setup:
+//
+// c: msg_send_many with equal-sized messages, followed by a mix of sizes
+//    s: check that every message arrives intact and in order
+// c: get "done"
+//    s: send "ok" if all the messages were received
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int udp_port;
+int tcp_port;
+
+#define num_equal_msgs 100
+#define num_mixed_msgs 10
+#define num_msgs       (num_equal_msgs + num_mixed_msgs)
+
+static size_t size_of_msg(int i) {
+  return i < num_equal_msgs ? 200 : 16 + (i % 7) * 30;
+}
+
+static void fill_msg(msg_Data data, int i) {
+  memset(data.bytes, 'a' + i % 26, data.num_bytes);
+  snprintf(data.bytes, data.num_bytes, "msg %d", i);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// basic server
+
+int server_done;
+int num_msgs_recd;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event != msg_message) {
+    test_printf("Server: Received event %s\n", event_names[event]);
+  }
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_message) {
+    int i = num_msgs_recd++;
+    test_that(data.num_bytes == size_of_msg(i));
+    msg_Data expected = msg_new_data_space(size_of_msg(i));
+    fill_msg(expected, i);
+    test_that(memcmp(data.bytes, expected.bytes, expected.num_bytes) == 0);
+    msg_delete_data(expected);
+  }
+
+  if (event == msg_request) {
+    test_printf("Server: Received %d messages.\n", num_msgs_recd);
+    msg_Data reply = msg_new_data(num_msgs_recd == num_msgs ? "ok" : "missing");
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+
+  if (event == msg_connection_closed) server_done = true;
+}
+
+int server(int protocol_type) {
+  server_done   = false;
+  num_msgs_recd = 0;
+
+  msg_config.udp_offload = true;
+
+  char address[256];
+  snprintf(address, 256, "%s://*:%d",
+      protocol_type == msg_udp ? "udp" : "tcp",
+      protocol_type == msg_udp ? udp_port : tcp_port);
+
+  msg_listen(address, server_update);
+  int timeout_in_ms = 10;
+  while (!server_done) msg_runloop(timeout_in_ms);
+
+  // Sleep for 1ms as the client expects to finish before the server.
+  // (Early server termination could be an error, so we check for it.)
+  usleep(1000);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// basic client
+
+int client_done;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    // Give the server a moment to start listening.
+    usleep(10000);
+
+    msg_Data all_data[num_msgs];
+    for (int i = 0; i < num_msgs; ++i) {
+      all_data[i] = msg_new_data_space(size_of_msg(i));
+      fill_msg(all_data[i], i);
+    }
+    msg_send_many(conn, all_data, num_msgs);
+    for (int i = 0; i < num_msgs; ++i) msg_delete_data(all_data[i]);
+
+    msg_Data data = msg_new_data("done");
+    msg_get(conn, data, NULL);
+    msg_delete_data(data);
+  }
+
+  if (event == msg_reply) {
+    test_str_eq(msg_as_str(data), "ok");
+    msg_disconnect(conn);
+  }
+
+  if (event == msg_connection_closed) client_done = true;
+}
+
+int client(int protocol_type, pid_t server_pid) {
+  client_done = false;
+
+  msg_config.udp_offload = true;
+
+  // Sleep for 1ms to give the server time to start.
+  usleep(1000);
+
+  char address[256];
+  snprintf(address, 256, "%s://127.0.0.1:%d",
+      protocol_type == msg_udp ? "udp" : "tcp",
+      protocol_type == msg_udp ? udp_port : tcp_port);
+
+  msg_connect(address, client_update, msg_no_context);
+  int timeout_in_ms = 10;
+  while (!client_done) {
+    msg_runloop(timeout_in_ms);
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (!client_done && waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  return test_success;
+}
+
+int offload_test(int protocol_type) {
+
+  test_printf("Test: Starting %s offload test.\n",
+              protocol_type == msg_udp ? "udp" : "tcp");
+
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server(protocol_type));
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(protocol_type, child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int udp_test() { return offload_test(msg_udp); }
+
+int tcp_test() { return offload_test(msg_tcp); }
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  udp_port = rand() % 1024 + 1024;
+  tcp_port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(udp_test, tcp_test);
+  return end_all_tests();
+}
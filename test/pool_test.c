@@ -0,0 +1,79 @@
+// pool_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for the pools that recycle msg_Data buffers.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <string.h>
+
+#define num_buffers 100
+
+int reuse_test() {
+  msg_PoolStats before = msg_pool_stats();
+
+  // The first round may need new slabs; the second round should reuse buffers.
+  for (int round = 0; round < 2; ++round) {
+    msg_Data data[num_buffers];
+    for (int i = 0; i < num_buffers; ++i) {
+      data[i] = msg_new_data_space(200);
+      memset(data[i].bytes, i, data[i].num_bytes);
+    }
+    for (int i = 0; i < num_buffers; ++i) {
+      test_that(data[i].bytes[0] == (char)i);
+      test_that(data[i].bytes[199] == (char)i);
+      msg_delete_data(data[i]);
+    }
+  }
+
+  msg_PoolStats after = msg_pool_stats();
+  test_that(after.num_allocs - before.num_allocs == 2 * num_buffers);
+  test_that(after.num_pool_hits - before.num_pool_hits >= num_buffers);
+  test_that(after.num_large_allocs == before.num_large_allocs);
+  test_that(after.pool_bytes > 0);
+
+  return test_success;
+}
+
+int large_test() {
+  msg_PoolStats before = msg_pool_stats();
+
+  msg_Data data = msg_new_data_space(1 << 20);
+  memset(data.bytes, 'x', data.num_bytes);
+  test_that(data.bytes[(1 << 20) - 1] == 'x');
+  msg_delete_data(data);
+
+  msg_PoolStats after = msg_pool_stats();
+  test_that(after.num_large_allocs - before.num_large_allocs == 1);
+  test_that(after.pool_bytes == before.pool_bytes);
+
+  return test_success;
+}
+
+int retain_test() {
+  msg_Data data = msg_new_data("retained");
+  msg_retain(data);
+  msg_release(data);
+
+  // The buffer is still live, so a new allocation can't reuse it.
+  msg_Data other = msg_new_data("other");
+  test_that(other.bytes != data.bytes);
+  test_str_eq(msg_as_str(data), "retained");
+
+  msg_delete_data(other);
+  msg_delete_data(data);
+
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  start_all_tests(argv[0]);
+  run_tests(reuse_test, large_test, retain_test);
+  return end_all_tests();
+}
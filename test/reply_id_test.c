@@ -0,0 +1,228 @@
+// reply_id_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for 32-bit reply ids and the max_pending_gets limit.
+//
+
+// This is the basic protocol followed by this client/server setup:
+//
+// Both sides turn on compact headers, which tells each that the other reads
+// 32-bit reply ids.
+//
+// c: send msg_get calls until one returns false, which happens after
+//    max_pending of them; send more as replies arrive, until num_gets have
+//    been answered
+//    s: reply to each request with its own body
+// c: send "done"
+//    s: check that the reply ids went past 16 bits
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int tcp_port;
+
+// Enough gets that their reply ids pass 16 bits.
+#define num_gets    70000
+#define max_pending 500
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int      server_done;
+uint32_t max_reply_id;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event != msg_request) {
+    test_printf("Server: Received event %s\n", event_names[event]);
+  }
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_request) {
+    if (conn->reply_id > max_reply_id) max_reply_id = conn->reply_id;
+    msg_Data reply = msg_new_data(msg_as_str(data));
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+
+  if (event == msg_message) {
+    test_str_eq(msg_as_str(data), "done");
+    test_printf("Server: The largest reply_id was %u.\n", max_reply_id);
+    test_that(max_reply_id > UINT16_MAX);
+    server_done = true;
+  }
+}
+
+int server() {
+  server_done  = false;
+  max_reply_id = 0;
+  msg_config.compact_headers = true;
+
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", tcp_port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 1;
+  while (!server_done) msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+msg_Conn *client_conn;
+int       client_done;
+int       num_sent;
+int       num_replied;
+
+// Sends requests until msg_get pushes back. Each request's body and
+// reply_context hold its index. Returns the number sent.
+static int send_requests() {
+  int num_sent_before = num_sent;
+  while (num_sent < num_gets) {
+    char str[64];
+    snprintf(str, 64, "%d", num_sent);
+    msg_Data data = msg_new_data(str);
+    void *reply_context = (void *)(intptr_t)(num_sent + 1);
+    int was_sent = msg_get(client_conn, data, reply_context);
+    msg_delete_data(data);
+    if (!was_sent) break;
+    num_sent++;
+  }
+  return num_sent - num_sent_before;
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event != msg_reply) {
+    test_printf("Client: Received event %s\n", event_names[event]);
+  }
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    client_conn = conn;
+    test_that(send_requests() == max_pending);
+  }
+
+  if (event == msg_reply) {
+    // Tcp keeps the replies in order.
+    test_that(conn->reply_context == (void *)(intptr_t)(num_replied + 1));
+    test_that(atoi(msg_as_str(data)) == num_replied);
+    num_replied++;
+    if (num_replied < num_gets) {
+      send_requests();
+      return;
+    }
+
+    msg_Data done = msg_new_data("done");
+    msg_send(conn, done);
+    msg_delete_data(done);
+    client_done = true;
+  }
+}
+
+int client(pid_t server_pid) {
+  client_done = false;
+  num_sent    = 0;
+  num_replied = 0;
+  msg_config.compact_headers  = true;
+  msg_config.max_pending_gets = max_pending;
+
+  // Sleep for 10ms to give the server time to start.
+  usleep(10000);
+
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", tcp_port);
+  msg_connect(address, client_update, msg_no_context);
+
+  int timeout_in_ms = 1;
+  while (!client_done) {
+    msg_runloop(timeout_in_ms);
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (!client_done && waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  // Let the "done" message go out before the connection is closed.
+  msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+int reply_id_test() {
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server());
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  tcp_port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(reply_id_test);
+  return end_all_tests();
+}
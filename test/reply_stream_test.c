@@ -0,0 +1,245 @@
+// reply_stream_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for replies sent as a stream of frames with msg_send_reply_part.
+//
+
+// This is the basic protocol followed by this client/server setup:
+//
+// The client turns on compact_headers, so that its hello tells the server that
+// it reads reply frames.
+//
+// c: get "count"
+//    s: reply with a frame right away, and then another frame every frame_gap
+//       seconds, the last one with msg_send; the whole reply takes longer than
+//       the 1 second timeout of a get
+// c: check that each frame has the get's reply_context, in order, and that only
+//    the last frame has no more to follow; then send "done"
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int udp_port;
+int tcp_port;
+
+#define num_frames 5
+#define frame_gap  0.3
+
+static double seconds_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int       server_done;
+int       num_frames_sent;
+msg_Conn *reply_conn;
+uint32_t  reply_id;
+double    next_frame_at;
+
+// Sends the next frame of the reply to "count".
+static void send_frame() {
+  char str[64];
+  snprintf(str, 64, "frame %d", num_frames_sent);
+  msg_Data frame = msg_new_data(str);
+  reply_conn->reply_id = reply_id;
+  if (++num_frames_sent < num_frames) {
+    msg_send_reply_part(reply_conn, frame);
+  } else {
+    msg_send(reply_conn, frame);
+  }
+  msg_delete_data(frame);
+  next_frame_at = seconds_now() + frame_gap;
+}
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_request) {
+    test_str_eq(msg_as_str(data), "count");
+    reply_conn = conn;
+    reply_id   = conn->reply_id;
+    send_frame();
+  }
+
+  if (event == msg_message) {
+    test_str_eq(msg_as_str(data), "done");
+    server_done = true;
+  }
+}
+
+int server(int protocol_type) {
+  server_done     = false;
+  num_frames_sent = 0;
+  reply_conn      = NULL;
+
+  char address[256];
+  snprintf(address, 256, "%s://*:%d",
+      protocol_type == msg_udp ? "udp" : "tcp",
+      protocol_type == msg_udp ? udp_port : tcp_port);
+
+  msg_listen(address, server_update);
+  int timeout_in_ms = 5;
+  while (!server_done) {
+    msg_runloop(timeout_in_ms);
+    int is_streaming = (reply_conn && num_frames_sent < num_frames);
+    if (is_streaming && seconds_now() >= next_frame_at) send_frame();
+  }
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_done;
+int num_frames_recd;
+int get_context;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    msg_Data data = msg_new_data("count");
+    test_that(msg_get(conn, data, &get_context));
+    msg_delete_data(data);
+  }
+
+  if (event == msg_reply) {
+    char str[64];
+    snprintf(str, 64, "frame %d", num_frames_recd);
+    test_str_eq(msg_as_str(data), str);
+    test_that(conn->reply_context == &get_context);
+    num_frames_recd++;
+    test_that(msg_reply_has_more(data) == (num_frames_recd < num_frames));
+
+    if (num_frames_recd == num_frames) {
+      msg_Data done = msg_new_data("done");
+      msg_send(conn, done);
+      msg_delete_data(done);
+      client_done = true;
+    }
+  }
+}
+
+int client(int protocol_type, pid_t server_pid) {
+  client_done     = false;
+  num_frames_recd = 0;
+
+  msg_config.compact_headers = true;
+
+  // Sleep for 10ms to give the server time to start.
+  usleep(10000);
+
+  char address[256];
+  snprintf(address, 256, "%s://127.0.0.1:%d",
+      protocol_type == msg_udp ? "udp" : "tcp",
+      protocol_type == msg_udp ? udp_port : tcp_port);
+
+  msg_connect(address, client_update, msg_no_context);
+  int timeout_in_ms = 5;
+  while (!client_done) {
+    msg_runloop(timeout_in_ms);
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (!client_done && waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  // Let the "done" message go out before the connection is closed.
+  msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+int reply_stream_test(int protocol_type) {
+
+  test_printf("Test: Starting %s reply stream test.\n",
+              protocol_type == msg_udp ? "udp" : "tcp");
+
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server(protocol_type));
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(protocol_type, child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int udp_test() { return reply_stream_test(msg_udp); }
+
+int tcp_test() { return reply_stream_test(msg_tcp); }
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  udp_port = rand() % 1024 + 1024;
+  tcp_port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(udp_test, tcp_test);
+  return end_all_tests();
+}
@@ -0,0 +1,274 @@
+// reply_wrap_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for reply ids that wrap around while a msg_get is outstanding.
+//
+
+// This is the basic protocol followed by this client/server setup:
+//
+// Neither side turns on compact headers, so reply ids are 16 bits.
+//
+// c: get "hold", which has reply id 1
+//    s: don't reply yet
+// c: send gets until the other reply ids have all been used, keeping at most
+//    max_pending outstanding
+//    s: reply to each request with its own body
+// c: check that the next get fails, as its reply id would be the held one;
+//    send "release"
+//    s: reply to "hold"
+// c: check the reply's context; get "after"
+//    s: check that "after" reuses reply id 1; reply
+// c: send "done"
+//    s: check the held and largest reply ids
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int tcp_port;
+
+// The gets after the held one use up the rest of the 16-bit reply ids.
+#define num_gets    (UINT16_MAX - 1)
+#define max_pending 500
+
+#define hold_context ((void *)(intptr_t)-1)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int      server_done;
+uint32_t held_reply_id;
+uint32_t max_reply_id;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event != msg_request) {
+    test_printf("Server: Received event %s\n", event_names[event]);
+  }
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_request) {
+    // Leave the first get outstanding until the client asks for its reply.
+    if (strcmp(msg_as_str(data), "hold") == 0) {
+      held_reply_id = conn->reply_id;
+      return;
+    }
+    // The first get after the wraparound reuses the freed reply id.
+    if (strcmp(msg_as_str(data), "after") == 0) {
+      test_that(conn->reply_id == held_reply_id);
+    }
+    if (conn->reply_id > max_reply_id) max_reply_id = conn->reply_id;
+    msg_Data reply = msg_new_data(msg_as_str(data));
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+
+  if (event == msg_message && strcmp(msg_as_str(data), "release") == 0) {
+    conn->reply_id = held_reply_id;
+    msg_Data reply = msg_new_data("hold");
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+    conn->reply_id = 0;
+    return;
+  }
+
+  if (event == msg_message) {
+    test_str_eq(msg_as_str(data), "done");
+    test_printf("Server: The held reply_id was %u; the largest was %u.\n",
+                held_reply_id, max_reply_id);
+    test_that(held_reply_id == 1);
+    test_that(max_reply_id == UINT16_MAX);
+    server_done = true;
+  }
+}
+
+int server() {
+  server_done   = false;
+  held_reply_id = 0;
+  max_reply_id  = 0;
+
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", tcp_port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 1;
+  while (!server_done) msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+msg_Conn *client_conn;
+int       client_done;
+int       num_sent;
+int       num_replied;
+
+static int send_get(const char *str, void *reply_context) {
+  msg_Data data = msg_new_data(str);
+  int was_sent = msg_get(client_conn, data, reply_context);
+  msg_delete_data(data);
+  return was_sent;
+}
+
+// Sends requests until msg_get pushes back. Each request's body and
+// reply_context hold its index.
+static void send_requests() {
+  while (num_sent < num_gets) {
+    char str[64];
+    snprintf(str, 64, "%d", num_sent);
+    if (!send_get(str, (void *)(intptr_t)(num_sent + 1))) break;
+    num_sent++;
+  }
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event != msg_reply) {
+    test_printf("Client: Received event %s\n", event_names[event]);
+  }
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    client_conn = conn;
+    test_that(send_get("hold", hold_context));
+    send_requests();
+  }
+
+  if (event != msg_reply) return;
+
+  if (conn->reply_context == hold_context) {
+    test_str_eq(msg_as_str(data), "hold");
+    test_that(send_get("after", msg_no_context));
+    return;
+  }
+
+  if (strcmp(msg_as_str(data), "after") == 0) {
+    test_that(conn->reply_context == msg_no_context);
+    msg_Data done = msg_new_data("done");
+    msg_send(conn, done);
+    msg_delete_data(done);
+    client_done = true;
+    return;
+  }
+
+  // Tcp keeps the replies in order.
+  test_that(conn->reply_context == (void *)(intptr_t)(num_replied + 1));
+  test_that(atoi(msg_as_str(data)) == num_replied);
+  num_replied++;
+  if (num_replied < num_gets) {
+    send_requests();
+    return;
+  }
+
+  // The reply ids have wrapped around to the held one, which can't be reused
+  // while its get is outstanding.
+  test_that(!send_get("blocked", msg_no_context));
+  msg_Data release = msg_new_data("release");
+  msg_send(conn, release);
+  msg_delete_data(release);
+}
+
+int client(pid_t server_pid) {
+  client_done = false;
+  num_sent    = 0;
+  num_replied = 0;
+  msg_config.max_pending_gets = max_pending;
+
+  // Sleep for 10ms to give the server time to start.
+  usleep(10000);
+
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", tcp_port);
+  msg_connect(address, client_update, msg_no_context);
+
+  int timeout_in_ms = 1;
+  while (!client_done) {
+    msg_runloop(timeout_in_ms);
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (!client_done && waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  // Let the "done" message go out before the connection is closed.
+  msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+int reply_wrap_test() {
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server());
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  tcp_port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(reply_wrap_test);
+  return end_all_tests();
+}
@@ -0,0 +1,168 @@
+// socket_options_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for the socket options of msg_listen_ex and msg_connect_ex, read back
+// from the sockets with getsockopt.
+//
+
+// This test runs the server and the client in one process:
+//
+// s: listen with tcp_nodelay and a recv buffer size
+// c: connect with msg_low_latency_options
+//    s: check the options on the listening socket and on the accepted socket,
+//       which inherits them
+// c: check the options on the connecting socket
+// A udp socket listening with msg_bulk_options has a recv buffer at least as
+// large as one listening without options.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+int tcp_port;
+int udp_port;
+
+#define recv_size (256 << 10)
+
+static int int_option(int sock, int level, int name) {
+  int value = 0;
+  socklen_t len = sizeof(value);
+  test_that(getsockopt(sock, level, name, &value, &len) == 0);
+  return value;
+}
+
+// The kernel may double a requested buffer size for its own bookkeeping.
+static int has_recv_size(int sock) {
+  return int_option(sock, SOL_SOCKET, SO_RCVBUF) >= recv_size;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// tcp
+
+int num_checked;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  // Both the listening and the accepted socket have the server's options.
+  if (event == msg_listening || event == msg_connection_ready) {
+    test_printf("Server: checking the %s socket\n",
+                event == msg_listening ? "listening" : "accepted");
+    test_that(int_option(conn->socket, IPPROTO_TCP, TCP_NODELAY));
+    test_that(has_recv_size(conn->socket));
+    num_checked++;
+  }
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    test_that(int_option(conn->socket, IPPROTO_TCP, TCP_NODELAY));
+    test_that(int_option(conn->socket, IPPROTO_IP, IP_TOS) ==
+              msg_low_latency_options.tos);
+    num_checked++;
+  }
+}
+
+int tcp_test() {
+  num_checked = 0;
+
+  msg_SocketOptions options = { .tcp_nodelay      = true,
+                                .recv_buffer_size = recv_size };
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", tcp_port);
+  msg_listen_ex(address, server_update, &options);
+
+  snprintf(address, 256, "tcp://127.0.0.1:%d", tcp_port);
+  msg_connect_ex(address, client_update, msg_no_context,
+                 &msg_low_latency_options);
+
+  int timeout_in_ms = 5;
+  for (int i = 0; i < 200 && num_checked < 3; ++i) msg_runloop(timeout_in_ms);
+  test_that(num_checked == 3);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// udp
+
+int plain_recv_size;
+int bulk_recv_size;
+
+void plain_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_listening) {
+    plain_recv_size = int_option(conn->socket, SOL_SOCKET, SO_RCVBUF);
+    msg_unlisten(conn);
+  }
+}
+
+void bulk_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_listening) {
+    bulk_recv_size = int_option(conn->socket, SOL_SOCKET, SO_RCVBUF);
+    msg_unlisten(conn);
+  }
+}
+
+int udp_test() {
+  plain_recv_size = bulk_recv_size = 0;
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", udp_port);
+  msg_listen(address, plain_update);
+  snprintf(address, 256, "udp://*:%d", udp_port + 1);
+  msg_listen_ex(address, bulk_update, &msg_bulk_options);
+
+  int timeout_in_ms = 5;
+  for (int i = 0; i < 200 && !(plain_recv_size && bulk_recv_size); ++i) {
+    msg_runloop(timeout_in_ms);
+  }
+  test_printf("udp SO_RCVBUF: plain %d, bulk %d\n",
+              plain_recv_size, bulk_recv_size);
+
+  // The kernel caps buffer sizes at net.core.rmem_max, so only check that the
+  // preset didn't shrink the buffer below the default.
+  test_that(plain_recv_size > 0);
+  test_that(bulk_recv_size >= plain_recv_size);
+
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  tcp_port = rand() % 1024 + 1024;
+  udp_port = rand() % 1024 + 2048;
+
+  start_all_tests(argv[0]);
+  run_tests(tcp_test, udp_test);
+  return end_all_tests();
+}
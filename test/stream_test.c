@@ -0,0 +1,242 @@
+// stream_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for receiving large tcp messages as msg_message_chunk events, and for
+// rejecting messages larger than msg_config.max_message_size.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+int tcp_port;
+
+#define message_size (1 << 20)
+#define chunk_size   (1 << 16)
+#define max_size     1000
+
+static char byte_at(size_t offset) {
+  return (char)(offset * 7 + offset / 251);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// chunk server
+
+int server_done;
+size_t next_offset;
+int num_chunks;
+
+void chunk_server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  // Whole messages arrive as chunks instead of as msg_request events.
+  test_that(event != msg_request && event != msg_message);
+
+  if (event == msg_message_chunk) {
+    num_chunks++;
+    test_that(data.num_bytes <= chunk_size);
+    test_that(msg_message_size(data) == message_size);
+    test_that(msg_chunk_offset(data) == next_offset);
+    for (size_t i = 0; i < data.num_bytes; ++i) {
+      if (data.bytes[i] != byte_at(next_offset + i)) {
+        test_failed("Server: Wrong byte at offset %zd.\n", next_offset + i);
+      }
+    }
+    next_offset += data.num_bytes;
+    test_that(msg_is_last_chunk(data) == (next_offset == message_size));
+
+    // The request's reply_id is available with every chunk.
+    test_that(conn->reply_id != 0);
+
+    if (msg_is_last_chunk(data)) {
+      msg_Data reply = msg_new_data("thanks!");
+      msg_send(conn, reply);
+      msg_delete_data(reply);
+    }
+  }
+
+  if (event == msg_connection_closed) {
+    test_that(next_offset == message_size);
+    test_that(num_chunks == message_size / chunk_size);
+    server_done = true;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// max size server
+
+void max_size_server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_message);
+
+  if (event == msg_connection_lost) server_done = true;
+}
+
+int server(msg_Callback callback) {
+  server_done = false;
+  next_offset = 0;
+  num_chunks  = 0;
+
+  msg_config.stream_chunk_size = chunk_size;
+  msg_config.max_message_size  = (callback == max_size_server_update ?
+                                  max_size : 0);
+
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", tcp_port);
+
+  msg_listen(address, callback);
+  int timeout_in_ms = 10;
+  while (!server_done) msg_runloop(timeout_in_ms);
+
+  // Sleep for 1ms as the client expects to finish before the server.
+  // (Early server termination could be an error, so we check for it.)
+  usleep(1000);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_done;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_connection_ready) {
+    size_t num_bytes = (conn->conn_context ? max_size + 1 : message_size);
+    msg_Data data = msg_new_data_space(num_bytes);
+    for (size_t i = 0; i < num_bytes; ++i) data.bytes[i] = byte_at(i);
+    if (conn->conn_context) {
+      msg_send(conn, data);
+    } else {
+      msg_get(conn, data, NULL);
+    }
+    msg_delete_data(data);
+  }
+
+  if (event == msg_reply) {
+    test_str_eq(msg_as_str(data), "thanks!");
+    msg_disconnect(conn);
+  }
+
+  // The max size server drops the connection.
+  if (event == msg_connection_closed || event == msg_connection_lost) {
+    client_done = true;
+  }
+}
+
+int client(void *conn_context, pid_t server_pid) {
+  client_done = false;
+
+  // Sleep for 1ms to give the server time to start.
+  usleep(1000);
+
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", tcp_port);
+
+  msg_connect(address, client_update, conn_context);
+  int timeout_in_ms = 10;
+  while (!client_done) {
+    msg_runloop(timeout_in_ms);
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (!client_done && waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  return test_success;
+}
+
+int run_server_and_client(msg_Callback server_callback, void *conn_context) {
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server(server_callback));
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(conn_context, child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int chunk_test() {
+  return run_server_and_client(chunk_server_update, NULL);
+}
+
+int max_size_test() {
+  // A non-NULL conn_context tells the client to send an oversized message.
+  static int send_oversized = true;
+  tcp_port++;  // Avoid the TIME_WAIT state left by the previous test.
+  return run_server_and_client(max_size_server_update, &send_oversized);
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // Generate random port numbers to help debugging in the face of bind errors
+  // caused by 'address already in use' (from the internal TIME_WAIT tcp state).
+  srand(time(NULL));
+  tcp_port = rand() % 1024 + 1024;
+
+  start_all_tests(argv[0]);
+  run_tests(chunk_test, max_size_test);
+  return end_all_tests();
+}
@@ -0,0 +1,296 @@
+// unix_socket_test.c
+//
+// Home repo: https://github.com/tylerneylon/msgbox
+//
+// Tests for unix domain sockets, with unix:// and unixgram:// addresses.
+//
+
+// This is the basic protocol followed by this client/server setup:
+//
+// The client opens num_clients connections to the server's path.
+//
+// c: each connection gets "ping <i>"
+//    s: reply with "pong <i>", checking that each unixgram remote has its own
+//       address
+// c: check that each reply has the reply_context of its own get, then
+//    disconnect, which removes each unixgram client's own socket file
+//    s: once every connection is closed, unlisten, which removes the server's
+//       socket file
+//
+// Separately, a unixgram listener rejects a path too long for its clients'
+// paths to fit next to it.
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+// This can be used in cases of emergency debugging.
+#define prline printf("%s:%d(%s)\n", __FILE__, __LINE__, __FUNCTION__)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_chunk",
+  "msg_load_shed"
+};
+
+char socket_path[64];
+
+#define num_clients 2
+
+static const char *prefix_of(int protocol_type) {
+  return protocol_type == msg_udp ? "unixgram" : "unix";
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int       server_done;
+int       num_ready;
+int       num_closed;
+msg_Conn *listening_conn;
+char      ping_addresses[num_clients][128];
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Server: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  if (event == msg_listening) listening_conn = conn;
+
+  if (event == msg_connection_ready) num_ready++;
+
+  if (event == msg_request) {
+    int i;
+    test_that(sscanf(msg_as_str(data), "ping %d", &i) == 1);
+    test_that(0 <= i && i < num_clients);
+    snprintf(ping_addresses[i], 128, "%s", msg_address_str(conn));
+    test_printf("Server: ping %d is from %s\n", i, ping_addresses[i]);
+
+    char str[64];
+    snprintf(str, 64, "pong %d", i);
+    msg_Data reply = msg_new_data(str);
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+
+  if (event == msg_connection_closed) {
+    if (++num_closed == num_clients) msg_unlisten(listening_conn);
+  }
+
+  if (event == msg_listening_ended) server_done = true;
+}
+
+int server(int protocol_type) {
+  server_done = false;
+  num_ready   = 0;
+  num_closed  = 0;
+
+  char address[256];
+  snprintf(address, 256, "%s://%s", prefix_of(protocol_type), socket_path);
+
+  msg_listen(address, server_update);
+  int timeout_in_ms = 5;
+  while (!server_done) msg_runloop(timeout_in_ms);
+
+  test_that(num_ready == num_clients);
+  test_that(access(socket_path, F_OK) == -1);
+
+  // Unixgram remotes are told apart by their own paths, below the server's.
+  if (protocol_type == msg_udp) {
+    char listen_prefix[sizeof(address) + 1];
+    snprintf(listen_prefix, sizeof(listen_prefix), "%s.", address);
+    for (int i = 0; i < num_clients; ++i) {
+      test_that(strncmp(ping_addresses[i], listen_prefix,
+                        strlen(listen_prefix)) == 0);
+    }
+    test_that(strcmp(ping_addresses[0], ping_addresses[1]) != 0);
+  } else {
+    test_str_eq(ping_addresses[0], address);
+  }
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_done;
+int num_replies;
+int get_contexts[num_clients];
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) test_printf("Client: Error: %s\n", msg_as_str(data));
+  test_that(event != msg_error);
+
+  int i = (int)(intptr_t)conn->conn_context;
+
+  if (event == msg_connection_ready) {
+    char str[64];
+    snprintf(str, 64, "ping %d", i);
+    msg_Data data = msg_new_data(str);
+    test_that(msg_get(conn, data, &get_contexts[i]));
+    msg_delete_data(data);
+  }
+
+  if (event == msg_reply) {
+    char str[64];
+    snprintf(str, 64, "pong %d", i);
+    test_str_eq(msg_as_str(data), str);
+    test_that(conn->reply_context == &get_contexts[i]);
+    msg_disconnect(conn);
+    if (++num_replies == num_clients) client_done = true;
+  }
+}
+
+int client(int protocol_type, pid_t server_pid) {
+  client_done = false;
+  num_replies = 0;
+
+  // Sleep for 10ms to give the server time to start.
+  usleep(10000);
+
+  char address[256];
+  snprintf(address, 256, "%s://%s", prefix_of(protocol_type), socket_path);
+
+  for (int i = 0; i < num_clients; ++i) {
+    msg_connect(address, client_update, (void *)(intptr_t)i);
+  }
+  int timeout_in_ms = 5;
+  while (!client_done) {
+    msg_runloop(timeout_in_ms);
+
+    // Check to see if the server process ended before we expected it to.
+    int status;
+    if (!client_done && waitpid(server_pid, &status, WNOHANG)) {
+      test_failed("Client: Server process ended before client expected.");
+    }
+  }
+
+  // Unixgram clients are bound to paths counted from 1 in each process.
+  if (protocol_type == msg_udp) {
+    for (int i = 1; i <= num_clients; ++i) {
+      char client_path[128];
+      snprintf(client_path, 128, "%s.%d.%d", socket_path, getpid(), i);
+      test_that(access(client_path, F_OK) == -1);
+    }
+  }
+
+  return test_success;
+}
+
+int unix_socket_test(int protocol_type) {
+
+  test_printf("Test: Starting %s socket test.\n", prefix_of(protocol_type));
+
+  pid_t child_pid = fork();
+  if (child_pid == -1) return test_failure;
+
+  if (child_pid == 0) {
+    // Child process.
+    exit(server(protocol_type));
+  } else {
+    // Parent process.
+    test_printf("Client pid=%d  server pid=%d\n", getpid(), child_pid);
+    int client_failed = client(protocol_type, child_pid);
+    int server_status;
+    wait(&server_status);
+    int server_failed = WEXITSTATUS(server_status);
+
+    test_printf("Test: client_failed=%d server_failed=%d.\n",
+                client_failed, server_failed);
+
+    return client_failed || server_failed;
+  }
+}
+
+int unix_test() { return unix_socket_test(msg_tcp); }
+
+int unixgram_test() { return unix_socket_test(msg_udp); }
+
+int num_path_errors;
+int num_listening;
+
+void path_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Path: Received event %s\n", event_names[event]);
+  if (event == msg_error) {
+    test_printf("Path: Error: %s\n", msg_as_str(data));
+    num_path_errors++;
+  }
+  if (event == msg_listening) {
+    num_listening++;
+    msg_unlisten(conn);
+  }
+}
+
+// Listens on a unixgram path of the given length, and returns after the
+// resulting events.
+static void listen_on_path_of_len(size_t path_len) {
+  char path[sizeof(((struct sockaddr_un *)NULL)->sun_path) + 1];
+  int  prefix_len = snprintf(path, sizeof(path), "%s.", socket_path);
+  memset(path + prefix_len, 'p', path_len - prefix_len);
+  path[path_len] = '\0';
+
+  char address[256];
+  snprintf(address, 256, "unixgram://%s", path);
+  msg_listen(address, path_update);
+  for (int i = 0; i < 10; ++i) msg_runloop(5);
+}
+
+// A unixgram client binds to its listener's path plus ".<pid>.<n>", at most 15
+// bytes, so the listener's path leaves room for that.
+int unixgram_path_len_test() {
+  size_t max_len = sizeof(((struct sockaddr_un *)NULL)->sun_path) - 1 - 15;
+  num_path_errors = 0;
+  num_listening   = 0;
+
+  listen_on_path_of_len(max_len + 1);
+  test_that(num_path_errors == 1);
+  test_that(num_listening == 0);
+
+  listen_on_path_of_len(max_len);
+  test_that(num_path_errors == 1);
+  test_that(num_listening == 1);
+
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  // A path of our own keeps concurrent runs of this test apart.
+  snprintf(socket_path, 64, "/tmp/msgbox_unix_test.%d", getpid());
+
+  start_all_tests(argv[0]);
+  run_tests(unix_test, unixgram_test, unixgram_path_len_test);
+  return end_all_tests();
+}